@@ -0,0 +1,137 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal ingress admission logic.
+ *
+ * Every type of command coming from the controller has its own token bucket,
+ * and the commands waiting to be performed by the scheduler are bounded. What
+ * does not fit is rejected before becoming a job, so that a flood of commands
+ * costs to the eNB only the time to read and decode it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <emlog.h>
+#include <emage/emproto.h>
+
+#include "admit.h"
+#include "agent.h"
+#include "net.h"
+
+/* Is the message a command which costs a job to the agent? */
+int admit_is_command(struct net_msg * m)
+{
+	switch(m->type) {
+	case EP_TYPE_SINGLE_MSG:
+		return m->dir == EP_DIR_REQUEST && m->act != EP_ACT_HELLO;
+	case EP_TYPE_TRIGGER_MSG:
+		return m->op == EP_OPERATION_ADD && m->act != EP_ACT_HELLO;
+	}
+
+	return 0;
+}
+
+int admit_msg(
+	struct admit_context * ac, struct net_msg * m, unsigned int commands)
+{
+	struct admit_class * c = 0;
+	struct timespec      now;
+
+	int found = 0;
+
+	if(!admit_is_command(m)) {
+		return 1;
+	}
+
+	if(ac->queue && commands >= ac->queue) {
+		EMDBG("Command rejected, queue full, type=%d, act=%d",
+			m->type, m->act);
+
+		ac->rejected++;
+		return 0;
+	}
+
+	if(!ac->rate) {
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	list_for_each_entry(c, &ac->cs, next) {
+		if(c->type == m->type && c->act == m->act) {
+			found = 1;
+			break;
+		}
+	}
+
+	if(!found) {
+		c = mem_alloc(
+			agent_mem(ac, admit),
+			EM_MEM_OTHER,
+			sizeof(struct admit_class));
+
+		if(!c) {
+			EMLOG("No more memory!");
+			return 1;
+		}
+
+		memset(c, 0, sizeof(struct admit_class));
+
+		INIT_LIST_HEAD(&c->next);
+		c->type = m->type;
+		c->act  = m->act;
+
+		rate_setup(&c->b, ac->rate, ac->burst, &now);
+
+		list_add(&c->next, &ac->cs);
+	}
+
+	if(!rate_has_token(&c->b, &now)) {
+		EMDBG("Command rejected, over budget, type=%d, act=%d",
+			m->type, m->act);
+
+		ac->rejected++;
+		return 0;
+	}
+
+	rate_take_token(&c->b);
+
+	return 1;
+}
+
+int admit_init(
+	struct admit_context * ac,
+	unsigned int rate,
+	unsigned int burst,
+	unsigned int queue)
+{
+	memset(ac, 0, sizeof(struct admit_context));
+
+	INIT_LIST_HEAD(&ac->cs);
+	ac->rate  = rate;
+	ac->burst = burst;
+	ac->queue = queue;
+
+	return 0;
+}
+
+int admit_release(struct admit_context * ac)
+{
+	INIT_LIST_HEAD(&ac->cs);
+
+	return 0;
+}
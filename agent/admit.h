@@ -0,0 +1,81 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal ingress admission logic.
+ */
+
+#ifndef __EMAGE_ADMIT_H
+#define __EMAGE_ADMIT_H
+
+#include <stdint.h>
+
+#include "emlist.h"
+#include "rate.h"
+
+struct net_msg;
+
+/* Commands of a single type. */
+struct admit_class {
+	/* Member of a list. */
+	struct list_head next;
+
+	/* Message type and action of the commands. */
+	int type;
+	int act;
+
+	/* Budget of this type of commands. */
+	struct rate_bucket b;
+};
+
+/* Ingress admission context for an agent; used by the network thread only. */
+struct admit_context {
+	/* Types of commands received. */
+	struct list_head cs;
+
+	/* Commands per second allowed for every type; 0 means unlimited. */
+	unsigned int rate;
+	unsigned int burst;
+	/* Maximum number of commands waiting to be performed; 0 means
+	 * unlimited.
+	 */
+	unsigned int queue;
+
+	/* Commands rejected. */
+	uint64_t rejected;
+	/* Duplicate commands merged with one still waiting. */
+	uint64_t coalesced;
+};
+
+/* Check if a command from the controller can be accepted, given its budget and
+ * the number of commands already waiting. Messages which are not commands, like
+ * the Hello replies or the removal of triggers, are always accepted.
+ *
+ * Returns 1 if the command can be accepted, 0 if it has to be rejected.
+ */
+int admit_msg(
+	struct admit_context * ac, struct net_msg * m, unsigned int commands);
+
+/* Initialize an ingress admission context. */
+int admit_init(
+	struct admit_context * ac,
+	unsigned int rate,
+	unsigned int burst,
+	unsigned int queue);
+
+/* Release the resources of an ingress admission context. */
+int admit_release(struct admit_context * ac);
+
+#endif /* __EMAGE_ADMIT_H */
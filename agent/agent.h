@@ -20,12 +20,41 @@
 #ifndef __EMAGE_AGENT_H
 #define __EMAGE_AGENT_H
 
+#include <emage.h>
+
+#include "admit.h"
+#include "aggr.h"
+#include "backlog.h"
+#include "cond.h"
+#include "delta.h"
 #include "emlist.h"
+#include "meas.h"
+#include "mem.h"
 #include "net.h"
+#include "rate.h"
 #include "sched.h"
+#include "sess.h"
+#include "shm.h"
+#include "stats.h"
+#include "trace.h"
 #include "triggers.h"
 
-struct em_agent_ops;
+/* Call an operation of the wrapper, tracing and timing it; the result of the
+ * operation is the value of the expression.
+ */
+#define agent_op(a, id, call)                                           \
+	({                                                              \
+		int             __ret;                                  \
+		struct timespec __start;                                \
+		agent_op_begin(a, id, &__start);                        \
+		__ret = (a)->ops->call;                                 \
+		agent_op_end(a, id, &__start);                          \
+		__ret;                                                  \
+	})
+
+/* Memory of the agent which embeds a context as the given member. */
+#define agent_mem(ctx, member)                                          \
+	(&container_of(ctx, struct agent, member)->mem)
 
 /* This is ultimately an agent. */
 struct agent {
@@ -37,9 +66,35 @@ struct agent {
 
 	/* Registered, technology dependant, operations. */
 	struct em_agent_ops * ops;
+	/* Tuning of this agent. */
+	struct em_agent_conf conf;
+	/* Memory accounting of this agent. */
+	struct mem_context mem;
 
 	/* Triggering context for this agent.*/
 	struct tr_context trig;
+	/* Reports aggregation context for this agent. */
+	struct aggr_context aggr;
+	/* Delta reporting context for this agent. */
+	struct delta_context delta;
+	/* Measurements reduction context for this agent. */
+	struct meas_context meas;
+	/* Triggers conditions context for this agent. */
+	struct cond_context cond;
+	/* Egress rate limiting context for this agent. */
+	struct rate_context rate;
+	/* Ingress admission context for this agent. */
+	struct admit_context admit;
+	/* Outbound backlog context for this agent. */
+	struct backlog_context backlog;
+	/* Report sessions context for this agent. */
+	struct sess_context sess;
+	/* Runtime metrics context for this agent. */
+	struct stats_context stats;
+	/* Shared memory metrics context for this agent. */
+	struct shm_context shm;
+	/* Tracing context for this agent. */
+	struct trace_context trace;
 
 	/* Network operation context for this agent. */
 	struct net_context net;
@@ -47,4 +102,35 @@ struct agent {
 	struct sched_context sched;
 };
 
+/* Schedule the send of a report, and of its copies for the modules which share
+ * the trigger that generated it. The trigger is 'tid' if known, otherwise it is
+ * told from the header of the report, when possible.
+ *
+ * Returns 0 on success, otherwise a negative error number.
+ */
+int add_report_jobs(struct agent * a, int tid, char * msg, unsigned int size);
+
+/* Give the controller the reconnection grace time to confirm the triggers
+ * kept across a disconnection; any previous deadline is replaced.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int add_resync_job(struct agent * a);
+
+/* Publish the metrics of the agent in its shared memory segment, if any, at
+ * the configured interval.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int add_publish_job(struct agent * a);
+
+/* Mark the start of an operation of the wrapper; see 'agent_op'. */
+void agent_op_begin(struct agent * a, int id, struct timespec * start);
+
+/* Account the time spent in an operation of the wrapper; see 'agent_op'. */
+void agent_op_end(struct agent * a, int id, struct timespec * start);
+
+/* Collect the gauges and counters of an agent into the user metrics. */
+void em_agent_stats(struct agent * a, struct em_stats * st);
+
 #endif /* __EMAGE_AGENT_H */
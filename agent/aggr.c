@@ -0,0 +1,206 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal reports aggregation logic.
+ *
+ * Reports sent by the wrapper for the same trigger within a short time are
+ * collected in a batch, which leaves the agent with a single transmission once
+ * its time is over or it is full. Each report keeps its own header, so the
+ * controller sees exactly the same messages.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <emlog.h>
+#include <emage/emproto.h>
+
+#include "agent.h"
+#include "aggr.h"
+
+/* Schedule the send of a batch. */
+static int aggr_sched(struct agent * a, unsigned int id, int elapse)
+{
+	struct sched_job * job =
+		mem_alloc(&a->mem, EM_MEM_JOBS, sizeof(struct sched_job));
+
+	if(!job) {
+		EMLOG("No more memory!");
+		return -1;
+	}
+
+	memset(job, 0, sizeof(struct sched_job));
+
+	INIT_LIST_HEAD(&job->next);
+	job->id         = id;
+	job->type       = JOB_TYPE_AGGR;
+	job->elapse     = elapse;
+	job->reschedule = 0;
+
+	if(sched_add_job(job, &a->sched)) {
+		mem_free(job);
+		return -1;
+	}
+
+	return 0;
+}
+
+int aggr_wants(struct aggr_context * ac, char * msg, unsigned int size)
+{
+	return ac->time > 0 &&
+		size <= ac->size &&
+		epp_msg_type(msg, size) == EP_TYPE_TRIGGER_MSG;
+}
+
+int aggr_add(struct agent * a, char * msg, unsigned int size)
+{
+	struct aggr_context * ac = &a->aggr;
+	struct aggr_batch *   b  = 0;
+	struct aggr_batch *   n  = 0;
+
+	uint32_t mod = 0;
+	int      act = epp_trigger_type(msg, size);
+	int      found = 0;
+	unsigned int full = 0;	/* Batch to send now. */
+	unsigned int nid  = 0;	/* Batch just opened. */
+
+	if(epp_head(msg, size, 0, 0, 0, &mod)) {
+		return -1;
+	}
+
+	lock_take(&ac->lock);
+	list_for_each_entry(b, &ac->bs, next) {
+		if(b->open && b->mod == mod && b->act == act) {
+			found = 1;
+			break;
+		}
+	}
+
+	/* No more room: close it and let it leave now. */
+	if(found && b->len + size > ac->size) {
+		b->open = 0;
+		full    = b->id;
+		found   = 0;
+	}
+
+	if(!found) {
+		n = mem_alloc(
+			&a->mem,
+			EM_MEM_BUFFERS,
+			sizeof(struct aggr_batch) + ac->size);
+
+		if(!n) {
+			lock_drop(&ac->lock);
+			EMLOG("No more memory!");
+
+			if(full) {
+				aggr_sched(a, full, 1);
+			}
+
+			return -1;
+		}
+
+		memset(n, 0, sizeof(struct aggr_batch));
+
+		INIT_LIST_HEAD(&n->next);
+		n->id   = ac->next++;
+		n->mod  = mod;
+		n->act  = act;
+		n->open = 1;
+
+		list_add_tail(&n->next, &ac->bs);
+
+		nid = n->id;
+		b   = n;
+	}
+
+	memcpy(b->buf + b->len, msg, size);
+	b->len += size;
+	lock_drop(&ac->lock);
+
+	/* Jobs are added out of the aggregation lock. */
+	if(full) {
+		aggr_sched(a, full, 1);
+	}
+
+	if(nid && aggr_sched(a, nid, ac->time)) {
+		b = aggr_take(ac, nid);
+		mem_free(b);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+struct aggr_batch * aggr_take(struct aggr_context * ac, unsigned int id)
+{
+	struct aggr_batch * b = 0;
+	int found = 0;
+
+	lock_take(&ac->lock);
+	list_for_each_entry(b, &ac->bs, next) {
+		if(b->id == id) {
+			list_del(&b->next);
+			found = 1;
+			break;
+		}
+	}
+	lock_drop(&ac->lock);
+
+	if(!found) {
+		return 0;
+	}
+
+	return b;
+}
+
+int aggr_flush(struct aggr_context * ac)
+{
+	struct aggr_batch * b = 0;
+	struct aggr_batch * c = 0;
+
+	lock_take(&ac->lock);
+	list_for_each_entry_safe(b, c, &ac->bs, next) {
+		list_del(&b->next);
+		mem_free(b);
+	}
+	lock_drop(&ac->lock);
+
+	return 0;
+}
+
+int aggr_init(struct aggr_context * ac, unsigned int time, unsigned int size)
+{
+	INIT_LIST_HEAD(&ac->bs);
+
+	ac->next = 1;
+	ac->time = time;
+	ac->size = size ? size : AGGR_DEF_SIZE;
+
+	lock_init(&ac->lock);
+
+	return 0;
+}
+
+int aggr_release(struct aggr_context * ac)
+{
+	lock_destroy(&ac->lock);
+
+	return 0;
+}
@@ -0,0 +1,95 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal reports aggregation logic.
+ */
+
+#ifndef __EMAGE_AGGR_H
+#define __EMAGE_AGGR_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emlist.h"
+#include "lock.h"
+
+/* Default maximum size of a batch, in bytes. */
+#define AGGR_DEF_SIZE			16384
+
+struct agent;
+
+/* Reports of the same trigger which will be sent together. */
+struct aggr_batch {
+	/* Member of a list. */
+	struct list_head next;
+
+	/* Id of this batch. */
+	unsigned int id;
+	/* Module which the reports are directed to. */
+	uint32_t mod;
+	/* Action of the reports. */
+	int act;
+	/* A value different than 0 means the batch still accepts reports. */
+	int open;
+
+	/* Bytes used in the buffer. */
+	unsigned int len;
+	/* Reports, one after the other. */
+	char buf[];
+};
+
+/* Aggregation context for an agent. */
+struct aggr_context {
+	/* Batches waiting to be sent. */
+	struct list_head bs;
+
+	/* Id for the next batch. */
+	unsigned int next;
+
+	/* Time, in ms, a report can wait in a batch; 0 disables aggregation. */
+	unsigned int time;
+	/* Maximum size, in bytes, of a batch. */
+	unsigned int size;
+
+	/* Lock for this context. */
+	lock_t lock;
+};
+
+/* Check if a message will be aggregated. */
+int aggr_wants(struct aggr_context * ac, char * msg, unsigned int size);
+
+/* Add a report to the batch of its trigger, opening a new one if needed.
+ *
+ * Returns 0 on success, otherwise a negative error number.
+ */
+int aggr_add(struct agent * a, char * msg, unsigned int size);
+
+/* Detach a batch from the context; the caller must free it.
+ *
+ * Returns the batch, or a null pointer if it has already been taken.
+ */
+struct aggr_batch * aggr_take(struct aggr_context * ac, unsigned int id);
+
+/* Drop every batch still waiting in the context. */
+int aggr_flush(struct aggr_context * ac);
+
+/* Initialize an aggregation context. */
+int aggr_init(struct aggr_context * ac, unsigned int time, unsigned int size);
+
+/* Release the resources of an aggregation context. */
+int aggr_release(struct aggr_context * ac);
+
+#endif /* __EMAGE_AGGR_H */
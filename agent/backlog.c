@@ -0,0 +1,384 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal outbound backlog logic.
+ *
+ * Messages which cannot be sent because the controller is not there are kept
+ * in a ring in memory and, once it is full, in a second ring mapped on a file,
+ * so that long outages do not grow the heap. To keep the order, new messages
+ * go to the file as long as it holds something. Every message carries the time
+ * it has been kept, and the ones too old are dropped instead of being replayed.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <emlog.h>
+
+#include "agent.h"
+#include "backlog.h"
+
+/* Marks the end of the used part of a ring */
+#define BACKLOG_WRAP                            0xffffffff
+
+/* Size of a message in a ring, header included */
+#define backlog_need(len)                       \
+	((sizeof(struct backlog_rec) + (len) + 7) & ~7U)
+
+/* Header of a message in a ring. */
+struct backlog_rec {
+	/* Size of the message. */
+	uint32_t len;
+	uint32_t pad;
+	/* Time the message has been kept, in ms. */
+	uint64_t time;
+};
+
+uint64_t backlog_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/******************************************************************************
+ * Rings                                                                      *
+ ******************************************************************************/
+
+struct backlog_rec * ring_first(struct backlog_ring * r)
+{
+	struct backlog_rec * m;
+
+	if(!r->count) {
+		return 0;
+	}
+
+	/* The writer went back to the start of the ring? */
+	if(r->size - r->head < sizeof(struct backlog_rec)) {
+		r->head = 0;
+	} else {
+		m = (struct backlog_rec *)(r->buf + r->head);
+
+		if(m->len == BACKLOG_WRAP) {
+			r->head = 0;
+		}
+	}
+
+	return (struct backlog_rec *)(r->buf + r->head);
+}
+
+void ring_drop(struct backlog_ring * r)
+{
+	struct backlog_rec * m = ring_first(r);
+
+	if(!m) {
+		return;
+	}
+
+	r->head += backlog_need(m->len);
+	r->count--;
+
+	if(!r->count) {
+		r->head = 0;
+		r->tail = 0;
+	}
+}
+
+int ring_put(
+	struct backlog_ring * r, char * msg, unsigned int size, uint64_t now)
+{
+	struct backlog_rec * m;
+
+	unsigned int need = backlog_need(size);
+	unsigned int off;
+
+	if(need > r->size) {
+		return -1;
+	}
+
+	/* Free space between the last message and the oldest one. */
+	if(r->count && r->tail <= r->head) {
+		if(r->tail + need > r->head) {
+			return -1;
+		}
+
+		off = r->tail;
+	}
+	/* Free space at the end, and maybe at the start, of the ring. */
+	else {
+		if(r->tail + need <= r->size) {
+			off = r->tail;
+		} else if(need <= r->head) {
+			if(r->size - r->tail >= sizeof(struct backlog_rec)) {
+				m = (struct backlog_rec *)(r->buf + r->tail);
+				m->len = BACKLOG_WRAP;
+			}
+
+			off = 0;
+		} else {
+			return -1;
+		}
+	}
+
+	m = (struct backlog_rec *)(r->buf + off);
+	m->len  = size;
+	m->time = now;
+	memcpy(m + 1, msg, size);
+
+	r->tail = off + need;
+	r->count++;
+
+	return 0;
+}
+
+/******************************************************************************
+ * Public API                                                                 *
+ ******************************************************************************/
+
+int backlog_push(struct backlog_context * bc, char * msg, unsigned int size)
+{
+	struct backlog_rec * m;
+
+	uint64_t now = backlog_now();
+	int      status = -1;
+
+	if(!bc->mem.size) {
+		return -1;
+	}
+
+	lock_take(&bc->lock);
+
+	/* Would not fit even with the backlog empty. */
+	if(backlog_need(size) > bc->mem.size &&
+		backlog_need(size) > bc->spill.size) {
+
+		bc->dropped++;
+		lock_drop(&bc->lock);
+
+		return -1;
+	}
+
+	while(1) {
+		if(!bc->spill.count && !ring_put(&bc->mem, msg, size, now)) {
+			status = 0;
+			break;
+		}
+
+		if(bc->spill.size && !ring_put(&bc->spill, msg, size, now)) {
+			bc->spilled++;
+			status = 0;
+			break;
+		}
+
+		/* Drop the new message, or the oldest one and try again. */
+		bc->dropped++;
+
+		if(!bc->drop_oldest || (!bc->mem.count && !bc->spill.count)) {
+			break;
+		}
+
+		if(!bc->mem.count) {
+			ring_drop(&bc->spill);
+			continue;
+		}
+
+		ring_drop(&bc->mem);
+
+		/* Keep the order: the oldest spilled message takes the room
+		 * left in memory, and makes room in the spill file.
+		 */
+		if(bc->spill.count) {
+			m = ring_first(&bc->spill);
+
+			if(!ring_put(&bc->mem, (char *)(m + 1), m->len, m->time)) {
+				ring_drop(&bc->spill);
+			}
+		}
+	}
+
+	if(bc->mem.count + bc->spill.count > bc->peak) {
+		bc->peak = bc->mem.count + bc->spill.count;
+	}
+	lock_drop(&bc->lock);
+
+	return status;
+}
+
+unsigned int backlog_peek(struct backlog_context * bc, char ** msg)
+{
+	struct backlog_ring * r;
+	struct backlog_rec *  m   = 0;
+	uint64_t              now = backlog_now();
+
+	lock_take(&bc->lock);
+	while(1) {
+		r = bc->mem.count ? &bc->mem : &bc->spill;
+		m = ring_first(r);
+
+		if(!m || !bc->age || now - m->time <= bc->age) {
+			break;
+		}
+
+		ring_drop(r);
+		bc->expired++;
+	}
+	lock_drop(&bc->lock);
+
+	if(!m) {
+		return 0;
+	}
+
+	*msg = (char *)(m + 1);
+
+	return m->len;
+}
+
+int backlog_pop(struct backlog_context * bc)
+{
+	lock_take(&bc->lock);
+	if(bc->mem.count) {
+		ring_drop(&bc->mem);
+	} else {
+		ring_drop(&bc->spill);
+	}
+	lock_drop(&bc->lock);
+
+	return 0;
+}
+
+int backlog_empty(struct backlog_context * bc)
+{
+	int empty;
+
+	lock_take(&bc->lock);
+	empty = !bc->mem.count && !bc->spill.count;
+	lock_drop(&bc->lock);
+
+	return empty;
+}
+
+/* Map the spill ring on its file. */
+int backlog_map(struct backlog_context * bc, unsigned int size)
+{
+	struct backlog_ring * r = &bc->spill;
+
+	r->fd = open(bc->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+	if(r->fd < 0) {
+		EMLOG("Cannot open spill file %s", bc->path);
+		return -1;
+	}
+
+	if(ftruncate(r->fd, size)) {
+		EMLOG("Cannot size spill file %s", bc->path);
+		goto err;
+	}
+
+	r->buf = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+
+	if(r->buf == MAP_FAILED) {
+		EMLOG("Cannot map spill file %s", bc->path);
+		r->buf = 0;
+		goto err;
+	}
+
+	r->size = size;
+
+	return 0;
+
+err:
+	close(r->fd);
+	unlink(bc->path);
+	r->fd = -1;
+
+	return -1;
+}
+
+int backlog_init(
+	struct backlog_context * bc,
+	unsigned int size,
+	const char * path,
+	unsigned int spill,
+	int drop_oldest,
+	unsigned int age)
+{
+	memset(bc, 0, sizeof(struct backlog_context));
+
+	bc->mem.fd      = -1;
+	bc->spill.fd    = -1;
+	bc->drop_oldest = drop_oldest;
+	bc->age         = age;
+
+	lock_init(&bc->lock);
+
+	/* Sizes multiple of the alignment of the messages. */
+	size  &= ~7U;
+	spill &= ~7U;
+
+	if(!size) {
+		return 0;
+	}
+
+	bc->mem.buf = mem_alloc(agent_mem(bc, backlog), EM_MEM_BUFFERS, size);
+
+	if(!bc->mem.buf) {
+		EMLOG("No more memory!");
+		return -1;
+	}
+
+	bc->mem.size = size;
+
+	if(!path || !spill) {
+		return 0;
+	}
+
+	bc->path = mem_strdup(agent_mem(bc, backlog), EM_MEM_OTHER, path);
+
+	if(!bc->path) {
+		EMLOG("No more memory!");
+		return -1;
+	}
+
+	/* Go on without the spill file. */
+	backlog_map(bc, spill);
+
+	return 0;
+}
+
+int backlog_release(struct backlog_context * bc)
+{
+	if(bc->spill.buf) {
+		munmap(bc->spill.buf, bc->spill.size);
+	}
+
+	if(bc->spill.fd >= 0) {
+		close(bc->spill.fd);
+		unlink(bc->path);
+	}
+
+	lock_destroy(&bc->lock);
+
+	memset(bc, 0, sizeof(struct backlog_context));
+
+	return 0;
+}
@@ -0,0 +1,109 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal outbound backlog logic.
+ */
+
+#ifndef __EMAGE_BACKLOG_H
+#define __EMAGE_BACKLOG_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "lock.h"
+
+/* Ring of messages, kept one after the other. */
+struct backlog_ring {
+	/* Memory of the ring, and its size in bytes. */
+	char * buf;
+	unsigned int size;
+
+	/* Offset of the oldest message, and of the next one to add. */
+	unsigned int head;
+	unsigned int tail;
+	/* Number of messages in the ring. */
+	unsigned int count;
+
+	/* File backing the memory, if any. */
+	int fd;
+};
+
+/* Backlog of the messages to send once connected again. */
+struct backlog_context {
+	/* Messages kept in memory. */
+	struct backlog_ring mem;
+	/* Messages which did not fit in memory, kept in a mapped file. */
+	struct backlog_ring spill;
+	/* Path of the spill file. */
+	char * path;
+
+	/* Drop the oldest message rather than the new one when full. */
+	int drop_oldest;
+	/* Maximum age, in ms, of the messages replayed; 0 means no limit. */
+	unsigned int age;
+
+	/* Messages dropped because the backlog was full. */
+	uint64_t dropped;
+	/* Messages dropped because too old. */
+	uint64_t expired;
+	/* Messages which went into the spill file. */
+	uint64_t spilled;
+	/* Most messages kept at once. */
+	unsigned int peak;
+
+	/* Lock for this context. */
+	lock_t lock;
+};
+
+/* Keep a message, or a batch of messages, to be sent later.
+ *
+ * Returns 0 on success, a negative error code if the message has been dropped.
+ */
+int backlog_push(struct backlog_context * bc, char * msg, unsigned int size);
+
+/* Look at the oldest message kept which is still young enough, dropping the
+ * expired ones. The message remains valid until it is popped, and only the
+ * thread which pushes messages can look at them.
+ *
+ * Returns the size of the message, or 0 if the backlog is empty.
+ */
+unsigned int backlog_peek(struct backlog_context * bc, char ** msg);
+
+/* Drop the oldest message kept. */
+int backlog_pop(struct backlog_context * bc);
+
+/* Check if there are messages kept. */
+int backlog_empty(struct backlog_context * bc);
+
+/* Initialize a backlog context; a size of 0 disables the backlog, and a spill
+ * size of 0 or a null path disables the spill file.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int backlog_init(
+	struct backlog_context * bc,
+	unsigned int size,
+	const char * path,
+	unsigned int spill,
+	int drop_oldest,
+	unsigned int age);
+
+/* Release the resources of a backlog context, removing the spill file; its
+ * memory goes away with the one of the agent.
+ */
+int backlog_release(struct backlog_context * bc);
+
+#endif /* __EMAGE_BACKLOG_H */
@@ -0,0 +1,217 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal triggers conditions logic.
+ *
+ * A condition holds once the samples stay beyond its threshold for the
+ * requested number of consecutive times, and it is released only when they
+ * come back by more than the hysteresis for the same number of times.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <emlog.h>
+
+#include "agent.h"
+#include "cond.h"
+
+static void cond_free(struct cond * c)
+{
+	struct cond_state * s = 0;
+	struct cond_state * t = 0;
+
+	list_for_each_entry_safe(s, t, &c->ss, next) {
+		list_del(&s->next);
+		mem_free(s);
+	}
+
+	mem_free(c);
+}
+
+int cond_set(struct cond_context * cc, int tid, struct em_cond * c)
+{
+	struct cond * n = mem_alloc(
+		agent_mem(cc, cond), EM_MEM_TRIGGERS, sizeof(struct cond));
+
+	if(!n) {
+		EMLOG("No more memory!");
+		return -1;
+	}
+
+	memset(n, 0, sizeof(struct cond));
+
+	INIT_LIST_HEAD(&n->next);
+	INIT_LIST_HEAD(&n->ss);
+	n->tid = tid;
+	n->c   = *c;
+
+	if(!n->c.count) {
+		n->c.count = 1;
+	}
+
+	cond_del(cc, tid);
+
+	lock_take(&cc->lock);
+	list_add(&n->next, &cc->cs);
+	lock_drop(&cc->lock);
+
+	return 0;
+}
+
+int cond_del(struct cond_context * cc, int tid)
+{
+	struct cond * c = 0;
+	struct cond * d = 0;
+
+	lock_take(&cc->lock);
+	list_for_each_entry_safe(c, d, &cc->cs, next) {
+		if(tid && c->tid != tid) {
+			continue;
+		}
+
+		list_del(&c->next);
+		cond_free(c);
+	}
+	lock_drop(&cc->lock);
+
+	return 0;
+}
+
+int cond_sample(
+	struct cond_context * cc,
+	int tid, int metric, uint16_t rnti, int32_t value)
+{
+	struct cond *       c = 0;
+	struct cond_state * s = 0;
+
+	int found = 0;
+	int push  = 0;
+	int ret   = COND_NONE;
+
+	lock_take(&cc->lock);
+	list_for_each_entry(c, &cc->cs, next) {
+		if(c->tid == tid && c->c.metric == metric) {
+			found = 1;
+			break;
+		}
+	}
+
+	if(!found) {
+		lock_drop(&cc->lock);
+		return COND_NONE;
+	}
+
+	found = 0;
+
+	list_for_each_entry(s, &c->ss, next) {
+		if(s->rnti == rnti) {
+			found = 1;
+			break;
+		}
+	}
+
+	if(!found) {
+		s = mem_alloc(
+			agent_mem(cc, cond),
+			EM_MEM_TRIGGERS,
+			sizeof(struct cond_state));
+
+		if(!s) {
+			lock_drop(&cc->lock);
+			EMLOG("No more memory!");
+			return COND_NONE;
+		}
+
+		memset(s, 0, sizeof(struct cond_state));
+
+		INIT_LIST_HEAD(&s->next);
+		s->rnti = rnti;
+
+		list_add(&s->next, &c->ss);
+	}
+
+	/* Does the sample push toward the other state? */
+	if(!s->active) {
+		push = c->c.op == EM_COND_BELOW ?
+			value < c->c.threshold :
+			value > c->c.threshold;
+	} else {
+		push = c->c.op == EM_COND_BELOW ?
+			value > c->c.threshold + c->c.hysteresis :
+			value < c->c.threshold - c->c.hysteresis;
+	}
+
+	s->run = push ? s->run + 1 : 0;
+
+	if(s->run >= c->c.count) {
+		s->active = !s->active;
+		s->run    = 0;
+
+		ret = s->active ? COND_ENTERED : COND_LEFT;
+	}
+	lock_drop(&cc->lock);
+
+	return ret;
+}
+
+int cond_pass(struct cond_context * cc, int tid)
+{
+	struct cond *       c = 0;
+	struct cond_state * s = 0;
+
+	int found = 0;
+	int pass  = 1;
+
+	lock_take(&cc->lock);
+	list_for_each_entry(c, &cc->cs, next) {
+		if(c->tid == tid) {
+			found = 1;
+			break;
+		}
+	}
+
+	if(found) {
+		pass = 0;
+
+		list_for_each_entry(s, &c->ss, next) {
+			if(s->active) {
+				pass = 1;
+				break;
+			}
+		}
+	}
+	lock_drop(&cc->lock);
+
+	return pass;
+}
+
+int cond_init(struct cond_context * cc)
+{
+	INIT_LIST_HEAD(&cc->cs);
+	lock_init(&cc->lock);
+
+	return 0;
+}
+
+int cond_release(struct cond_context * cc)
+{
+	lock_destroy(&cc->lock);
+
+	return 0;
+}
@@ -0,0 +1,101 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal triggers conditions logic.
+ */
+
+#ifndef __EMAGE_COND_H
+#define __EMAGE_COND_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <emage.h>
+
+#include "emlist.h"
+#include "lock.h"
+
+/* Possible outcomes of a sample on a condition. */
+#define COND_NONE			0
+#define COND_ENTERED			1
+#define COND_LEFT			2
+
+/* State of a condition for a single UE (or for the cell, with RNTI 0). */
+struct cond_state {
+	/* Member of a list. */
+	struct list_head next;
+
+	/* UE which the state refers to. */
+	uint16_t rnti;
+
+	/* A value different than 0 means the condition holds. */
+	int active;
+	/* Consecutive samples pushing toward the other state. */
+	uint32_t run;
+};
+
+/* Condition attached to a trigger. */
+struct cond {
+	/* Member of a list. */
+	struct list_head next;
+
+	/* Trigger which the condition is attached to. */
+	int tid;
+	/* Condition requested. */
+	struct em_cond c;
+
+	/* States of the condition. */
+	struct list_head ss;
+};
+
+/* Conditions context for an agent. */
+struct cond_context {
+	/* Conditions attached to triggers. */
+	struct list_head cs;
+
+	/* Lock for this context. */
+	lock_t lock;
+};
+
+/* Attach a condition to a trigger, replacing the one already there. */
+int cond_set(struct cond_context * cc, int tid, struct em_cond * c);
+
+/* Remove the condition of a trigger, or all of them if 'tid' is 0. */
+int cond_del(struct cond_context * cc, int tid);
+
+/* Evaluate a sample on the condition of a trigger, if any.
+ *
+ * Returns COND_ENTERED or COND_LEFT if the condition changed its state,
+ * otherwise COND_NONE.
+ */
+int cond_sample(
+	struct cond_context * cc,
+	int tid, int metric, uint16_t rnti, int32_t value);
+
+/* Check if the reports of a trigger can pass.
+ *
+ * Returns 1 if the trigger has no condition or its condition holds for at
+ * least a UE, 0 otherwise.
+ */
+int cond_pass(struct cond_context * cc, int tid);
+
+/* Initialize a conditions context. */
+int cond_init(struct cond_context * cc);
+
+/* Release the resources of a conditions context. */
+int cond_release(struct cond_context * cc);
+
+#endif /* __EMAGE_COND_H */
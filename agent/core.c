@@ -39,6 +39,7 @@
 
 #include "agent.h"
 #include "emlist.h"
+#include "lock.h"
 #include "net.h"
 #include "sched.h"
 
@@ -50,37 +51,38 @@ int initialized = 0;
 /* Agents which are actually active. */
 LIST_HEAD(em_agents);
 /* Lock for handling the agents list. */
-pthread_spinlock_t em_agents_lock;
+lock_t em_agents_lock;
 
 /******************************************************************************
  * Misc.                                                                      *
  ******************************************************************************/
 
-/* Schedule the send of a message. */
-int add_send_job(struct agent * a, char * msg, unsigned int size)
+/* Schedule the send of a message already placed in its own buffer; the job
+ * takes the ownership of such buffer.
+ */
+int add_send_buf_job(struct agent * a, char * buf, unsigned int size)
 {
-	char * buf;
 	struct sched_job * s = 0;
 
 	int status = -1;
 
-	s = malloc(sizeof(struct sched_job));
+	if(aggr_wants(&a->aggr, buf, size)) {
+		status = aggr_add(a, buf, size);
+		mem_free(buf);
 
-	if(!s) {
-		EMLOG("No more memory!");
-		return -1;
+		return status;
 	}
 
-	buf = malloc(sizeof(char) * size);
+	s = mem_alloc(&a->mem, EM_MEM_JOBS, sizeof(struct sched_job));
 
-	if(!buf) {
+	if(!s) {
 		EMLOG("No more memory!");
 
-		free(s);
+		mem_free(buf);
 		return -1;
 	}
 
-	memcpy(buf, msg, sizeof(char) * size);
+	memset(s, 0, sizeof(struct sched_job));
 
 	INIT_LIST_HEAD(&s->next);
 	s->args       = buf;
@@ -93,8 +95,252 @@ int add_send_job(struct agent * a, char * msg, unsigned int size)
 
 	/* Some error occurs?*/
 	if(status) {
-		free(buf);
-		free(s);
+		mem_free(buf);
+		mem_free(s);
+	}
+
+	return status;
+}
+
+/* Schedule the send of a message. */
+int add_send_job(struct agent * a, char * msg, unsigned int size)
+{
+	char * buf;
+
+	/* Copied straight in its batch. */
+	if(aggr_wants(&a->aggr, msg, size)) {
+		return aggr_add(a, msg, size);
+	}
+
+	buf = mem_alloc(&a->mem, EM_MEM_JOBS, sizeof(char) * size);
+
+	if(!buf) {
+		EMLOG("No more memory!");
+		return -1;
+	}
+
+	memcpy(buf, msg, sizeof(char) * size);
+
+	return add_send_buf_job(a, buf, size);
+}
+
+/* Find the trigger which originated a report, when it can be told from the
+ * header: only MAC and UE reports, which are enabled once per module. Only the
+ * keys of the trigger are copied; no reference is held on its request.
+ *
+ * Returns 0 if the trigger has been found, a negative error code otherwise.
+ */
+int report_trigger(
+	struct agent * a, char * msg, unsigned int size, struct trigger * copy)
+{
+	uint32_t mod;
+	int      type;
+
+	if(epp_msg_type(msg, size) != EP_TYPE_TRIGGER_MSG) {
+		return -1;
+	}
+
+	switch(epp_trigger_type(msg, size)) {
+	case EP_ACT_MAC_REPORT:
+		type = TR_TYPE_MAC_REP;
+		break;
+	case EP_ACT_UE_REPORT:
+		type = TR_TYPE_UE_REP;
+		break;
+	default:
+		return -1;
+	}
+
+	if(epp_head(msg, size, 0, 0, 0, &mod) ||
+		tr_snapshot_ext(&a->trig, mod, type, 0, copy)) {
+
+		return -1;
+	}
+
+	tr_put(copy);
+
+	return 0;
+}
+
+/* Schedule a single sampling of a trigger, now. */
+int add_sample_job(struct agent * a, int tid)
+{
+	struct sched_job * s =
+		mem_alloc(&a->mem, EM_MEM_JOBS, sizeof(struct sched_job));
+
+	if(!s) {
+		EMLOG("No more memory!");
+		return -1;
+	}
+
+	memset(s, 0, sizeof(struct sched_job));
+
+	INIT_LIST_HEAD(&s->next);
+	s->id         = tid;
+	s->elapse     = 1;
+	s->type       = JOB_TYPE_SAMPLE;
+	s->reschedule = 0;
+
+	if(sched_add_job(s, &a->sched)) {
+		mem_free(s);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* (Re)start the time given to the controller to come back and confirm the
+ * triggers kept across a disconnection.
+ */
+int add_resync_job(struct agent * a)
+{
+	struct sched_job * s;
+
+	sched_remove_job(0, JOB_TYPE_RESYNC, &a->sched);
+
+	s = mem_alloc(&a->mem, EM_MEM_JOBS, sizeof(struct sched_job));
+
+	if(!s) {
+		EMLOG("No more memory!");
+		return -1;
+	}
+
+	memset(s, 0, sizeof(struct sched_job));
+
+	INIT_LIST_HEAD(&s->next);
+	s->id         = 0;
+	s->elapse     = a->conf.reconnect_grace;
+	s->type       = JOB_TYPE_RESYNC;
+	s->reschedule = 0;
+
+	if(sched_add_job(s, &a->sched)) {
+		mem_free(s);
+		return -1;
+	}
+
+	return 0;
+}
+
+int add_publish_job(struct agent * a)
+{
+	struct sched_job * s;
+
+	if(!a->shm.shm) {
+		return 0;
+	}
+
+	s = mem_alloc(&a->mem, EM_MEM_JOBS, sizeof(struct sched_job));
+
+	if(!s) {
+		EMLOG("No more memory!");
+		return -1;
+	}
+
+	memset(s, 0, sizeof(struct sched_job));
+
+	INIT_LIST_HEAD(&s->next);
+	s->id         = 0;
+	s->elapse     = a->shm.shm->interval;
+	s->type       = JOB_TYPE_PUBLISH;
+	s->reschedule = -1;
+
+	if(sched_add_job(s, &a->sched)) {
+		mem_free(s);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Replicate a report for every module which shares the collection of the
+ * trigger that originated it. Only the module in the header changes.
+ */
+int add_fanout_jobs(struct agent * a, char * msg, unsigned int size)
+{
+	ep_msg_type      mt;
+	uint32_t         enb;
+	uint16_t         cell;
+	uint32_t         mod;
+
+	char *           buf;
+	struct trigger   o;
+	struct trigger * t = 0;
+	struct tr_context * tc = &a->trig;
+
+	/* Only shared triggers have copies to send. */
+	if(report_trigger(a, msg, size, &o) || o.owner) {
+		return 0;
+	}
+
+	if(epp_head(msg, size, &mt, &enb, &cell, &mod)) {
+		return 0;
+	}
+
+	lock_take(&tc->lock);
+	list_for_each_entry(t, &tc->ts, next) {
+		if(t->owner != o.id) {
+			continue;
+		}
+
+		buf = mem_alloc(&a->mem, EM_MEM_JOBS, sizeof(char) * size);
+
+		if(!buf) {
+			EMLOG("No more memory!");
+			break;
+		}
+
+		memcpy(buf, msg, sizeof(char) * size);
+		epf_head(buf, size, mt, enb, cell, t->mod);
+
+		add_send_buf_job(a, buf, size);
+	}
+	lock_drop(&tc->lock);
+
+	return 0;
+}
+
+int add_report_jobs(struct agent * a, int tid, char * msg, unsigned int size)
+{
+	int              status;
+	unsigned int     queued;
+	struct trigger   c;
+	struct trigger * t = &c;
+
+	/* Only the keys of the trigger are needed. */
+	if(tid && !tr_snapshot(&a->trig, tid, t)) {
+		tr_put(t);
+	} else if(tid || report_trigger(a, msg, size, t)) {
+		t = 0;
+	}
+
+	/* The trigger condition does not hold. */
+	if(t && !cond_pass(&a->cond, t->id)) {
+		return 0;
+	}
+
+	/* Events are not periodic: dropping one loses it for good. */
+	if(!t || t->type != TR_TYPE_UE_REP) {
+		lock_take(&a->sched.lock);
+		queued = a->sched.queued;
+		lock_drop(&a->sched.lock);
+
+		/* Over the limits, or the link is not keeping up. */
+		if(!rate_admit(&a->rate, msg, size, queued)) {
+			return 0;
+		}
+	}
+
+	/* Nothing new since the last time; events are never repeated. */
+	if(t && t->type != TR_TYPE_UE_REP &&
+		delta_skip(&a->delta, t->id, msg, size)) {
+
+		return 0;
+	}
+
+	status = add_send_job(a, msg, size);
+
+	if(!status) {
+		add_fanout_jobs(a, msg, size);
 	}
 
 	return status;
@@ -105,18 +351,17 @@ int em_has_trigger(int enb_id, int tid)
 	struct agent * a = 0;
 
 	int found = 0;
-	struct trigger * t = 0;
 
-	pthread_spin_lock(&em_agents_lock);
+	lock_take(&em_agents_lock);
 	list_for_each_entry(a, &em_agents, next) {
 		if(a->b_id == enb_id) {
-			t = tr_has_trigger(&a->trig, tid);
+			found = tr_has_trigger(&a->trig, tid);
 			break;
 		}
 	}
-	pthread_spin_unlock(&em_agents_lock);
+	lock_drop(&em_agents_lock);
 
-	return t ? 1 : 0;
+	return found;
 }
 
 int em_is_connected(int enb_id)
@@ -124,7 +369,7 @@ int em_is_connected(int enb_id)
 	struct agent * a = 0;
 	int found = 0;
 
-	pthread_spin_lock(&em_agents_lock);
+	lock_take(&em_agents_lock);
 	list_for_each_entry(a, &em_agents, next) {
 		if(a->b_id == enb_id) {
 			/* 1/0 evaluation operation. */
@@ -132,16 +377,166 @@ int em_is_connected(int enb_id)
 			break;
 		}
 	}
-	pthread_spin_unlock(&em_agents_lock);
+	lock_drop(&em_agents_lock);
 
 	return found;
 }
 
+/* Names of the wrapper operations; see 'em_agent_op'. */
+static const char * em_op_names[EM_OP_MAX] = {
+	"init", "release", "disconnected", "cell_setup_request",
+	"enb_setup_request", "ue_report", "ue_measure", "handover_UE",
+	"mac_report", "mac_report_pull", "ue_measure_pull",
+	"ue_measure_summary"
+};
+
+void agent_op_begin(struct agent * a, int id, struct timespec * start)
+{
+	trace_event(&a->trace, EM_TRACE_OP_BEGIN, 0, 0, id);
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+void agent_op_end(struct agent * a, int id, struct timespec * start)
+{
+	struct timespec now;
+	int64_t         us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	trace_event(&a->trace, EM_TRACE_OP_END, 0, 0, id);
+
+	us = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+
+	if(us < 0) {
+		us = 0;
+	}
+
+	stats_hist(&a->stats.ops[id], us);
+
+	if(a->conf.op_budget && us > a->conf.op_budget) {
+		stats_add(a->stats.ops_over[id], 1);
+
+		EMLOG("Operation %s took %lld us, over the budget of %u us",
+			em_op_names[id], (long long)us, a->conf.op_budget);
+	}
+}
+
+void em_agent_stats(struct agent * a, struct em_stats * st)
+{
+	struct sched_job * job;
+	struct trigger *   t;
+	struct session *   s;
+	unsigned int       i;
+
+	memset(st, 0, sizeof(struct em_stats));
+
+	stats_read(&a->stats, st);
+	mem_read(&a->mem, st);
+
+	lock_take(&a->sched.lock);
+	list_for_each_entry(job, &a->sched.jobs, next) {
+		st->sched_jobs++;
+	}
+	list_for_each_entry(job, &a->sched.todo, next) {
+		st->sched_jobs++;
+	}
+	st->sched_queued        = a->sched.queued;
+	st->sched_commands      = a->sched.commands;
+	st->sched_queued_peak   = a->sched.queued_peak;
+	st->sched_commands_peak = a->sched.commands_peak;
+	lock_drop(&a->sched.lock);
+
+	lock_take(&a->trig.lock);
+	list_for_each_entry(t, &a->trig.ts, next) {
+		st->triggers++;
+	}
+	lock_drop(&a->trig.lock);
+
+	st->connected   = a->net.status == EM_STATUS_CONNECTED;
+	st->failovers   = a->net.failovers;
+	st->failover_us = a->net.failover_us;
+
+	st->rate_dropped    = a->rate.dropped;
+	st->rate_degraded   = a->rate.degraded;
+	st->admit_rejected  = a->admit.rejected;
+	st->admit_coalesced = a->admit.coalesced;
+
+	lock_take(&a->backlog.lock);
+	st->backlog_msgs    = a->backlog.mem.count + a->backlog.spill.count;
+	st->backlog_dropped = a->backlog.dropped;
+	st->backlog_expired = a->backlog.expired;
+	st->backlog_spilled = a->backlog.spilled;
+	st->backlog_peak    = a->backlog.peak;
+	lock_drop(&a->backlog.lock);
+
+	lock_take(&a->sess.lock);
+	for(i = 0; i < a->sess.n && i < EM_STATS_SESSIONS; i++) {
+		s = &a->sess.ss[i];
+
+		st->sessions[i].connected   = s->ok;
+		st->sessions[i].queued      = s->count;
+		st->sessions[i].queued_peak = s->peak;
+		st->sessions[i].sent        = s->sent;
+		st->sessions[i].dropped     = s->dropped;
+	}
+	st->nof_sessions = i;
+	lock_drop(&a->sess.lock);
+}
+
+int em_get_stats(int enb_id, struct em_stats * stats)
+{
+	struct agent * a = 0;
+	int found = 0;
+
+	if(!stats) {
+		return -1;
+	}
+
+	lock_take(&em_agents_lock);
+	list_for_each_entry(a, &em_agents, next) {
+		if(a->b_id == enb_id) {
+			em_agent_stats(a, stats);
+			found = 1;
+			break;
+		}
+	}
+	lock_drop(&em_agents_lock);
+
+	return found ? 0 : -1;
+}
+
+int em_trace_dump(int enb_id, const char * path)
+{
+	struct agent *    a = 0;
+	struct trace_copy c;
+	int status = -1;
+
+	if(!path) {
+		return -1;
+	}
+
+	lock_take(&em_agents_lock);
+	list_for_each_entry(a, &em_agents, next) {
+		if(a->b_id == enb_id) {
+			status = trace_copy(&a->trace, enb_id, &c);
+			break;
+		}
+	}
+	lock_drop(&em_agents_lock);
+
+	/* The file is written without blocking the other agents. */
+	if(!status) {
+		status = trace_write(&c, path);
+	}
+
+	return status;
+}
+
 int em_init(void)
 {
 	if(!initialized) {
 		/* Initialize locking. */
-		pthread_spin_init(&em_agents_lock, 0);
+		lock_init(&em_agents_lock);
 
 		/* Don't perform initialization again. */
 		initialized = 1;
@@ -150,28 +545,145 @@ int em_init(void)
 	return 0;
 }
 
+/* Release what the contexts of an agent hold besides its memory, like locks,
+ * files and mappings; the threads of the agent must not be running anymore.
+ */
+int em_release_contexts(struct agent * a)
+{
+	lock_destroy(&a->trig.lock);
+
+	aggr_release(&a->aggr);
+	delta_release(&a->delta);
+	meas_release(&a->meas);
+	cond_release(&a->cond);
+	rate_release(&a->rate);
+	admit_release(&a->admit);
+	backlog_release(&a->backlog);
+	sess_release(&a->sess);
+	shm_release(&a->shm);
+	trace_release(&a->trace);
+
+	return 0;
+}
+
 int em_release_agent(struct agent * a)
 {
-	free(a);
+	/* Whatever the agent allocated goes away at once. */
+	mem_release(&a->mem);
+	mem_sys_free(a->b_id, a, sizeof(struct agent));
 
 	return 0;
 }
 
+int em_meas_sample(
+	int enb_id, int trig_id, uint16_t rnti, int32_t rsrp, int32_t rsrq)
+{
+	struct agent * a = 0;
+
+	int status = -1;
+
+	lock_take(&em_agents_lock);
+	list_for_each_entry(a, &em_agents, next) {
+		if(a->b_id == enb_id) {
+			/* Samples of unknown triggers would never be released. */
+			if(!tr_has_trigger(&a->trig, trig_id)) {
+				break;
+			}
+
+			status = meas_add(&a->meas, trig_id, rnti, rsrp, rsrq);
+
+			/* Ask for a report as soon as the condition holds. */
+			if(cond_sample(&a->cond,
+				trig_id, EM_COND_RSRP, rnti, rsrp) ==
+					COND_ENTERED ||
+				cond_sample(&a->cond,
+				trig_id, EM_COND_RSRQ, rnti, rsrq) ==
+					COND_ENTERED) {
+
+				add_sample_job(a, trig_id);
+			}
+			break;
+		}
+	}
+	lock_drop(&em_agents_lock);
+
+	return status;
+}
+
+int em_mac_sample(
+	int enb_id, int trig_id, uint32_t prb_used, uint32_t prb_total)
+{
+	struct agent * a = 0;
+
+	int     status = -1;
+	int32_t util;
+
+	if(!prb_total) {
+		return -1;
+	}
+
+	util = (int32_t)((uint64_t)prb_used * 100 / prb_total);
+
+	lock_take(&em_agents_lock);
+	list_for_each_entry(a, &em_agents, next) {
+		if(a->b_id == enb_id) {
+			status = 0;
+
+			if(cond_sample(&a->cond,
+				trig_id, EM_COND_PRB_UTIL, 0, util) ==
+					COND_ENTERED) {
+
+				add_sample_job(a, trig_id);
+			}
+			break;
+		}
+	}
+	lock_drop(&em_agents_lock);
+
+	return status;
+}
+
+int em_trigger_cond(int enb_id, int trig_id, struct em_cond * cond)
+{
+	struct agent * a = 0;
+
+	int status = -1;
+
+	lock_take(&em_agents_lock);
+	list_for_each_entry(a, &em_agents, next) {
+		if(a->b_id == enb_id) {
+			if(!tr_has_trigger(&a->trig, trig_id)) {
+				break;
+			}
+
+			if(cond) {
+				status = cond_set(&a->cond, trig_id, cond);
+			} else {
+				status = cond_del(&a->cond, trig_id);
+			}
+			break;
+		}
+	}
+	lock_drop(&em_agents_lock);
+
+	return status;
+}
+
 int em_send(int enb_id, char * msg, unsigned int size) {
 	struct agent * a = 0;
 
 	int found  = 0;
 	int status = -1;
 
-	pthread_spin_lock(&em_agents_lock);
+	lock_take(&em_agents_lock);
 	list_for_each_entry(a, &em_agents, next) {
 		if(a->b_id == enb_id) {
-			status = add_send_job(a, msg, size);
+			status = add_report_jobs(a, 0, msg, size);
 
 			break;
 		}
 	}
-	pthread_spin_unlock(&em_agents_lock);
+	lock_drop(&em_agents_lock);
 
 	return status;
 }
@@ -184,7 +696,7 @@ int em_terminate_agent(int b_id)
 	int found = 0;
 	int status = 0;
 
-	pthread_spin_lock(&em_agents_lock);
+	lock_take(&em_agents_lock);
 	list_for_each_entry_safe(a, b, &em_agents, next) {
 		if(a->b_id == b_id) {
 			list_del(&a->next);
@@ -192,19 +704,19 @@ int em_terminate_agent(int b_id)
 			break;
 		}
 	}
-	pthread_spin_unlock(&em_agents_lock);
+	lock_drop(&em_agents_lock);
 
 	if(found) {
 		if(a->ops->release) {
-			status = a->ops->release();
+			status = agent_op(a, EM_OP_RELEASE, release());
 		}
 
-		tr_flush(&a->trig);
-		pthread_spin_destroy(&a->trig.lock);
-
 		net_stop(&a->net);
 		sched_stop(&a->sched);
 
+		/* The threads which use the contexts are gone now. */
+		em_release_contexts(a);
+
 		EMDBG("Releasing agent for base station %d", a->b_id);
 		em_release_agent(a);
 	}
@@ -221,12 +733,23 @@ int em_start(
 	struct em_agent_ops * ops,
 	char *                ctrl_addr,
 	unsigned short        ctrl_port)
+{
+	return em_start_ext(b_id, ops, ctrl_addr, ctrl_port, 0);
+}
+
+int em_start_ext(
+	int                    b_id,
+	struct em_agent_ops *  ops,
+	char *                 ctrl_addr,
+	unsigned short         ctrl_port,
+	struct em_agent_conf * conf)
 {
 	struct agent * a = 0;
 
 	int status = 0;
 	int running = 0;	/* Already running? */
 	int nm = 0;		/* No mem? */
+	unsigned int i;
 
 	if(em_init()) {
 		return -1;
@@ -240,7 +763,7 @@ int em_start(
 		return -1;
 	}
 
-	pthread_spin_lock(&em_agents_lock);
+	lock_take(&em_agents_lock);
 	/* Find for an already present agent */
 	list_for_each_entry(a, &em_agents, next) {
 		if(a->b_id == b_id) {
@@ -250,7 +773,7 @@ int em_start(
 	}
 
 	if(!running) {
-		a = malloc(sizeof(struct agent));
+		a = mem_sys_alloc(b_id, sizeof(struct agent));
 
 		if(a) {
 			memset(a, 0, sizeof(struct agent));
@@ -263,7 +786,7 @@ int em_start(
 		}
 
 	}
-	pthread_spin_unlock(&em_agents_lock);
+	lock_drop(&em_agents_lock);
 
 	if(running) {
 		EMLOG("Agent for base station %d is already running...",
@@ -283,25 +806,103 @@ int em_start(
 	a->net.port = ctrl_port;
 	a->ops = ops;
 
+	if(mem_init(&a->mem, b_id, conf ? conf->mem_limit : 0)) {
+		lock_take(&em_agents_lock);
+		list_del(&a->next);
+		lock_drop(&em_agents_lock);
+
+		mem_sys_free(b_id, a, sizeof(struct agent));
+
+		return -1;
+	}
+
+	sess_init(&a->sess, conf ? conf->session_queue : 0);
+
+	if(conf) {
+		a->conf = *conf;
+
+		for(i = 0; i < conf->nof_endpoints; i++) {
+			net_add_endpoint(
+				&a->net,
+				conf->endpoints[i].addr,
+				conf->endpoints[i].port);
+		}
+
+		for(i = 0; i < conf->nof_sessions; i++) {
+			sess_add(
+				&a->sess,
+				conf->sessions[i].addr,
+				conf->sessions[i].port);
+		}
+
+		/* Not valid after the start. */
+		a->conf.endpoints     = 0;
+		a->conf.nof_endpoints = 0;
+		a->conf.sessions      = 0;
+		a->conf.nof_sessions  = 0;
+
+		/* Used by the scheduler for the whole life of the agent. */
+		if(conf->trace_file) {
+			a->conf.trace_file = mem_strdup(
+				&a->mem, EM_MEM_OTHER, conf->trace_file);
+		}
+	}
+
 	a->trig.next = 1;
-	pthread_spin_init(&a->trig.lock, 0);
+	lock_init(&a->trig.lock);
 	INIT_LIST_HEAD(&a->trig.ts);
 
+	/* Every context is set up anyway, so that all of them can be released
+	 * if one fails.
+	 */
+	status  = aggr_init(&a->aggr, a->conf.aggr_time, a->conf.aggr_size);
+	status |= delta_init(&a->delta, a->conf.delta_keyframe);
+	status |= meas_init(&a->meas, a->conf.meas_samples, a->conf.meas_ewma);
+	status |= cond_init(&a->cond);
+	status |= rate_init(
+		&a->rate,
+		a->conf.rate_limit,
+		a->conf.rate_burst,
+		a->conf.rate_trigger,
+		a->conf.rate_trigger_burst,
+		a->conf.rate_degrade);
+	status |= admit_init(
+		&a->admit,
+		a->conf.cmd_rate,
+		a->conf.cmd_burst,
+		a->conf.cmd_queue);
+	status |= backlog_init(
+		&a->backlog,
+		a->conf.backlog_size,
+		a->conf.backlog_file,
+		a->conf.backlog_file_size,
+		a->conf.backlog_policy == EM_BACKLOG_DROP_OLDEST,
+		a->conf.backlog_age);
+	shm_init(
+		&a->shm,
+		a->conf.shm_path,
+		b_id,
+		a->conf.shm_interval ? a->conf.shm_interval : SHM_DEF_INTERVAL);
+	status |= trace_init(&a->trace, a->conf.trace_size);
+
+	if(status) {
+		EMLOG("Failed to set up the agent.");
+		status = -1;
+		goto err;
+	}
+
+	if(a->conf.trace_signal) {
+		trace_signal(a->conf.trace_signal);
+	}
+
 	if (a->ops->init) {
-		status = a->ops->init();
+		status = agent_op(a, EM_OP_INIT, init());
 
 		/* On error, do not launch the agent */
 		if (status < 0) {
 			EMLOG("Custom initialization failed with error %d",
 				status);
-
-			pthread_spin_lock(&em_agents_lock);
-			list_del(&a->next);
-			pthread_spin_unlock(&em_agents_lock);
-
-			em_release_agent(a);
-
-			return status;
+			goto err;
 		}
 	}
 
@@ -310,14 +911,9 @@ int em_start(
 	 */
 
 	if(sched_start(&a->sched)) {
-		pthread_spin_lock(&em_agents_lock);
-		list_del(&a->next);
-		pthread_spin_unlock(&em_agents_lock);
-
 		EMLOG("Failed to create the agent scheduler thread.");
-		em_release_agent(a);
-
-		return -1;
+		status = -1;
+		goto err;
 	}
 
 	/*
@@ -325,18 +921,30 @@ int em_start(
 	 */
 
 	if(net_start(&a->net)) {
-		pthread_spin_lock(&em_agents_lock);
-		list_del(&a->next);
-		pthread_spin_unlock(&em_agents_lock);
-
 		EMLOG("Failed to create the listener agent thread.");
 		sched_stop(&a->sched);
-		em_release_agent(a);
-
-		return -1;
+		status = -1;
+		goto err;
 	}
 
+	/*
+	 * Start this agent report sessions, if any
+	 */
+
+	sess_start(&a->sess);
+	add_publish_job(a);
+
 	return 0;
+
+err:
+	lock_take(&em_agents_lock);
+	list_del(&a->next);
+	lock_drop(&em_agents_lock);
+
+	em_release_contexts(a);
+	em_release_agent(a);
+
+	return status;
 }
 
 int em_stop(void)
@@ -344,26 +952,27 @@ int em_stop(void)
 	struct agent * a = 0;
 
 	while(!list_empty(&em_agents)) {
-		pthread_spin_lock(&em_agents_lock);
+		lock_take(&em_agents_lock);
 		a = list_first_entry(&em_agents, struct agent, next);
 		list_del(&a->next);
-		pthread_spin_unlock(&em_agents_lock);
+		lock_drop(&em_agents_lock);
 
 		if(a->ops->release) {
-			a->ops->release();
+			agent_op(a, EM_OP_RELEASE, release());
 		}
 
-		tr_flush(&a->trig);
-		pthread_spin_destroy(&a->trig.lock);
-
 		net_stop(&a->net);
 		sched_stop(&a->sched);
 
+		/* The threads which use the contexts are gone now. */
+		em_release_contexts(a);
+
 		EMDBG("Releasing agent for base station %d", a->b_id);
 		em_release_agent(a);
 	}
 
 	EMLOG("Shut down...");
+	em_log_flush();
 
 	return 0;
 }
@@ -0,0 +1,160 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal delta reporting logic.
+ *
+ * The protocol has no message to carry only the changed fields of a report,
+ * so the delta is done at report granularity: a report identical to the last
+ * one sent for its trigger is not sent at all, and the controller keeps the
+ * values it already has. A full report is sent anyway every 'keyframe' ones,
+ * and after every reconnection. Event-driven reports are never suppressed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <emlog.h>
+#include <emage/emproto.h>
+
+#include "agent.h"
+#include "delta.h"
+
+int delta_skip(
+	struct delta_context * dc, int tid, char * msg, unsigned int size)
+{
+	struct delta_snap * s = 0;
+
+	int      found = 0;
+	int      skip  = 0;
+
+	char *       body = msg + EP_HEADER_SIZE;
+	unsigned int len  = size - EP_HEADER_SIZE;
+	char *       nb;
+
+	if(!dc->keyframe || !tid || size < EP_HEADER_SIZE) {
+		return 0;
+	}
+
+	lock_take(&dc->lock);
+	list_for_each_entry(s, &dc->ss, next) {
+		if(s->tid == tid) {
+			found = 1;
+			break;
+		}
+	}
+
+	if(!found) {
+		s = mem_alloc(
+			agent_mem(dc, delta),
+			EM_MEM_TRIGGERS,
+			sizeof(struct delta_snap));
+
+		if(!s) {
+			lock_drop(&dc->lock);
+			return 0;
+		}
+
+		memset(s, 0, sizeof(struct delta_snap));
+
+		INIT_LIST_HEAD(&s->next);
+		s->tid = tid;
+
+		list_add(&s->next, &dc->ss);
+	}
+
+	/* Nothing changed, and still not the time for a full report? */
+	if(found &&
+		s->len == len &&
+		s->skip + 1 < dc->keyframe &&
+		memcmp(s->body, body, len) == 0) {
+
+		s->skip++;
+		skip = 1;
+	} else {
+		if(s->len != len) {
+			nb = mem_realloc(
+				agent_mem(dc, delta),
+				EM_MEM_TRIGGERS,
+				s->body,
+				len);
+
+			/* Without a snapshot the next report is sent anyway */
+			if(!nb && len > 0) {
+				mem_free(s->body);
+				s->body = 0;
+				s->len  = 0;
+				s->skip = 0;
+
+				lock_drop(&dc->lock);
+				return 0;
+			}
+
+			s->body = nb;
+			s->len  = len;
+		}
+
+		memcpy(s->body, body, len);
+		s->skip = 0;
+	}
+	lock_drop(&dc->lock);
+
+	return skip;
+}
+
+int delta_del(struct delta_context * dc, int tid)
+{
+	struct delta_snap * s = 0;
+	struct delta_snap * t = 0;
+
+	lock_take(&dc->lock);
+	list_for_each_entry_safe(s, t, &dc->ss, next) {
+		if(tid && s->tid != tid) {
+			continue;
+		}
+
+		list_del(&s->next);
+
+		mem_free(s->body);
+		mem_free(s);
+	}
+	lock_drop(&dc->lock);
+
+	return 0;
+}
+
+int delta_reset(struct delta_context * dc)
+{
+	return delta_del(dc, 0);
+}
+
+int delta_init(struct delta_context * dc, unsigned int keyframe)
+{
+	INIT_LIST_HEAD(&dc->ss);
+	dc->keyframe = keyframe;
+
+	lock_init(&dc->lock);
+
+	return 0;
+}
+
+int delta_release(struct delta_context * dc)
+{
+	lock_destroy(&dc->lock);
+
+	return 0;
+}
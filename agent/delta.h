@@ -0,0 +1,81 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal delta reporting logic.
+ */
+
+#ifndef __EMAGE_DELTA_H
+#define __EMAGE_DELTA_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "emlist.h"
+#include "lock.h"
+
+/* Last report sent for a trigger. */
+struct delta_snap {
+	/* Member of a list. */
+	struct list_head next;
+
+	/* Id of the trigger. */
+	int tid;
+
+	/* Reports not sent since the last one. */
+	unsigned int skip;
+
+	/* Size of the report body. */
+	unsigned int len;
+	/* Body of the report, without the header. */
+	char * body;
+};
+
+/* Delta reporting context for an agent. */
+struct delta_context {
+	/* Snapshots of the reports sent. */
+	struct list_head ss;
+
+	/* A report is sent at least once every 'keyframe' ones; 0 disables
+	 * the delta reporting.
+	 */
+	unsigned int keyframe;
+
+	/* Lock for this context. */
+	lock_t lock;
+};
+
+/* Check a report against the last one sent for its trigger; only reports of
+ * periodic triggers should be checked, since the others are not repeated.
+ *
+ * Returns 1 if the report does not carry anything new and can be skipped, 0 if
+ * it has to be sent.
+ */
+int delta_skip(
+	struct delta_context * dc, int tid, char * msg, unsigned int size);
+
+/* Forget the snapshot of a trigger, or all of them if 'tid' is 0. */
+int delta_del(struct delta_context * dc, int tid);
+
+/* Forget every snapshot, so that the next reports are all sent. */
+int delta_reset(struct delta_context * dc);
+
+/* Initialize a delta reporting context. */
+int delta_init(struct delta_context * dc, unsigned int keyframe);
+
+/* Release the resources of a delta reporting context. */
+int delta_release(struct delta_context * dc);
+
+#endif /* __EMAGE_DELTA_H */
@@ -0,0 +1,472 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent logging logic.
+ *
+ * Every thread which logs gets its own ring of records, with a single producer
+ * (the thread) and a single consumer (the writer), so that queueing a message
+ * takes no lock and never waits. The text is formatted in the record by the
+ * thread which logs, while buffer dumps are copied raw and turned in hex only
+ * by the writer; the writer thread collects the records of all the rings and
+ * writes them on the standard output with few big writes.
+ *
+ * Messages emitted too often from the same place are limited to a burst per
+ * second, and the number of the ones suppressed is written with the next one.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <emlog.h>
+
+#include "mem.h"
+
+/* Maximum number of threads with their own ring */
+#define EMLOG_THREADS                           32
+/* Records per ring; must be a power of 2 */
+#define EMLOG_SLOTS                             256
+/* Size of a record */
+#define EMLOG_REC_SIZE                          256
+/* Bytes of a buffer dump carried by a record; rows of 16 bytes */
+#define EMLOG_HEX_BYTES                         240
+/* Messages per second allowed from the same place */
+#define EMLOG_BURST                             20
+/* Time the writer sleeps when there is nothing to write, in ns */
+#define EMLOG_IDLE                              5000000
+
+enum emlog_kind {
+	EMLOG_TEXT = 0,
+	EMLOG_HEX,
+};
+
+struct emlog_rec {
+	/* Kind of record; see 'emlog_kind'. */
+	uint16_t kind;
+	/* Bytes used in the data. */
+	uint16_t len;
+	/* Offset of the dumped bytes in the whole buffer. */
+	uint32_t off;
+
+	char data[EMLOG_REC_SIZE - 8];
+};
+
+/* Ring of records of a thread. */
+struct emlog_ring {
+	/* The ring belongs to a thread. */
+	int used;
+	/* The thread is gone; the ring is free once written. */
+	int dead;
+
+	/* Next record to write, and next one to fill. */
+	uint32_t head;
+	uint32_t tail;
+
+	/* Records lost because the ring was full, and the ones reported. */
+	uint32_t lost;
+	uint32_t told;
+
+	struct emlog_rec recs[EMLOG_SLOTS];
+};
+
+static struct emlog_ring * emlog_rings[EMLOG_THREADS];
+static __thread struct emlog_ring * emlog_mine;
+
+static int             emlog_level = EM_LOG_DEBUG;
+static pthread_once_t  emlog_once  = PTHREAD_ONCE_INIT;
+static pthread_key_t   emlog_key;
+static pthread_mutex_t emlog_lock  = PTHREAD_MUTEX_INITIALIZER;
+
+/* Output buffer of the writer. */
+static char         emlog_out[16384];
+static unsigned int emlog_olen;
+
+/******************************************************************************
+ * Writer                                                                     *
+ ******************************************************************************/
+
+void emlog_write_out(void)
+{
+	unsigned int off = 0;
+	int          op;
+
+	while(off < emlog_olen) {
+		op = write(STDOUT_FILENO, emlog_out + off, emlog_olen - off);
+
+		if(op <= 0) {
+			break;
+		}
+
+		off += op;
+	}
+
+	emlog_olen = 0;
+}
+
+void emlog_append(const char * fmt, ...)
+{
+	va_list args;
+	int     n;
+
+	if(emlog_olen + EMLOG_REC_SIZE * 4 > sizeof(emlog_out)) {
+		emlog_write_out();
+	}
+
+	va_start(args, fmt);
+	n = vsnprintf(
+		emlog_out + emlog_olen,
+		sizeof(emlog_out) - emlog_olen,
+		fmt,
+		args);
+	va_end(args);
+
+	if(n <= 0) {
+		return;
+	}
+
+	/* Truncated; keep what fitted. */
+	if((unsigned int)n >= sizeof(emlog_out) - emlog_olen) {
+		n = sizeof(emlog_out) - emlog_olen - 1;
+	}
+
+	emlog_olen += n;
+}
+
+void emlog_render(struct emlog_rec * r)
+{
+	unsigned int i;
+
+	if(r->kind == EMLOG_TEXT) {
+		emlog_append("%.*s", r->len, r->data);
+		return;
+	}
+
+	for(i = 0; i < r->len; i++) {
+		if((r->off + i) % 16 == 0) {
+			emlog_append("\n%03x ", r->off + i);
+		}
+
+		emlog_append("%02x ", (unsigned char)r->data[i]);
+	}
+}
+
+/* Write what is in the rings; returns the number of records written. */
+int emlog_drain(void)
+{
+	struct emlog_ring * r;
+
+	unsigned int i;
+	uint32_t     tail;
+	uint32_t     lost;
+	int          n = 0;
+
+	pthread_mutex_lock(&emlog_lock);
+
+	for(i = 0; i < EMLOG_THREADS; i++) {
+		r = __atomic_load_n(&emlog_rings[i], __ATOMIC_ACQUIRE);
+
+		if(!r || !__atomic_load_n(&r->used, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+		for(; r->head != tail; n++) {
+			emlog_render(&r->recs[r->head & (EMLOG_SLOTS - 1)]);
+			__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+		}
+
+		lost = __atomic_load_n(&r->lost, __ATOMIC_RELAXED);
+
+		if(lost != r->told) {
+			emlog_append("emage: %u log messages lost\n",
+				lost - r->told);
+			r->told = lost;
+		}
+
+		/* The thread is gone and everything has been written. */
+		if(__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+			r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+
+			r->dead = 0;
+			__atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+		}
+	}
+
+	emlog_write_out();
+
+	pthread_mutex_unlock(&emlog_lock);
+
+	return n;
+}
+
+void * emlog_loop(void * args __attribute__((unused)))
+{
+	struct timespec idle = {0, EMLOG_IDLE};
+
+	while(1) {
+		if(!emlog_drain()) {
+			nanosleep(&idle, 0);
+		}
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ * Rings                                                                      *
+ ******************************************************************************/
+
+/* The thread which owned the ring is terminating. */
+void emlog_release(void * arg)
+{
+	struct emlog_ring * r = (struct emlog_ring *)arg;
+
+	__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+void emlog_init(void)
+{
+	pthread_t t;
+
+	pthread_key_create(&emlog_key, emlog_release);
+
+	if(pthread_create(&t, NULL, emlog_loop, 0) == 0) {
+		pthread_detach(t);
+	}
+
+	atexit(em_log_flush);
+}
+
+/* Get the ring of the calling thread, taking a free one the first time. */
+struct emlog_ring * emlog_ring(void)
+{
+	struct emlog_ring * r;
+	struct emlog_ring * n = 0;
+
+	unsigned int i;
+
+	if(emlog_mine) {
+		return emlog_mine;
+	}
+
+	pthread_once(&emlog_once, emlog_init);
+
+	for(i = 0; i < EMLOG_THREADS && !emlog_mine; i++) {
+		r = __atomic_load_n(&emlog_rings[i], __ATOMIC_ACQUIRE);
+
+		if(!r) {
+			if(!n) {
+				n = mem_sys_alloc(-1, sizeof(struct emlog_ring));
+
+				if(!n) {
+					return 0;
+				}
+
+				memset(n, 0, sizeof(struct emlog_ring));
+				n->used = 1;
+			}
+
+			if(__sync_bool_compare_and_swap(&emlog_rings[i], 0, n)) {
+				emlog_mine = n;
+				n = 0;
+			}
+		} else if(__sync_bool_compare_and_swap(&r->used, 0, 1)) {
+			emlog_mine = r;
+		}
+	}
+
+	if(n) {
+		mem_sys_free(-1, n, sizeof(struct emlog_ring));
+	}
+
+	if(emlog_mine) {
+		pthread_setspecific(emlog_key, emlog_mine);
+	}
+
+	return emlog_mine;
+}
+
+/* Take the next record of the thread ring, if there is room. */
+struct emlog_rec * emlog_reserve(struct emlog_ring * r)
+{
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if(r->tail - head >= EMLOG_SLOTS) {
+		__atomic_add_fetch(&r->lost, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return &r->recs[r->tail & (EMLOG_SLOTS - 1)];
+}
+
+void emlog_commit(struct emlog_ring * r)
+{
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+void emlog_text(struct emlog_ring * r, const char * fmt, va_list args)
+{
+	struct emlog_rec * rec;
+	int                n;
+
+	/* No ring for this thread: write it directly. */
+	if(!r) {
+		vprintf(fmt, args);
+		return;
+	}
+
+	rec = emlog_reserve(r);
+
+	if(!rec) {
+		return;
+	}
+
+	n = vsnprintf(rec->data, sizeof(rec->data), fmt, args);
+
+	if(n < 0) {
+		return;
+	}
+
+	/* Truncated; keep the end of line. */
+	if(n >= (int)sizeof(rec->data)) {
+		n = sizeof(rec->data);
+		rec->data[n - 1] = '\n';
+	}
+
+	rec->kind = EMLOG_TEXT;
+	rec->len  = n;
+
+	emlog_commit(r);
+}
+
+void emlog_puts(struct emlog_ring * r, const char * fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	emlog_text(r, fmt, args);
+	va_end(args);
+}
+
+/* Check if a message can be written, given how many came from its place. */
+int emlog_pass(struct emlog_ring * r, struct em_log_site * site)
+{
+	struct timespec now;
+	uint32_t        sec;
+	uint32_t        s;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	sec = now.tv_sec;
+
+	/* Only the thread which moves the window resets it. */
+	if(__atomic_load_n(&site->window, __ATOMIC_RELAXED) != sec &&
+		__atomic_exchange_n(&site->window, sec, __ATOMIC_RELAXED) != sec) {
+
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+		s = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+
+		if(s) {
+			emlog_puts(r, "emage: %u similar messages suppressed\n",
+				s);
+		}
+	}
+
+	if(__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > EMLOG_BURST) {
+		__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return 1;
+}
+
+/******************************************************************************
+ * Public API                                                                 *
+ ******************************************************************************/
+
+void em_log(struct em_log_site * site, int level, const char * fmt, ...)
+{
+	struct emlog_ring * r;
+	va_list             args;
+
+	if(level > __atomic_load_n(&emlog_level, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	r = emlog_ring();
+
+	if(site && !emlog_pass(r, site)) {
+		return;
+	}
+
+	va_start(args, fmt);
+	emlog_text(r, fmt, args);
+	va_end(args);
+}
+
+void em_log_hex(int level, const char * mark, const char * buf, int size)
+{
+	struct emlog_ring * r;
+	struct emlog_rec *  rec;
+
+	int off;
+	int len;
+
+	if(level > __atomic_load_n(&emlog_level, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	r = emlog_ring();
+
+	if(!r) {
+		return;
+	}
+
+	emlog_puts(r, "%s\n    00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f\n",
+		mark);
+
+	for(off = 0; off < size; off += len) {
+		len = size - off < EMLOG_HEX_BYTES ? size - off : EMLOG_HEX_BYTES;
+		rec = emlog_reserve(r);
+
+		if(!rec) {
+			break;
+		}
+
+		rec->kind = EMLOG_HEX;
+		rec->len  = len;
+		rec->off  = off;
+		memcpy(rec->data, buf + off, len);
+
+		emlog_commit(r);
+	}
+
+	emlog_puts(r, "\n%s\n", mark);
+}
+
+void em_log_set_level(int level)
+{
+	__atomic_store_n(&emlog_level, level, __ATOMIC_RELAXED);
+}
+
+void em_log_flush(void)
+{
+	emlog_drain();
+}
@@ -0,0 +1,197 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal locking logic.
+ *
+ * Sites register themselves the first time they take a lock, by pushing in a
+ * global list which is never shrunk; their counters are updated with relaxed
+ * atomics, since a dump does not need an exact snapshot.
+ */
+
+/* For PTHREAD_MUTEX_ADAPTIVE_NP. */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <time.h>
+
+#include <emage.h>
+
+#include "lock.h"
+
+#ifdef EM_LOCK_STATS
+
+/* All the sites which took a lock at least once. */
+static struct lock_site * lock_sites;
+
+static inline uint64_t lock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void lock_max(uint64_t * max, uint64_t v)
+{
+	uint64_t c = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while(v > c) {
+		if(__atomic_compare_exchange_n(
+			max, &c, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+}
+
+static void lock_register(struct lock_site * s)
+{
+	if(__atomic_exchange_n(&s->reg, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	s->next = __atomic_load_n(&lock_sites, __ATOMIC_ACQUIRE);
+
+	while(!__atomic_compare_exchange_n(
+		&lock_sites, &s->next, s, 1,
+		__ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+		/* s->next has been updated with the current head. */
+	}
+}
+
+void lock_take_site(lock_t * l, struct lock_site * s)
+{
+	uint64_t t;
+	uint64_t w;
+
+	if(!__atomic_load_n(&s->reg, __ATOMIC_RELAXED)) {
+		lock_register(s);
+	}
+
+	if(lock_try(l) == 0) {
+		t = lock_now();
+	} else {
+		w = lock_now();
+		lock_acquire(l);
+		t = lock_now();
+		w = t - w;
+
+		__atomic_fetch_add(&s->contended, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&s->wait, w, __ATOMIC_RELAXED);
+		lock_max(&s->wait_max, w);
+	}
+
+	__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+
+	/* Only the holder touches these. */
+	l->site  = s;
+	l->since = t;
+}
+
+void lock_drop_site(lock_t * l)
+{
+	struct lock_site * s = l->site;
+	uint64_t           h = lock_now() - l->since;
+
+	lock_release(l);
+
+	__atomic_fetch_add(&s->hold, h, __ATOMIC_RELAXED);
+	lock_max(&s->hold_max, h);
+}
+
+int em_lock_dump(const char * path)
+{
+	struct lock_site * s;
+	FILE *             f;
+	uint64_t           n;
+
+	f = fopen(path, "w");
+
+	if(!f) {
+		return -1;
+	}
+
+	fprintf(f, "%-24s %10s %10s %12s %12s %12s %12s\n",
+		"site", "count", "contended",
+		"wait_avg_ns", "wait_max_ns", "hold_avg_ns", "hold_max_ns");
+
+	for(s = __atomic_load_n(&lock_sites, __ATOMIC_ACQUIRE);
+		s;
+		s = s->next) {
+
+		n = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+
+		fprintf(f, "%18s:%-5d %10llu %10llu %12llu %12llu %12llu %12llu\n",
+			s->file, s->line,
+			(unsigned long long)n,
+			(unsigned long long)s->contended,
+			(unsigned long long)(s->contended ?
+				s->wait / s->contended : 0),
+			(unsigned long long)s->wait_max,
+			(unsigned long long)(n ? s->hold / n : 0),
+			(unsigned long long)s->hold_max);
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+#else
+
+int em_lock_dump(const char * path __attribute__((unused)))
+{
+	return -1;
+}
+
+#endif /* EM_LOCK_STATS */
+
+int lock_init(lock_t * l)
+{
+#if defined(EM_LOCK_MUTEX) || defined(EM_LOCK_PARK)
+	pthread_mutexattr_t attr;
+	int                 ret;
+
+	pthread_mutexattr_init(&attr);
+#ifdef EM_LOCK_MUTEX
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+	ret = pthread_mutex_init(&l->m, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	if(ret) {
+		return -1;
+	}
+#else
+	if(pthread_spin_init(&l->s, 0)) {
+		return -1;
+	}
+#endif
+#ifdef EM_LOCK_STATS
+	l->site  = 0;
+	l->since = 0;
+#endif
+	return 0;
+}
+
+void lock_destroy(lock_t * l)
+{
+#if defined(EM_LOCK_MUTEX) || defined(EM_LOCK_PARK)
+	pthread_mutex_destroy(&l->m);
+#else
+	pthread_spin_destroy(&l->s);
+#endif
+}
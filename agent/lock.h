@@ -0,0 +1,140 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal locking primitives.
+ *
+ * The implementation is chosen at build time:
+ *   - default:         spinlock;
+ *   - EM_LOCK_MUTEX:   adaptive mutex (spins a little, then sleeps);
+ *   - EM_LOCK_PARK:    spins with trylock for LOCK_SPINS rounds, then parks on
+ *                      the mutex.
+ * With EM_LOCK_STATS every place which takes a lock records how long it waited
+ * for it and how long it kept it (see 'em_lock_dump').
+ */
+
+#ifndef __EMAGE_LOCK_H
+#define __EMAGE_LOCK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Rounds of trylock before parking, for EM_LOCK_PARK. */
+#define LOCK_SPINS                              100
+
+#ifdef EM_LOCK_STATS
+/* Statistics of a place in the code which takes a lock. */
+struct lock_site {
+	const char *       file;
+	int                line;
+	/* Set once the site is in the global list. */
+	int                reg;
+	struct lock_site * next;
+
+	/* Acquisitions, and how many found the lock already taken. */
+	uint64_t count;
+	uint64_t contended;
+	/* Time spent waiting for the lock and holding it, in ns. */
+	uint64_t wait;
+	uint64_t wait_max;
+	uint64_t hold;
+	uint64_t hold_max;
+};
+#endif /* EM_LOCK_STATS */
+
+typedef struct {
+#if defined(EM_LOCK_MUTEX) || defined(EM_LOCK_PARK)
+	pthread_mutex_t    m;
+#else
+	pthread_spinlock_t s;
+#endif
+#ifdef EM_LOCK_STATS
+	/* Site of the current holder and when it took the lock. */
+	struct lock_site * site;
+	uint64_t           since;
+#endif
+} lock_t;
+
+/* Initialize a lock. Returns 0 on success, otherwise a negative number. */
+int lock_init(lock_t * l);
+
+/* Release the resources of a lock, which must not be held. */
+void lock_destroy(lock_t * l);
+
+/* Try to take the lock without waiting; returns 0 if it has been taken. */
+static inline int lock_try(lock_t * l)
+{
+#if defined(EM_LOCK_MUTEX) || defined(EM_LOCK_PARK)
+	return pthread_mutex_trylock(&l->m);
+#else
+	return pthread_spin_trylock(&l->s);
+#endif
+}
+
+static inline void lock_acquire(lock_t * l)
+{
+#if defined(EM_LOCK_PARK)
+	int i;
+
+	for(i = 0; i < LOCK_SPINS; i++) {
+		if(pthread_mutex_trylock(&l->m) == 0) {
+			return;
+		}
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#else
+		__asm__ __volatile__("" ::: "memory");
+#endif
+	}
+
+	pthread_mutex_lock(&l->m);
+#elif defined(EM_LOCK_MUTEX)
+	pthread_mutex_lock(&l->m);
+#else
+	pthread_spin_lock(&l->s);
+#endif
+}
+
+static inline void lock_release(lock_t * l)
+{
+#if defined(EM_LOCK_MUTEX) || defined(EM_LOCK_PARK)
+	pthread_mutex_unlock(&l->m);
+#else
+	pthread_spin_unlock(&l->s);
+#endif
+}
+
+#ifdef EM_LOCK_STATS
+
+void lock_take_site(lock_t * l, struct lock_site * s);
+void lock_drop_site(lock_t * l);
+
+/* Every call of lock_take gets its own statistics. */
+#define lock_take(l)                                                    \
+	do {                                                            \
+		static struct lock_site __lsite = {__FILE__, __LINE__}; \
+		lock_take_site(l, &__lsite);                            \
+	} while(0)
+
+#define lock_drop(l)            lock_drop_site(l)
+
+#else
+
+#define lock_take(l)            lock_acquire(l)
+#define lock_drop(l)            lock_release(l)
+
+#endif /* EM_LOCK_STATS */
+
+#endif /* __EMAGE_LOCK_H */
@@ -0,0 +1,361 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal measurements reduction logic.
+ *
+ * Instead of forwarding every sample to the controller, the samples of each UE
+ * are collected during the reporting window of the trigger and only their
+ * summary leaves the agent.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <emlog.h>
+
+#include "agent.h"
+#include "meas.h"
+
+/* Range of values handled by counting instead of sorting. */
+#define MEAS_HIST_SIZE			512
+/* Samples per window which the kernels can sum without overflowing. */
+#define MEAS_MAX_SAMPLES		65536
+
+/* Vector of samples processed at once by the kernels; the compiler maps it on
+ * the widest registers available, or splits it on narrower ones.
+ */
+typedef int32_t meas_vec __attribute__ ((vector_size (32)));
+/* Same lanes widened to 64 bits, to sum them without overflowing. */
+typedef int64_t meas_wide __attribute__ ((vector_size (64)));
+
+#define MEAS_LANES			(sizeof(meas_vec) / sizeof(int32_t))
+
+/******************************************************************************
+ * Kernels.                                                                   *
+ ******************************************************************************/
+
+/* Minimum, maximum and sum of the samples in a single pass. */
+static void meas_kernel(
+	const int32_t * v,
+	unsigned int    n,
+	int32_t *       min,
+	int32_t *       max,
+	int64_t *       sum)
+{
+	meas_vec     x;
+	meas_vec     m;
+	meas_vec     vmin;
+	meas_vec     vmax;
+	meas_wide    vsum = {0};
+
+	unsigned int i = 0;
+	unsigned int j;
+
+	*min = v[0];
+	*max = v[0];
+	*sum = 0;
+
+	if(n >= MEAS_LANES) {
+		memcpy(&vmin, v, sizeof(meas_vec));
+		vmax = vmin;
+
+		/* Branch-less selection on the comparison masks. */
+		for(; i + MEAS_LANES <= n; i += MEAS_LANES) {
+			memcpy(&x, v + i, sizeof(meas_vec));
+
+			m    = x < vmin;
+			vmin = (x & m) | (vmin & ~m);
+			m    = x > vmax;
+			vmax = (x & m) | (vmax & ~m);
+			vsum = vsum + __builtin_convertvector(x, meas_wide);
+		}
+
+		for(j = 0; j < MEAS_LANES; j++) {
+			*min  = vmin[j] < *min ? vmin[j] : *min;
+			*max  = vmax[j] > *max ? vmax[j] : *max;
+			*sum += vsum[j];
+		}
+	}
+
+	for(; i < n; i++) {
+		*min  = v[i] < *min ? v[i] : *min;
+		*max  = v[i] > *max ? v[i] : *max;
+		*sum += v[i];
+	}
+}
+
+static int meas_cmp(const void * a, const void * b)
+{
+	int32_t x = *(const int32_t *)a;
+	int32_t y = *(const int32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Percentiles 10, 50 and 90 of the samples, with the nearest-rank method. The
+ * samples can be reordered.
+ */
+static void meas_percentiles(
+	int32_t *      v,
+	unsigned int   n,
+	int32_t        min,
+	int32_t        max,
+	int32_t *      p)
+{
+	static const unsigned int pc[3] = {10, 50, 90};
+
+	uint32_t     h[MEAS_HIST_SIZE];
+	unsigned int r[3];
+	unsigned int c = 0;
+	unsigned int i;
+	unsigned int k = 0;
+	int64_t      range;
+
+	for(i = 0; i < 3; i++) {
+		r[i] = (pc[i] * n + 99) / 100;
+		r[i] = r[i] ? r[i] : 1;
+	}
+
+	/* In 64 bits, since far samples overflow once subtracted. */
+	range = (int64_t)max - min;
+
+	/* Reported quantities have small ranges: just count them. */
+	if(range < MEAS_HIST_SIZE) {
+		memset(h, 0, sizeof(uint32_t) * (range + 1));
+
+		for(i = 0; i < n; i++) {
+			h[v[i] - min]++;
+		}
+
+		for(i = 0; i <= range && k < 3; i++) {
+			c += h[i];
+
+			while(k < 3 && c >= r[k]) {
+				p[k++] = min + i;
+			}
+		}
+
+		return;
+	}
+
+	qsort(v, n, sizeof(int32_t), meas_cmp);
+
+	for(k = 0; k < 3; k++) {
+		p[k] = v[r[k] - 1];
+	}
+}
+
+/* Moving average of the samples in arrival order, starting from 'e'. */
+static float meas_ewma(
+	const int32_t * v,
+	unsigned int    n,
+	unsigned int    first,
+	unsigned int    size,
+	float           w,
+	float           e)
+{
+	unsigned int i;
+	unsigned int j = first;
+
+	for(i = 0; i < n; i++) {
+		e += w * ((float)v[j] - e);
+		j  = j + 1 < size ? j + 1 : 0;
+	}
+
+	return e;
+}
+
+/* Reduce one quantity of a window. */
+static void meas_stat(
+	int32_t *             v,
+	struct meas_window *  mw,
+	unsigned int          size,
+	float                 w,
+	float *               ewma,
+	struct em_meas_stat * s)
+{
+	int64_t      sum;
+	int32_t      p[3];
+	unsigned int first = mw->n < size ? 0 : mw->w;
+
+	/* Seed the average with the first sample ever seen. */
+	if(!mw->ewma) {
+		*ewma = (float)v[first];
+	}
+
+	*ewma = meas_ewma(v, mw->n, first, size, w, *ewma);
+
+	meas_kernel(v, mw->n, &s->min, &s->max, &sum);
+	meas_percentiles(v, mw->n, s->min, s->max, p);
+
+	s->mean = (float)sum / mw->n;
+	s->p10  = p[0];
+	s->p50  = p[1];
+	s->p90  = p[2];
+	s->ewma = *ewma;
+}
+
+/******************************************************************************
+ * Public procedures.                                                         *
+ ******************************************************************************/
+
+int meas_add(
+	struct meas_context * mc,
+	int tid, uint16_t rnti, int32_t rsrp, int32_t rsrq)
+{
+	struct meas_window * mw = 0;
+	int found = 0;
+
+	lock_take(&mc->lock);
+	list_for_each_entry(mw, &mc->ws, next) {
+		if(mw->tid == tid && mw->rnti == rnti) {
+			found = 1;
+			break;
+		}
+	}
+
+	if(!found) {
+		mw = mem_alloc(
+			agent_mem(mc, meas),
+			EM_MEM_TRIGGERS,
+			sizeof(struct meas_window));
+
+		if(!mw) {
+			lock_drop(&mc->lock);
+			EMLOG("No more memory!");
+			return -1;
+		}
+
+		memset(mw, 0, sizeof(struct meas_window));
+
+		mw->rsrp = mem_alloc(
+			agent_mem(mc, meas),
+			EM_MEM_TRIGGERS,
+			sizeof(int32_t) * mc->max);
+		mw->rsrq = mem_alloc(
+			agent_mem(mc, meas),
+			EM_MEM_TRIGGERS,
+			sizeof(int32_t) * mc->max);
+
+		if(!mw->rsrp || !mw->rsrq) {
+			lock_drop(&mc->lock);
+			EMLOG("No more memory!");
+
+			mem_free(mw->rsrp);
+			mem_free(mw->rsrq);
+			mem_free(mw);
+			return -1;
+		}
+
+		INIT_LIST_HEAD(&mw->next);
+		mw->tid  = tid;
+		mw->rnti = rnti;
+
+		list_add_tail(&mw->next, &mc->ws);
+	}
+
+	mw->rsrp[mw->w] = rsrp;
+	mw->rsrq[mw->w] = rsrq;
+
+	mw->w = mw->w + 1 < mc->max ? mw->w + 1 : 0;
+	mw->n = mw->n < mc->max ? mw->n + 1 : mw->n;
+	lock_drop(&mc->lock);
+
+	return 0;
+}
+
+int meas_reduce(
+	struct meas_context * mc,
+	int tid, struct em_meas_summary * s, int max)
+{
+	struct meas_window * mw = 0;
+
+	int   i = 0;
+	float w = (float)mc->weight / 100;
+
+	lock_take(&mc->lock);
+	list_for_each_entry(mw, &mc->ws, next) {
+		if(i >= max) {
+			break;
+		}
+
+		if(mw->tid != tid || mw->n == 0) {
+			continue;
+		}
+
+		s[i].rnti    = mw->rnti;
+		s[i].samples = mw->n;
+
+		meas_stat(mw->rsrp, mw, mc->max, w, &mw->ewma_rsrp, &s[i].rsrp);
+		meas_stat(mw->rsrq, mw, mc->max, w, &mw->ewma_rsrq, &s[i].rsrq);
+
+		/* Start a new window. */
+		mw->ewma = 1;
+		mw->n    = 0;
+		mw->w    = 0;
+
+		i++;
+	}
+	lock_drop(&mc->lock);
+
+	return i;
+}
+
+int meas_del(struct meas_context * mc, int tid)
+{
+	struct meas_window * mw = 0;
+	struct meas_window * t  = 0;
+
+	lock_take(&mc->lock);
+	list_for_each_entry_safe(mw, t, &mc->ws, next) {
+		if(tid && mw->tid != tid) {
+			continue;
+		}
+
+		list_del(&mw->next);
+
+		mem_free(mw->rsrp);
+		mem_free(mw->rsrq);
+		mem_free(mw);
+	}
+	lock_drop(&mc->lock);
+
+	return 0;
+}
+
+int meas_init(
+	struct meas_context * mc, unsigned int max, unsigned int weight)
+{
+	INIT_LIST_HEAD(&mc->ws);
+
+	mc->max    = max ? max : MEAS_DEF_SAMPLES;
+	mc->max    = mc->max < MEAS_MAX_SAMPLES ? mc->max : MEAS_MAX_SAMPLES;
+	mc->weight = weight ? weight : MEAS_DEF_EWMA;
+	mc->weight = mc->weight < 100 ? mc->weight : 100;
+
+	lock_init(&mc->lock);
+
+	return 0;
+}
+
+int meas_release(struct meas_context * mc)
+{
+	lock_destroy(&mc->lock);
+
+	return 0;
+}
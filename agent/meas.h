@@ -0,0 +1,107 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal measurements reduction logic.
+ */
+
+#ifndef __EMAGE_MEAS_H
+#define __EMAGE_MEAS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <emage.h>
+
+#include "emlist.h"
+#include "lock.h"
+
+/* Default maximum number of samples kept per UE in a window. */
+#define MEAS_DEF_SAMPLES		1024
+/* Default weight, in percent, of a new sample in the moving average. */
+#define MEAS_DEF_EWMA			10
+
+/* Samples of a UE collected for a trigger during the current window.
+ *
+ * Quantities are kept in separate arrays, so that each one can be reduced with
+ * a single pass over contiguous memory.
+ */
+struct meas_window {
+	/* Member of a list. */
+	struct list_head next;
+
+	/* Trigger which the samples belong to. */
+	int tid;
+	/* UE measured. */
+	uint16_t rnti;
+
+	/* Number of samples in the window. */
+	unsigned int n;
+	/* Next slot to write; once full, the oldest samples are overwritten. */
+	unsigned int w;
+
+	/* Samples of the measured quantities. */
+	int32_t * rsrp;
+	int32_t * rsrq;
+
+	/* Moving averages, kept across windows. */
+	float ewma_rsrp;
+	float ewma_rsrq;
+	/* A value different than 0 means the moving averages are valid. */
+	int ewma;
+};
+
+/* Measurements reduction context for an agent. */
+struct meas_context {
+	/* Windows of samples. */
+	struct list_head ws;
+
+	/* Maximum number of samples kept per window. */
+	unsigned int max;
+	/* Weight, in percent, of a new sample in the moving average. */
+	unsigned int weight;
+
+	/* Lock for this context. */
+	lock_t lock;
+};
+
+/* Add a sample of a UE to the current window of a trigger.
+ *
+ * Returns 0 on success, otherwise a negative error number.
+ */
+int meas_add(
+	struct meas_context * mc,
+	int tid, uint16_t rnti, int32_t rsrp, int32_t rsrq);
+
+/* Reduce the windows of a trigger to their summaries and start new windows.
+ * Up to 'max' summaries are filled, one for each UE having samples.
+ *
+ * Returns the number of summaries filled.
+ */
+int meas_reduce(
+	struct meas_context * mc,
+	int tid, struct em_meas_summary * s, int max);
+
+/* Drop the windows of a trigger, or all of them if 'tid' is 0. */
+int meas_del(struct meas_context * mc, int tid);
+
+/* Initialize a measurements reduction context. */
+int meas_init(
+	struct meas_context * mc, unsigned int max, unsigned int weight);
+
+/* Release the resources of a measurements reduction context. */
+int meas_release(struct meas_context * mc);
+
+#endif /* __EMAGE_MEAS_H */
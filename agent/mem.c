@@ -0,0 +1,348 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal memory logic.
+ *
+ * Blocks are allocated and released by different threads of the agent (a job
+ * is created by the wrapper and freed by the scheduler), so the header of each
+ * block remembers its owner, and the size from which the class is found. The
+ * counters per kind are updated atomically, out of the lock of the arena.
+ *
+ * The arenas, and anything else of the library, take their memory from the
+ * allocator given by the user, if any, and from malloc otherwise.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+#include "stats.h"
+
+/* Allocator of the library; fixed once the first block is taken from it. */
+static struct em_allocator mem_sys;
+static int                 mem_sys_fixed;
+
+/******************************************************************************
+ * Allocator                                                                  *
+ ******************************************************************************/
+
+void * mem_sys_alloc(int owner, size_t size)
+{
+	if(!__atomic_load_n(&mem_sys_fixed, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&mem_sys_fixed, 1, __ATOMIC_RELEASE);
+	}
+
+	if(mem_sys.alloc) {
+		return mem_sys.alloc(mem_sys.arg, owner, size);
+	}
+
+	return malloc(size);
+}
+
+void mem_sys_free(int owner, void * ptr, size_t size)
+{
+	if(mem_sys.free) {
+		mem_sys.free(mem_sys.arg, owner, ptr, size);
+		return;
+	}
+
+	free(ptr);
+}
+
+int em_set_allocator(const struct em_allocator * alloc)
+{
+	if(!alloc || !alloc->alloc || !alloc->free) {
+		return -1;
+	}
+
+	if(!__sync_bool_compare_and_swap(&mem_sys_fixed, 0, 1)) {
+		return -1;
+	}
+
+	mem_sys = *alloc;
+
+	return 0;
+}
+
+/******************************************************************************
+ * Arenas                                                                     *
+ ******************************************************************************/
+
+/* Size class of a block, header included, which is not too big. */
+static inline int mem_class(size_t total)
+{
+	if(total <= (1 << MEM_MIN_SHIFT)) {
+		return 0;
+	}
+
+	return 64 - __builtin_clzll(total - 1) - MEM_MIN_SHIFT;
+}
+
+static void mem_account(struct mem_context * mc, int type, int64_t size)
+{
+	uint64_t used = stats_add(mc->used[type], size) + size;
+
+	if(size > 0) {
+		stats_peak(&mc->peak[type], used);
+	}
+}
+
+/* Can the agent hold a block more? */
+static int mem_room(struct mem_context * mc, size_t size)
+{
+	if(mc->limit && mc->held + size > mc->limit) {
+		stats_add(mc->refused, 1);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Take a new chunk; the rest of the last one is lost. */
+static int mem_grow(struct mem_context * mc)
+{
+	struct mem_chunk * c;
+
+	c = mem_sys_alloc(mc->owner, MEM_CHUNK);
+
+	if(!c) {
+		return -1;
+	}
+
+	c->next    = mc->chunks;
+	mc->chunks = c;
+
+	mc->top       = (char *)(c + 1);
+	mc->left      = MEM_CHUNK - sizeof(struct mem_chunk);
+	mc->reserved += MEM_CHUNK;
+
+	return 0;
+}
+
+static struct mem_hdr * mem_alloc_large(struct mem_context * mc, size_t total)
+{
+	struct mem_large * l = 0;
+
+	total += sizeof(struct mem_large);
+
+	lock_take(&mc->lock);
+	if(mem_room(mc, total)) {
+		l = mem_sys_alloc(mc->owner, total);
+
+		if(l) {
+			list_add(&l->next, &mc->large);
+			mc->reserved += total;
+			mc->held     += total;
+		}
+	}
+	lock_drop(&mc->lock);
+
+	return l ? (struct mem_hdr *)(l + 1) : 0;
+}
+
+static struct mem_hdr * mem_alloc_small(struct mem_context * mc, size_t total)
+{
+	int    c = mem_class(total);
+	size_t s = 1 << (c + MEM_MIN_SHIFT);
+	void * b = 0;
+
+	lock_take(&mc->lock);
+	if(!mem_room(mc, s)) {
+		/* Over the limit. */
+	} else if(mc->free[c]) {
+		b = mc->free[c];
+		mc->free[c] = *(void **)b;
+	} else if(mc->left >= s || mem_grow(mc) == 0) {
+		b = mc->top;
+		mc->top  += s;
+		mc->left -= s;
+	}
+
+	if(b) {
+		mc->held += s;
+	}
+	lock_drop(&mc->lock);
+
+	return b;
+}
+
+void * mem_alloc(struct mem_context * mc, int type, size_t size)
+{
+	size_t           total = sizeof(struct mem_hdr) + size;
+	struct mem_hdr * h;
+
+	if(total > (1 << MEM_MAX_SHIFT)) {
+		h = mem_alloc_large(mc, total);
+	} else {
+		h = mem_alloc_small(mc, total);
+	}
+
+	if(!h) {
+		return 0;
+	}
+
+	h->mc   = mc;
+	h->size = size;
+	h->type = type;
+
+	mem_account(mc, type, size);
+
+	return h + 1;
+}
+
+void * mem_realloc(
+	struct mem_context * mc, int type, void * ptr, size_t size)
+{
+	struct mem_hdr * h;
+	void *           n;
+	size_t           old;
+
+	if(!ptr) {
+		return mem_alloc(mc, type, size);
+	}
+
+	h   = (struct mem_hdr *)ptr - 1;
+	old = sizeof(struct mem_hdr) + h->size;
+
+	/* Still fits in the same block. */
+	if(old <= (1 << MEM_MAX_SHIFT) &&
+		sizeof(struct mem_hdr) + size <= (1 << MEM_MAX_SHIFT) &&
+		mem_class(old) == mem_class(sizeof(struct mem_hdr) + size)) {
+
+		mem_account(h->mc, h->type, (int64_t)size - h->size);
+		h->size = size;
+
+		return ptr;
+	}
+
+	n = mem_alloc(h->mc, h->type, size);
+
+	if(!n) {
+		return 0;
+	}
+
+	memcpy(n, ptr, h->size < size ? h->size : size);
+	mem_free(ptr);
+
+	return n;
+}
+
+char * mem_strdup(struct mem_context * mc, int type, const char * str)
+{
+	size_t len = strlen(str) + 1;
+	char * s   = mem_alloc(mc, type, len);
+
+	if(s) {
+		memcpy(s, str, len);
+	}
+
+	return s;
+}
+
+void mem_free(void * ptr)
+{
+	struct mem_hdr *     h;
+	struct mem_large *   l;
+	struct mem_context * mc;
+	size_t               total;
+	int                  c;
+
+	if(!ptr) {
+		return;
+	}
+
+	h     = (struct mem_hdr *)ptr - 1;
+	mc    = h->mc;
+	total = sizeof(struct mem_hdr) + h->size;
+
+	mem_account(mc, h->type, -(int64_t)h->size);
+
+	if(total > (1 << MEM_MAX_SHIFT)) {
+		l = (struct mem_large *)h - 1;
+
+		lock_take(&mc->lock);
+		list_del(&l->next);
+		mc->reserved -= total + sizeof(struct mem_large);
+		mc->held     -= total + sizeof(struct mem_large);
+		lock_drop(&mc->lock);
+
+		mem_sys_free(mc->owner, l, total + sizeof(struct mem_large));
+		return;
+	}
+
+	c = mem_class(total);
+
+	lock_take(&mc->lock);
+	*(void **)h = mc->free[c];
+	mc->free[c] = h;
+	mc->held   -= 1 << (c + MEM_MIN_SHIFT);
+	lock_drop(&mc->lock);
+}
+
+void mem_read(struct mem_context * mc, struct em_stats * st)
+{
+	int i;
+
+	for(i = 0; i < EM_MEM_MAX; i++) {
+		st->mem[i]      = stats_get(mc->used[i]);
+		st->mem_peak[i] = stats_get(mc->peak[i]);
+	}
+
+	st->mem_reserved = stats_get(mc->reserved);
+	st->mem_refused  = stats_get(mc->refused);
+}
+
+int mem_init(struct mem_context * mc, int owner, uint64_t limit)
+{
+	memset(mc, 0, sizeof(struct mem_context));
+
+	INIT_LIST_HEAD(&mc->large);
+	mc->owner = owner;
+	mc->limit = limit;
+
+	if(lock_init(&mc->lock)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void mem_release(struct mem_context * mc)
+{
+	struct mem_chunk * c;
+	struct mem_large * l;
+	struct mem_large * t;
+	struct mem_hdr *   h;
+
+	while(mc->chunks) {
+		c          = mc->chunks;
+		mc->chunks = c->next;
+
+		mem_sys_free(mc->owner, c, MEM_CHUNK);
+	}
+
+	list_for_each_entry_safe(l, t, &mc->large, next) {
+		h = (struct mem_hdr *)(l + 1);
+
+		list_del(&l->next);
+		mem_sys_free(
+			mc->owner,
+			l,
+			sizeof(struct mem_large) + sizeof(struct mem_hdr) + h->size);
+	}
+
+	lock_destroy(&mc->lock);
+}
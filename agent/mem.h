@@ -0,0 +1,141 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal memory logic.
+ */
+
+#ifndef __EMAGE_MEM_H
+#define __EMAGE_MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <emage.h>
+
+#include "emlist.h"
+#include "lock.h"
+
+/* Memory taken from the system at once for the small blocks. */
+#define MEM_CHUNK                               (64 * 1024)
+/* Smallest and biggest block of the size classes, as powers of two; bigger
+ * blocks are allocated on their own.
+ */
+#define MEM_MIN_SHIFT                           5
+#define MEM_MAX_SHIFT                           14
+#define MEM_CLASSES                     (MEM_MAX_SHIFT - MEM_MIN_SHIFT + 1)
+
+struct mem_context;
+
+/* Prepended to every block, so that it can be released without knowing which
+ * agent owns it and how big it is.
+ */
+struct mem_hdr {
+	struct mem_context * mc;
+	uint32_t             size;
+	uint32_t             type;
+};
+
+/* Memory taken from the system for the small blocks. */
+struct mem_chunk {
+	struct mem_chunk * next;
+	uint64_t           pad;
+};
+
+/* Prepended to the header of a block allocated on its own. */
+struct mem_large {
+	struct list_head next;
+};
+
+/* Memory of an agent: small blocks are carved from chunks and reused through a
+ * free list per size class, big ones are allocated on their own. Everything is
+ * given back at once when the agent goes away.
+ */
+struct mem_context {
+	/* Bytes in use and the most there have been, per 'em_mem_type'. */
+	uint64_t used[EM_MEM_MAX];
+	uint64_t peak[EM_MEM_MAX];
+
+	/* Bytes taken from the system, and bytes of the blocks given out. */
+	uint64_t reserved;
+	uint64_t held;
+	/* Bytes of blocks which can be given out at once; 0 means no limit.
+	 * Released blocks are kept for their size class, so the memory taken
+	 * from the system can be more than this, after bursts in different
+	 * classes.
+	 */
+	uint64_t limit;
+	/* Allocations refused because of the limit. */
+	uint64_t refused;
+
+	/* Chunks, and the part of the last one not used yet. */
+	struct mem_chunk * chunks;
+	char *             top;
+	size_t             left;
+	/* Released blocks, per size class. */
+	void *             free[MEM_CLASSES];
+	/* Blocks allocated on their own. */
+	struct list_head   large;
+
+	/* Agent which owns the memory, for the allocator. */
+	int    owner;
+	/* Lock for this context. */
+	lock_t lock;
+};
+
+/* Take memory from the allocator of the library; 'owner' is the agent which
+ * uses it, or -1. See 'em_set_allocator'.
+ */
+void * mem_sys_alloc(int owner, size_t size);
+
+/* Give back memory taken with 'mem_sys_alloc', of the given size. */
+void mem_sys_free(int owner, void * ptr, size_t size);
+
+/* Initialize the memory of an agent, which can hold at most 'limit' bytes in
+ * blocks, headers and rounding to the size class included; 0 means no limit.
+ *
+ * Returns 0 on success, otherwise a negative number.
+ */
+int mem_init(struct mem_context * mc, int owner, uint64_t limit);
+
+/* Give back all the memory of an agent, whatever has been released or not. */
+void mem_release(struct mem_context * mc);
+
+/* Allocate a block of the given kind, see 'em_mem_type', for an agent.
+ *
+ * Returns the block, or a null pointer if there is no memory or the limit of
+ * the agent has been reached.
+ */
+void * mem_alloc(struct mem_context * mc, int type, size_t size);
+
+/* Resize a block; a null block is allocated with the given owner and kind,
+ * otherwise the ones of the block are kept.
+ *
+ * Returns the new block, or a null pointer if there is no memory; in this case
+ * the old block is untouched.
+ */
+void * mem_realloc(
+	struct mem_context * mc, int type, void * ptr, size_t size);
+
+/* Copy a string in a block of the given kind. */
+char * mem_strdup(struct mem_context * mc, int type, const char * str);
+
+/* Release a block; a null pointer is ignored. */
+void mem_free(void * ptr);
+
+/* Copy the counters of the context into the metrics given to the user. */
+void mem_read(struct mem_context * mc, struct em_stats * st);
+
+#endif /* __EMAGE_MEM_H */
@@ -30,6 +30,7 @@
 #include <netinet/tcp.h>
 
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -45,38 +46,33 @@
 #include "sched.h"
 
 #define NET_WAIT_TIME           300      /* 300ms in usec */
+#define NET_SEND_TIMEOUT        1000     /* 1 second in ms */
+#define NET_STANDBY_RETRY       1        /* 1 second */
+#define NET_HELLO_TIME          2000     /* 2 seconds in ms */
+#define NET_HELLO_TICK          250      /* Shortest Hello period, in ms */
+#define NET_LINK_TIMEOUT        10000    /* 10 seconds in ms */
+#define NET_RTT_EVERY           10       /* Hello intervals per RTT sample */
+
+int net_sched_job(
+	struct agent * a,
+	unsigned int id,
+	int type,
+	int interval,
+	int res,
+	struct net_msg * msg);
 
 #ifdef EM_DISSECT_MSG
 
 void net_show_msg(char * buf, int size, int send)
 {
-	int i;
-
 	EMDBG("Dissecting message, size=%d", size);
 
-	if(send) {
-		printf("-------------------------------------------------->\n");
-	} else {
-		printf("<--------------------------------------------------\n");
-	}
-
-	printf("    00 01 02 03 04 05 06 07 08 09 0a 0b 0c 0d 0e 0f\n");
-
-	for(i = 0; i < size; i++) {
-		if(i % 16 == 0) {
-			printf("\n%03x ", i);
-		}
-
-		printf("%02x ", (unsigned char)buf[i]);
-	}
-
-	if(send) {
-		printf(
-		"\n-------------------------------------------------->\n");
-	} else {
-		printf(
-		"\n<--------------------------------------------------\n");
-	}
+	em_log_hex(
+		EM_LOG_DEBUG,
+		send ? "-------------------------------------------------->" :
+			"<--------------------------------------------------",
+		buf,
+		size);
 }
 
 #endif /* EM_DISSECT_MSG */
@@ -92,17 +88,50 @@ int net_connected(struct net_context * net) {
 
 	EMDBG("Connected to controller %s:%d", net->addr, net->port);
 	net->status = EM_STATUS_CONNECTED;
+	stats_add(a->stats.connects, 1);
+
+	/* The first reports after a reconnection are always full ones. */
+	delta_reset(&a->delta);
+	rate_reset(&a->rate);
+
+	a->sched.offline = 0;
 
-	h = malloc(sizeof(struct sched_job));
+	/* Back within the grace time: the controller has now the same time to
+	 * confirm the triggers it still wants.
+	 */
+	if(sched_find_job(&a->sched, 0, JOB_TYPE_RESYNC)) {
+		add_resync_job(a);
+	}
+
+	/* Send what has been kept while disconnected. */
+	if(!backlog_empty(&a->backlog)) {
+		net_sched_job(a, 0, JOB_TYPE_REPLAY, 1, 0, 0);
+	}
+
+	h = mem_alloc(&a->mem, EM_MEM_JOBS, sizeof(struct sched_job));
 
 	if(!h) {
 		EMLOG("No more memory!");
 		return -1;
 	}
 
+	memset(h, 0, sizeof(struct sched_job));
+
 	INIT_LIST_HEAD(&h->next);
+	net->hello = NET_HELLO_TIME;
+	net->rtt_every = a->conf.rtt_every ? a->conf.rtt_every : NET_RTT_EVERY;
+
+	/* Replies to the requests of the old connection will not come. */
+	lock_take(&net->lock);
+	memset(net->pend, 0, sizeof(net->pend));
+	lock_drop(&net->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &net->last_tx);
+	net->last_rx    = net->last_tx;
+	net->last_hello = net->last_tx;
+
 	h->id         = 0;
-	h->elapse     = 2000;
+	h->elapse     = net_hello_tick(net);
 	h->type       = JOB_TYPE_HELLO;
 	h->reschedule = -1;
 
@@ -112,16 +141,99 @@ int net_connected(struct net_context * net) {
 	return 0;
 }
 
+int net_hello_tick(struct net_context * net)
+{
+	int t = net->hello / 4;
+
+	return t < NET_HELLO_TICK ? NET_HELLO_TICK : t;
+}
+
+void net_hello_sent(
+	struct net_context * net, uint32_t seq, struct timespec * sent)
+{
+	struct net_hello * h;
+
+	lock_take(&net->lock);
+	h = &net->pend[net->npend++ % NET_HELLO_PENDING];
+	h->used = 1;
+	h->seq  = seq;
+	h->sent = *sent;
+	lock_drop(&net->lock);
+}
+
+/* Match a Hello reply with its request, and account the round trip. */
+void net_hello_reply(struct net_context * net, uint32_t seq)
+{
+	struct agent *  a = container_of(net, struct agent, net);
+	struct timespec now;
+	struct timespec sent;
+
+	int i;
+	int found = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	lock_take(&net->lock);
+	for(i = 0; i < NET_HELLO_PENDING; i++) {
+		if(net->pend[i].used && net->pend[i].seq == seq) {
+			net->pend[i].used = 0;
+			sent  = net->pend[i].sent;
+			found = 1;
+			break;
+		}
+	}
+	lock_drop(&net->lock);
+
+	if(!found) {
+		return;
+	}
+
+	stats_rtt(&a->stats,
+		(int64_t)(now.tv_sec - sent.tv_sec) * 1000000 +
+		(now.tv_nsec - sent.tv_nsec) / 1000);
+}
+
 unsigned int net_next_seq(struct net_context * net) {
 	int ret = 0;
 
-	pthread_spin_lock(&net->lock);
+	lock_take(&net->lock);
 	ret = net->seq++;
-	pthread_spin_unlock(&net->lock);
+	lock_drop(&net->lock);
 
 	return ret;
 }
 
+/* Have the kernel detect a dead controller in bounded time, even when nothing
+ * is being sent: keepalive probes cover the idle link, while the user timeout
+ * covers data which is never acknowledged.
+ */
+int net_alive_socket(struct net_context * net, int sockfd)
+{
+	struct agent * a = container_of(net, struct agent, net);
+
+	unsigned int to = a->conf.link_timeout ?
+		a->conf.link_timeout : NET_LINK_TIMEOUT;
+	int on  = 1;
+	int cnt = 3;
+	int idl = to / 1000 / (cnt + 1);
+
+	if(idl < 1) {
+		idl = 1;
+	}
+
+	if(setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) ||
+		setsockopt(sockfd, SOL_TCP, TCP_KEEPIDLE, &idl, sizeof(idl)) ||
+		setsockopt(sockfd, SOL_TCP, TCP_KEEPINTVL, &idl, sizeof(idl)) ||
+		setsockopt(sockfd, SOL_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) ||
+		setsockopt(sockfd, SOL_TCP, TCP_USER_TIMEOUT, &to, sizeof(to))) {
+
+		EMLOG("Could not enable the link timeout on the socket!");
+		return -1;
+	}
+
+	return 0;
+}
+
 /* Turn the socket in an non-blocking one. */
 int net_noblock_socket(int sockfd) {
 	int flags = fcntl(sockfd, F_GETFL, 0);
@@ -154,8 +266,14 @@ int net_nodelay_socket(int sockfd) {
 }
 
 int net_not_connected(struct net_context * net) {
+	struct agent * a = container_of(net, struct agent, net);
+
 	EMDBG("No more connected with controller!");
 
+	if(net->status == EM_STATUS_CONNECTED) {
+		clock_gettime(CLOCK_MONOTONIC, &net->down);
+	}
+
 	if(net->sockfd > 0) {
 		close(net->sockfd);
 		net->sockfd = -1;
@@ -164,6 +282,66 @@ int net_not_connected(struct net_context * net) {
 	net->status = EM_STATUS_NOT_CONNECTED;
 	net->seq = 0;
 
+	/* Let the scheduler clean up as soon as possible. */
+	sched_wake(&a->sched);
+
+	return 0;
+}
+
+/* Select the controller to use. */
+void net_use_endpoint(struct net_context * net, unsigned int ep)
+{
+	net->cur = ep;
+
+	memcpy(net->addr, net->eps[ep].addr, sizeof(net->addr));
+	net->port = net->eps[ep].port;
+}
+
+int net_add_endpoint(
+	struct net_context * net, const char * addr, unsigned short port)
+{
+	struct net_endpoint * e;
+
+	/* The controller given at start comes first. */
+	if(!net->neps) {
+		memcpy(net->eps[0].addr, net->addr, sizeof(net->addr));
+		net->eps[0].port = net->port;
+		net->neps        = 1;
+	}
+
+	if(!addr) {
+		return 0;
+	}
+
+	if(net->neps >= NET_MAX_ENDPOINTS) {
+		EMLOG("Too many controllers, %s:%d ignored", addr, port);
+		return -1;
+	}
+
+	e = &net->eps[net->neps++];
+
+	strncpy(e->addr, addr, sizeof(e->addr) - 1);
+	e->port = port;
+
+	return 0;
+}
+
+/* Fill the address of a controller. */
+int net_resolve(struct net_endpoint * e, struct sockaddr_in * sa)
+{
+	struct hostent * ctrli = gethostbyname(e->addr);
+
+	if(!ctrli) {
+		EMLOG("Could not resolve controller %s!", e->addr);
+		return -1;
+	}
+
+	memset(sa, 0, sizeof(struct sockaddr_in));
+
+	sa->sin_family = AF_INET;
+	memcpy(&sa->sin_addr.s_addr, ctrli->h_addr, ctrli->h_length);
+	sa->sin_port = htons(e->port);
+
 	return 0;
 }
 
@@ -177,7 +355,6 @@ int net_connect_to_controller(struct net_context * net) {
 	int status = 0;
 
 	struct sockaddr_in srvaddr = {0};
-	struct hostent * ctrli = 0;
 
 	if(net->sockfd < 0) {
 		status = socket(AF_INET, SOCK_STREAM, 0);
@@ -193,26 +370,15 @@ int net_connect_to_controller(struct net_context * net) {
 	else if (status > 0) {
 		net->sockfd = status;
 		net_nodelay_socket(net->sockfd);
+		net_alive_socket(net, net->sockfd);
 	}
 
 	EMDBG("Connecting to %s:%d...", net->addr, net->port);
 
-	ctrli = gethostbyname(net->addr);
-
-	if(!ctrli) {
-		EMLOG("Could not resolve controller!");
-		perror("gethostbyname");
-
+	if(net_resolve(&net->eps[net->cur], &srvaddr)) {
 		return -1;
 	}
 
-	srvaddr.sin_family = AF_INET;
-	memcpy(
-		&srvaddr.sin_addr.s_addr,
-		ctrli->h_addr,
-		ctrli->h_length);
-	srvaddr.sin_port = htons(net->port);
-
 	status = connect(
 		net->sockfd,
 		(struct sockaddr *)&srvaddr,
@@ -223,19 +389,189 @@ int net_connect_to_controller(struct net_context * net) {
 			net->addr,
 			status);
 
+		/* Try the next controller, with a fresh socket. */
+		if(net->neps > 1) {
+			close(net->sockfd);
+			net->sockfd = -1;
+
+			net_use_endpoint(net, (net->cur + 1) % net->neps);
+		}
+
 		return -1;
 	}
 
 	return 0;
 }
 
+/******************************************************************************
+ * Standby connection.                                                        *
+ ******************************************************************************/
+
+void net_standby_close(struct net_context * net)
+{
+	if(net->sbfd >= 0) {
+		close(net->sbfd);
+	}
+
+	net->sbfd = -1;
+	net->sbok = 0;
+}
+
+/* Start connecting, without waiting, to the controller after the current one;
+ * the connection will be ready in case of failure of the current one.
+ */
+int net_standby_open(struct net_context * net)
+{
+	struct sockaddr_in sa;
+
+	net->sbep = (net->cur + 1) % net->neps;
+	net->sbfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &net->sbretry);
+	net->sbretry.tv_sec += NET_STANDBY_RETRY;
+
+	if(net->sbfd < 0) {
+		return -1;
+	}
+
+	net_noblock_socket(net->sbfd);
+
+	if(net_resolve(&net->eps[net->sbep], &sa) ||
+		(connect(net->sbfd, (struct sockaddr *)&sa, sizeof(sa)) &&
+		errno != EINPROGRESS)) {
+
+		net_standby_close(net);
+		return -1;
+	}
+
+	EMDBG("Standby connection to %s:%d",
+		net->eps[net->sbep].addr, net->eps[net->sbep].port);
+
+	return 0;
+}
+
+/* Keep the standby connection up, and find out when it breaks. */
+void net_standby_check(struct net_context * net)
+{
+	struct pollfd   p;
+	struct timespec now;
+	char            buf[EP_HEADER_SIZE];
+
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if(net->neps < 2) {
+		return;
+	}
+
+	if(net->sbfd < 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if(now.tv_sec >= net->sbretry.tv_sec) {
+			net_standby_open(net);
+		}
+
+		return;
+	}
+
+	p.fd      = net->sbfd;
+	p.events  = net->sbok ? POLLIN : POLLOUT;
+	p.revents = 0;
+
+	if(poll(&p, 1, 0) <= 0) {
+		return;
+	}
+
+	/* Connection attempt over. */
+	if(!net->sbok) {
+		if(getsockopt(net->sbfd, SOL_SOCKET, SO_ERROR, &err, &len) ||
+			err) {
+
+			net_standby_close(net);
+			return;
+		}
+
+		net_nodelay_socket(net->sbfd);
+		net_alive_socket(net, net->sbfd);
+		net->sbok = 1;
+
+		EMDBG("Standby connection ready");
+		return;
+	}
+
+	/* Nothing is expected on the standby connection: discard it, and look
+	 * for the controller closing it.
+	 */
+	while((err = recv(net->sbfd, buf, sizeof(buf), MSG_DONTWAIT)) > 0);
+
+	if(err == 0 || errno != EAGAIN) {
+		EMDBG("Standby connection lost");
+		net_standby_close(net);
+	}
+}
+
+/* Move on the standby connection, if it is ready.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int net_failover(struct net_context * net)
+{
+	struct timespec now;
+	int flags;
+
+	if(!net->sbok) {
+		/* Do not race with the main connection attempts. */
+		net_standby_close(net);
+		return -1;
+	}
+
+	if(net->sockfd >= 0) {
+		close(net->sockfd);
+	}
+
+	net->sockfd = net->sbfd;
+	net->sbfd   = -1;
+	net->sbok   = 0;
+
+	/* Back to a blocking socket, as the main one. */
+	flags = fcntl(net->sockfd, F_GETFL, 0);
+	fcntl(net->sockfd, F_SETFL, flags & ~O_NONBLOCK);
+
+	net_use_endpoint(net, net->sbep);
+	net_connected(net);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	net->failovers++;
+	net->failover_us =
+		(now.tv_sec - net->down.tv_sec) * 1000000 +
+		(now.tv_nsec - net->down.tv_nsec) / 1000;
+
+	EMLOG("Switched to controller %s:%d in %u us",
+		net->addr, net->port, net->failover_us);
+
+	return 0;
+}
+
 /* Receive data. */
 int net_recv(struct net_context * context, char * buf, unsigned int size) {
-	return recv(context->sockfd, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+	int op = recv(context->sockfd, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	if(op > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &context->last_rx);
+	}
+
+	return op;
 }
 
 /* Send data. */
 int net_send(struct net_context * context, char * buf, unsigned int size) {
+	struct agent * a = container_of(context, struct agent, net);
+
+	unsigned int  sent = 0;
+	int           op;
+	struct pollfd pfd;
+
 #ifdef EM_DISSECT_MSG
 	net_show_msg(buf, size, 1);
 #endif /* EM_DISSECT_MSG */
@@ -245,7 +581,35 @@ int net_send(struct net_context * context, char * buf, unsigned int size) {
 	 * application (SIGPIPE), we don't want that the host get disturbed by
 	 * this, and so we ask not to notify the error.
 	 */
-	return send(context->sockfd, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+	while(sent < size) {
+		op = send(context->sockfd,
+			buf + sent,
+			size - sent,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if(op < 0) {
+			/* Wait a little for room in the socket, since leaving
+			 * half of a message behind breaks the stream.
+			 */
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				pfd.fd     = context->sockfd;
+				pfd.events = POLLOUT;
+
+				if(poll(&pfd, 1, NET_SEND_TIMEOUT) > 0) {
+					continue;
+				}
+			}
+
+			return -1;
+		}
+
+		sent += op;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &context->last_tx);
+	trace_event(&a->trace, EM_TRACE_SEND, 0, 0, sent);
+
+	return sent;
 }
 
 int net_sched_job(
@@ -254,10 +618,10 @@ int net_sched_job(
 	int type,
 	int interval,
 	int res,
-	void * args,
-	unsigned int size) {
+	struct net_msg * msg) {
 
-	struct sched_job * job = malloc(sizeof(struct sched_job));
+	struct sched_job * job =
+		mem_alloc(&a->mem, EM_MEM_JOBS, sizeof(struct sched_job));
 
 	if(!job) {
 		EMLOG("Not enough memory!");
@@ -266,311 +630,538 @@ int net_sched_job(
 
 	memset(job, 0, sizeof(struct sched_job));
 
-	if(size > 0) {
-		job->args = malloc(sizeof(char) * size);
-
-		if(!job->args) {
-			free(job);
-			EMLOG("Not enough memory!");
-			return -1;
-		}
-
-		memcpy(job->args, args, sizeof(char) * size);
-	} else {
-		job->args = args;
+	if(msg) {
+		job->msg = net_msg_get(msg);
 	}
 
 	INIT_LIST_HEAD(&job->next);
 	job->type       = type;
-	job->size       = size;
 	job->id         = id;
 	job->elapse     = interval;
 	job->reschedule = res;
 
-	sched_add_job(job, &a->sched);
+	if(sched_add_job(job, &a->sched)) {
+		sched_release_job(job);
+		return -1;
+	}
 
 	return 0;
 }
 
+/******************************************************************************
+ * Messages.                                                                  *
+ ******************************************************************************/
+
+struct net_msg * net_msg_alloc(struct net_context * net, unsigned int size)
+{
+	struct net_msg * m = mem_alloc(
+		agent_mem(net, net),
+		EM_MEM_BUFFERS,
+		sizeof(struct net_msg) + size);
+
+	if(!m) {
+		return 0;
+	}
+
+	memset(m, 0, sizeof(struct net_msg));
+
+	m->ref  = 1;
+	m->buf  = (char *)(m + 1);
+	m->size = size;
+
+	return m;
+}
+
+struct net_msg * net_msg_get(struct net_msg * m)
+{
+	__sync_add_and_fetch(&m->ref, 1);
+
+	return m;
+}
+
+void net_msg_put(struct net_msg * m)
+{
+	if(__sync_sub_and_fetch(&m->ref, 1) == 0) {
+		mem_free(m);
+	}
+}
+
 /******************************************************************************
  * Message specific procedures.                                               *
  ******************************************************************************/
 
-int net_sc_hello(struct net_context * net, char * msg, int size)
+int net_sched_msg(struct agent * a, int type, struct net_msg * m)
+{
+	return net_sched_job(a, m->seq, type, 1, 0, m);
+}
+
+/* Let the agent sample a trigger periodically, if the wrapper allows it. */
+int net_sched_sample(struct agent * a, struct trigger * t, int interval)
+{
+	struct sched_job * job;
+
+	if(interval <= 0 || sched_find_job(&a->sched, t->id, JOB_TYPE_SAMPLE)) {
+		return 0;
+	}
+
+	job = mem_alloc(&a->mem, EM_MEM_JOBS, sizeof(struct sched_job));
+
+	if(!job) {
+		EMLOG("Not enough memory!");
+		return -1;
+	}
+
+	memset(job, 0, sizeof(struct sched_job));
+
+	INIT_LIST_HEAD(&job->next);
+	job->type       = JOB_TYPE_SAMPLE;
+	job->id         = t->id;
+	job->elapse     = interval;
+	job->reschedule = -1;
+	job->aligned    = 1;
+
+	if(sched_add_job(job, &a->sched)) {
+		sched_release_job(job);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Disable a trigger, and forget what is kept for it. */
+int net_tr_del(struct agent * a, int mod, int type, int instance)
+{
+	int id;
+
+	if(tr_del(&a->trig, mod, type, instance, &id)) {
+		return -1;
+	}
+
+	/* Not the id of the trigger if a subscriber inherited its collection. */
+	delta_del(&a->delta, id);
+	meas_del(&a->meas, id);
+	cond_del(&a->cond, id);
+
+	return 0;
+}
+
+int net_sc_hello(struct net_context * net, struct net_msg * m)
 {
 	struct sched_job * j;
 	struct agent *     a = container_of(net, struct agent, net);
-	uint32_t           intv;
 
 	EMDBG("Schedule message Hello");
 
+	net_hello_reply(net, m->seq);
+
 	/* Find the Hello job and change its interval */
 	j = sched_find_job(&a->sched, 0, JOB_TYPE_HELLO);
 
+	if(m->hello.interval > 0) {
+		net->hello = m->hello.interval;
+	}
+
 	if(j) {
-		intv      = epp_sched_interval(msg, size);
-		j->elapse = intv;
+		j->elapse = net_hello_tick(net);
 	}
 
 	return 0;
 }
 
-int net_se_cell_setup(struct net_context * net, char * msg, int size)
+int net_se_cell_setup(struct net_context * net, struct net_msg * m)
 {
-	uint32_t       seq;
 	struct agent * a = container_of(net, struct agent, net);
 
-	seq = epp_seq(msg, size);
-
 	EMDBG("Single message cell setup");
 
-	return net_sched_job(a, seq, JOB_TYPE_CELL_SETUP, 1, 0, msg, size);
+	return net_sched_msg(a, JOB_TYPE_CELL_SETUP, m);
 }
 
-int net_se_enb_setup(struct net_context * net, char * msg, int size)
+int net_se_enb_setup(struct net_context * net, struct net_msg * m)
 {
-	uint32_t       seq;
 	struct agent * a = container_of(net, struct agent, net);
 
-	seq = epp_seq(msg, size);
-
 	EMDBG("Single message eNB setup");
 
-	return net_sched_job(a, seq, JOB_TYPE_ENB_SETUP, 1, 0, msg, size);
+	return net_sched_msg(a, JOB_TYPE_ENB_SETUP, m);
 }
 
-int net_se_ho(struct net_context * net, char * msg, int size)
+int net_se_ho(struct net_context * net, struct net_msg * m)
 {
-	uint32_t       seq;
 	struct agent * a = container_of(net, struct agent, net);
 
-	seq = epp_seq(msg, size);
-
 	EMDBG("Single message Handover");
 
-	return net_sched_job(a, seq, JOB_TYPE_HO, 1, 0, msg, size);
+	return net_sched_msg(a, JOB_TYPE_HO, m);
 }
 
-int net_te_ue_measure(struct net_context * net, char * msg, int size)
+int net_te_ue_measure(struct net_context * net, struct net_msg * m)
 {
-	uint32_t         mod;
-	uint32_t         seq;
-	uint32_t         op;
-	uint8_t          m_id = 0;
-
-	struct trigger * t;
+	struct trigger   t;
 	struct agent *   a = container_of(net, struct agent, net);
 
-	epp_head(msg, size, 0, 0, 0, &mod);
-
-	seq = epp_seq(msg, size);
-	op  = epp_trigger_op(msg, size);
+	EMDBG("Trigger message UE measure, mod=%d, op=%d", m->mod_id, m->op);
 
-	epp_trigger_uemeas_req(msg, size, &m_id, 0, 0, 0, 0, 0);
+	if(m->op == EP_OPERATION_ADD) {
+		/* Still running since before the reconnection. */
+		if(tr_resync(
+			&a->trig,
+			m->mod_id,
+			TR_TYPE_UE_MEAS,
+			(int)m->uemeas.meas_id,
+			m)) {
 
-	EMDBG("Trigger message UE measure, mod=%d, op=%d", mod, op);
+			return 0;
+		}
 
-	if(op == EP_OPERATION_ADD) {
-		t = tr_add(
+		if(tr_add(
 			&a->trig,
 			tr_next_id(&a->trig),
-			mod,
+			m->mod_id,
 			TR_TYPE_UE_MEAS,
-			(int)m_id,
-			msg,
-			size);
+			(int)m->uemeas.meas_id,
+			m,
+			&t)) {
+
+			return -1;
+		}
 	} else {
-		return tr_del(&a->trig, mod, TR_TYPE_UE_MEAS, (int)m_id);
+		return net_tr_del(
+			a, m->mod_id, TR_TYPE_UE_MEAS, (int)m->uemeas.meas_id);
+	}
+
+	/* Only the keys of the trigger are needed. */
+	tr_put(&t);
+
+	if(a->ops->ue_measure_pull || a->ops->ue_measure_summary) {
+		net_sched_sample(a, &t, m->uemeas.interval);
 	}
 
-	return net_sched_job(
-		a, seq, JOB_TYPE_UE_MEASURE, 1, 0, t, sizeof(struct trigger));
+	return net_sched_job(a, t.id, JOB_TYPE_UE_MEASURE, 1, 0, 0);
 }
 
-int net_te_ue_report(struct net_context * net, char * msg, int size)
+int net_te_ue_report(struct net_context * net, struct net_msg * m)
 {
-	uint32_t         mod;
-	uint32_t         seq;
-	uint32_t         op;
-
-	struct trigger * t;
+	struct trigger   t;
 	struct agent *   a = container_of(net, struct agent, net);
 
-	epp_head(msg, size, 0, 0, 0, &mod);
+	EMDBG("Trigger message UE report, mod=%d, op=%d", m->mod_id, m->op);
 
-	seq = epp_seq(msg, size);
-	op  = epp_trigger_op(msg, size);
-
-	EMDBG("Trigger message UE report, mod=%d, op=%d", mod, op);
+	if(m->op == EP_OPERATION_ADD) {
+		/* Still running since before the reconnection. */
+		if(tr_resync(&a->trig, m->mod_id, TR_TYPE_UE_REP, 0, m)) {
+			return 0;
+		}
 
-	if(op == EP_OPERATION_ADD) {
-		t = tr_add(
+		if(tr_add(
 			&a->trig,
 			tr_next_id(&a->trig),
-			mod,
+			m->mod_id,
 			TR_TYPE_UE_REP,
 			0,
-			msg,
-			size);
+			m,
+			&t)) {
+
+			return -1;
+		}
 	} else {
-		return tr_del(&a->trig, mod, TR_TYPE_UE_REP, 0);
+		return net_tr_del(a, m->mod_id, TR_TYPE_UE_REP, 0);
 	}
 
-	return net_sched_job(
-		a, seq, JOB_TYPE_UE_REPORT, 1, 0, t, sizeof(struct trigger));
+	/* Only the keys of the trigger are needed. */
+	tr_put(&t);
+
+	/* Already collected for another module; nothing to ask the stack. */
+	if(t.owner) {
+		return 0;
+	}
+
+	return net_sched_job(a, t.id, JOB_TYPE_UE_REPORT, 1, 0, 0);
 }
 
-int net_te_mac_report(struct net_context * net, char * msg, int size)
+int net_te_mac_report(struct net_context * net, struct net_msg * m)
 {
-	uint32_t         mod;
-	uint32_t         seq;
-	uint32_t         op;
-
-	struct trigger * t;
+	struct trigger   t;
 	struct agent *   a = container_of(net, struct agent, net);
 
-	epp_head(msg, size, 0, 0, 0, &mod);
+	EMDBG("Trigger message MAC report, mod=%d, op=%d", m->mod_id, m->op);
 
-	seq = epp_seq(msg, size);
-	op  = epp_trigger_op(msg, size);
-
-	EMDBG("Trigger message MAC report, mod=%d, op=%d", mod, op);
+	if(m->op == EP_OPERATION_ADD) {
+		/* Still running since before the reconnection. */
+		if(tr_resync(&a->trig, m->mod_id, TR_TYPE_MAC_REP, 0, m)) {
+			return 0;
+		}
 
-	if(op == EP_OPERATION_ADD) {
-		t = tr_add(
+		if(tr_add(
 			&a->trig,
 			tr_next_id(&a->trig),
-			mod,
+			m->mod_id,
 			TR_TYPE_MAC_REP,
 			0,
-			msg,
-			size);
+			m,
+			&t)) {
+
+			return -1;
+		}
 	} else {
-		return tr_del(&a->trig, mod, TR_TYPE_MAC_REP, 0);
+		return net_tr_del(a, m->mod_id, TR_TYPE_MAC_REP, 0);
+	}
+
+	/* Only the keys of the trigger are needed. */
+	tr_put(&t);
+
+	/* Already collected for another module; nothing to ask the stack. */
+	if(t.owner) {
+		return 0;
 	}
 
-	return net_sched_job(
-		a, seq, JOB_TYPE_MAC_REPORT, 1, 0, t, sizeof(struct trigger));
+	if(a->ops->mac_report_pull) {
+		net_sched_sample(a, &t, m->macrep.interval);
+	}
+
+	return net_sched_job(a, t.id, JOB_TYPE_MAC_REPORT, 1, 0, 0);
 }
 
 /******************************************************************************
  * Top-level message handlers.                                                *
  ******************************************************************************/
 
-int net_process_sched_event(
-	struct net_context * net, char * msg, unsigned int size)
+/* Decode the raw bytes of the message once, filling all the fields which will
+ * be used later while processing and executing it.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int net_decode_msg(struct net_msg * m)
 {
-	ep_act_type s = epp_schedule_type(msg, size);
+	char *       msg  = m->buf;
+	unsigned int size = m->size;
+
+	m->type = epp_msg_type(msg, size);
+
+	if(epp_head(msg, size, 0, &m->enb_id, &m->cell_id, &m->mod_id)) {
+		EMDBG("Malformed header received!");
+		return -1;
+	}
+
+	m->seq = epp_seq(msg, size);
+
+	switch(m->type) {
+	case EP_TYPE_SINGLE_MSG:
+		m->act = epp_single_type(msg, size);
+		m->dir = epp_single_dir(msg, size);
+
+		if(m->act == EP_ACT_HANDOVER && m->dir == EP_DIR_REQUEST) {
+			if(epp_single_ho_req(
+				msg, size,
+				&m->ho.rnti,
+				&m->ho.target_enb,
+				&m->ho.target_cell,
+				&m->ho.cause)) {
+
+				EMLOG("Cannot parse request elements in Handover");
+				return -1;
+			}
+		}
+		break;
+	case EP_TYPE_SCHEDULE_MSG:
+		m->act = epp_schedule_type(msg, size);
+		m->dir = epp_schedule_dir(msg, size);
+
+		if(m->act == EP_ACT_HELLO && m->dir == EP_DIR_REPLY) {
+			m->hello.interval = epp_sched_interval(msg, size);
+		}
+		break;
+	case EP_TYPE_TRIGGER_MSG:
+		m->act = epp_trigger_type(msg, size);
+		m->op  = epp_trigger_op(msg, size);
+
+		if(m->act == EP_ACT_UE_MEASURE) {
+			epp_trigger_uemeas_req(
+				msg, size,
+				&m->uemeas.meas_id,
+				&m->uemeas.rnti,
+				&m->uemeas.earfcn,
+				&m->uemeas.interval,
+				&m->uemeas.max_cells,
+				&m->uemeas.max_meas);
+		} else if(m->act == EP_ACT_MAC_REPORT) {
+			epp_trigger_macrep_req(msg, size, &m->macrep.interval);
+		}
+		break;
+	default:
+		/* Handled by the caller. */
+		break;
+	}
 
-	if(s == EP_ACT_INVALID) {
+	return 0;
+}
+
+int net_process_sched_event(struct net_context * net, struct net_msg * m)
+{
+	if(m->act == EP_ACT_INVALID) {
 		EMDBG("Malformed schedule-event message received!\n");
 		return -1;
 	}
 
-	switch(s) {
+	switch(m->act) {
 	case EP_ACT_HELLO:
-		if(epp_schedule_dir(msg, size) == EP_DIR_REPLY) {
+		if(m->dir == EP_DIR_REPLY) {
 			EMDBG("Hello reply received!");
-			return net_sc_hello(net, msg, size);
+			return net_sc_hello(net, m);
 		}
 		break;
 	default:
-		EMDBG("Unknown scheduled event, type=%d", s);
+		EMDBG("Unknown scheduled event, type=%d", m->act);
 		break;
 	}
 
 	return 0;
 }
 
-int net_process_single_event(
-	struct net_context * net, char * msg, unsigned int size)
+int net_process_single_event(struct net_context * net, struct net_msg * m)
 {
-	ep_act_type s = epp_single_type(msg, size);
-
-	if(s == EP_ACT_INVALID) {
+	if(m->act == EP_ACT_INVALID) {
 		EMDBG("Malformed single-event message received!\n");
 		return -1;
 	}
 
-	switch(s) {
+	switch(m->act) {
 	case EP_ACT_HELLO:
 		/* Do nothing */
 		break;
 	case EP_ACT_ECAP:
-		if(epp_single_dir(msg, size) == EP_DIR_REQUEST) {
+		if(m->dir == EP_DIR_REQUEST) {
 			EMDBG("eNB capabilities request received!");
-			return net_se_enb_setup(net, msg, size);
+			return net_se_enb_setup(net, m);
 		}
 		break;
 	case EP_ACT_CCAP:
-		if(epp_single_dir(msg, size) == EP_DIR_REQUEST) {
+		if(m->dir == EP_DIR_REQUEST) {
 			EMDBG("Cell capabilities request received!");
-			return net_se_cell_setup(net, msg, size);
+			return net_se_cell_setup(net, m);
 		}
 		break;
 	case EP_ACT_HANDOVER:
-		if(epp_single_dir(msg, size) == EP_DIR_REQUEST) {
+		if(m->dir == EP_DIR_REQUEST) {
 			EMDBG("Handover request received!");
-			return net_se_ho(net, msg, size);
+			return net_se_ho(net, m);
 		}
 		break;
 	default:
-		EMDBG("Unknown single event, type=%d", s);
+		EMDBG("Unknown single event, type=%d", m->act);
 		break;
 	}
 
 	return 0;
 }
 
-int net_process_trigger_event(
-	struct net_context * net, char * msg, unsigned int size)
+int net_process_trigger_event(struct net_context * net, struct net_msg * m)
 {
-	ep_act_type t = epp_trigger_type(msg, size);
-
-	if(t == EP_ACT_INVALID) {
+	if(m->act == EP_ACT_INVALID) {
 		EMDBG("Malformed trigger-event message received!\n");
 		return -1;
 	}
 
-	switch(t) {
+	switch(m->act) {
 	case EP_ACT_HELLO:
 		/* Don't really care about the hello reply now */
 		break;
 	case EP_ACT_UE_REPORT:
-		return net_te_ue_report(net, msg, size);
+		return net_te_ue_report(net, m);
 	case EP_ACT_UE_MEASURE:
-		return net_te_ue_measure(net, msg, size);
+		return net_te_ue_measure(net, m);
 	case EP_ACT_MAC_REPORT:
-		return net_te_mac_report(net, msg, size);
+		return net_te_mac_report(net, m);
 	default:
-		EMDBG("Unknown trigger event, type=%d", t);
+		EMDBG("Unknown trigger event, type=%d", m->act);
 		break;
 	}
 
 	return 0;
 }
 
+/* Check if the message repeats a capabilities request still waiting to be
+ * answered; replying once is enough.
+ *
+ * Returns 1 if the message can be dropped, 0 otherwise.
+ */
+int net_coalesce_msg(struct net_context * net, struct net_msg * m)
+{
+	struct agent * a = container_of(net, struct agent, net);
+	int            type;
+
+	if(m->type != EP_TYPE_SINGLE_MSG || m->dir != EP_DIR_REQUEST) {
+		return 0;
+	}
+
+	switch(m->act) {
+	case EP_ACT_ECAP:
+		type = JOB_TYPE_ENB_SETUP;
+		break;
+	case EP_ACT_CCAP:
+		type = JOB_TYPE_CELL_SETUP;
+		break;
+	default:
+		return 0;
+	}
+
+	if(!sched_has_command(&a->sched, type, m->mod_id, m->cell_id)) {
+		return 0;
+	}
+
+	EMDBG("Duplicate request coalesced, act=%d, mod=%d, cell=%d",
+		m->act, m->mod_id, m->cell_id);
+
+	a->admit.coalesced++;
+
+	return 1;
+}
+
 /* Process incoming messages. */
-int net_process_message(struct net_context * net, char * msg, unsigned int size)
+int net_process_message(struct net_context * net, struct net_msg * m)
 {
-	ep_msg_type mt = epp_msg_type(msg, size);
+	struct agent * a = container_of(net, struct agent, net);
+	unsigned int   commands;
 
 #ifdef EM_DISSECT_MSG
-	net_show_msg(msg, size, 0);
+	net_show_msg(m->buf, m->size, 0);
 #endif /* EM_DISSECT_MSG */
 
-	switch(mt) {
+	stats_msg(&a->stats, 0, m->buf, m->size);
+	trace_event(&a->trace, EM_TRACE_RECV, 0, 0, m->size);
+
+	if(net_decode_msg(m)) {
+		return -1;
+	}
+
+	trace_event(&a->trace, EM_TRACE_PARSE, m->seq, 0, m->act);
+
+	if(net_coalesce_msg(net, m)) {
+		return 0;
+	}
+
+	/* The scheduler updates the count while performing the jobs. */
+	lock_take(&a->sched.lock);
+	commands = a->sched.commands;
+	lock_drop(&a->sched.lock);
+
+	/* Over the budget of its type, or too many commands waiting. */
+	if(!admit_msg(&a->admit, m, commands)) {
+		return -1;
+	}
+
+	switch(m->type) {
 	/* Single events messages. */
 	case EP_TYPE_SINGLE_MSG:
-		return net_process_single_event(net, msg, size);
+		return net_process_single_event(net, m);
 	/* Scheduled events messages. */
 	case EP_TYPE_SCHEDULE_MSG:
-		return net_process_sched_event(net, msg, size);
+		return net_process_sched_event(net, m);
 	/* Triggered events messages. */
 	case EP_TYPE_TRIGGER_MSG:
-		return net_process_trigger_event(net, msg, size);
+		return net_process_trigger_event(net, m);
 	default:
-		EMDBG("Unknown message received, size=%d", size);
+		EMDBG("Unknown message received, size=%d", m->size);
 		break;
 	}
 
@@ -584,17 +1175,24 @@ int net_process_message(struct net_context * net, char * msg, unsigned int size)
 void * net_loop(void * args)
 {
 	struct net_context * net = (struct net_context *)args;
+	struct agent *       a   = container_of(net, struct agent, net);
 
 	int op;
 	int bread;
 	int mlen  = 0;
 
-	char buf[EM_BUF_SIZE] = {0};
+	char buf[EP_HEADER_SIZE] = {0};
+	struct net_msg * m = 0;
 
 	unsigned int wi = net->interval;
 	struct timespec wt = {0};	/* Wait time. */
 	struct timespec wc = {0};	/* Wait time for reconnection. */
+	struct timespec ws = {0, 1000000};	/* Wait time for the scheduler. */
 	struct timespec td = {0};
+	struct pollfd   pfd = {0, POLLIN, 0};
+
+	trace_thread(EM_TRACE_NET);
+	stats_thread(&a->stats, STATS_THREAD_NET, 1);
 
 	/* Convert the wait interval in a timespec struct. */
 	while(wi >= 1000) {
@@ -614,8 +1212,20 @@ next:
 				goto stop;
 			}
 
+			/* Let the scheduler clean up the last connection. */
+			if(!a->sched.offline) {
+				nanosleep(&ws, &td);
+				continue;
+			}
+
+			/* The next controller is already there? */
+			if(net_failover(net) == 0) {
+				continue;
+			}
+
 			if(net_connect_to_controller(net) == 0) {
 				net_connected(net);
+				continue;
 			}
 
 			/* Relax the CPU. */
@@ -635,9 +1245,12 @@ next:
 				net, buf + bread, EP_HEADER_SIZE - bread);
 
 			if(op <= 0) {
-				if(errno == EAGAIN) {
-					/* Relax the CPU. */
-					nanosleep(&wt, &td);
+				if(op < 0 && errno == EAGAIN) {
+					net_standby_check(net);
+
+					/* Relax the CPU until something comes. */
+					pfd.fd = net->sockfd;
+					poll(&pfd, 1, net->interval);
 					continue;
 				}
 
@@ -664,23 +1277,42 @@ next:
 
 		EMDBG("Receiving a message of size %d", mlen);
 
-		//bread = 0;
+		if(mlen < EP_HEADER_SIZE || mlen > NET_MAX_MSG) {
+			EMLOG("Invalid message length %d!", mlen);
+
+			net_not_connected(net);
+			goto next;
+		}
+
+		/* The message is received directly in its final storage */
+		m = net_msg_alloc(net, mlen);
+
+		if(!m) {
+			EMLOG("No more memory!");
+
+			net_not_connected(net);
+			goto next;
+		}
+
+		memcpy(m->buf, buf, bread);
 
 		/* Continue until the entire message has been collected */
 		while(bread < mlen) {
 			if(net->stop) {
+				net_msg_put(m);
 				goto stop;
 			}
 
-			op = net_recv(net, buf + bread, mlen - bread);
+			op = net_recv(net, m->buf + bread, mlen - bread);
 
 			if(op <= 0) {
-				if(errno == EAGAIN) {
+				if(op < 0 && errno == EAGAIN) {
 					/* Relax the CPU. */
 					nanosleep(&wt, &td);
 					continue;
 				}
 
+				net_msg_put(m);
 				net_not_connected(net);
 				goto next;
 			}
@@ -688,25 +1320,17 @@ next:
 			bread += op;
 		}
 
-		if(bread != mlen) {
-			EMDBG("Read %d bytes, but only %d to process!",
-				bread, mlen);
-
-#ifdef EM_DISSECT_MSG
-			net_show_msg(buf, bread, 0);
-#endif /* EM_DISSECT_MSG */
-
-			net_not_connected(net);
-			goto next;
-		}
-
 		/* Finally we collected the entire message; process it! */
-		net_process_message(net, buf, bread);
+		net_process_message(net, m);
+		net_msg_put(m);
 	}
 
 stop:
 	EMDBG("Listening loop is terminating...");
 
+	net_standby_close(net);
+	stats_thread(&a->stats, STATS_THREAD_NET, 0);
+
 	/*
 	 * If you need to release 'net' specific resources, do it here!
 	 */
@@ -718,8 +1342,11 @@ int net_start(struct net_context * net)
 {
 	net->interval = NET_WAIT_TIME;
 	net->sockfd   = -1;
+	net->sbfd     = -1;
+
+	net_add_endpoint(net, 0, 0);
 
-	pthread_spin_init(&net->lock, 0);
+	lock_init(&net->lock);
 
 	/* Create the context where the agent scheduler will run on. */
 	if(pthread_create(
@@ -738,7 +1365,7 @@ int net_stop(struct net_context * net)
 	net->stop = 1;
 	pthread_join(net->thread, 0);
 
-	pthread_spin_destroy(&net->lock);
+	lock_destroy(&net->lock);
 
 	return 0;
 }
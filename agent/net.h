@@ -20,8 +20,13 @@
 #ifndef __EMAGE_NET_H
 #define __EMAGE_NET_H
 
+#include <stdint.h>
 #include <pthread.h>
 
+#include "lock.h"
+
+struct net_context;
+
 /* Not connected to the controller. */
 #define EM_STATUS_NOT_CONNECTED		0
 /* Connected to the controller. */
@@ -30,6 +35,101 @@
 /* Default buffer size. */
 #define EM_BUF_SIZE			4096
 
+/* Biggest message accepted from the controller. */
+#define NET_MAX_MSG			65536
+
+/* Maximum number of controller endpoints. */
+#define NET_MAX_ENDPOINTS		4
+
+/* Message received from the controller, decoded once at its arrival. Which of
+ * the request fields are valid depends on the type and action of the message.
+ *
+ * The message is shared by the triggers and jobs which originated from it, and
+ * it is released when the last of them drops its reference.
+ */
+struct net_msg {
+	/* References to this message. */
+	int          ref;
+
+	/* Type of message. */
+	int          type;
+	/* Action carried by the message. */
+	int          act;
+	/* Direction, request or reply, of the action. */
+	int          dir;
+	/* Operation requested on triggers. */
+	int          op;
+
+	/* Header fields. */
+	uint32_t     enb_id;
+	uint16_t     cell_id;
+	uint32_t     mod_id;
+	uint32_t     seq;
+
+	/* Request specific fields. */
+	union {
+		struct {
+			uint32_t interval;
+		} hello;
+
+		struct {
+			uint16_t rnti;
+			uint32_t target_enb;
+			uint16_t target_cell;
+			uint8_t  cause;
+		} ho;
+
+		struct {
+			uint8_t  meas_id;
+			uint16_t rnti;
+			uint16_t earfcn;
+			uint16_t interval;
+			int16_t  max_cells;
+			int16_t  max_meas;
+		} uemeas;
+
+		struct {
+			int16_t  interval;
+		} macrep;
+	};
+
+	/* Raw message, stored right after the descriptor. */
+	char *       buf;
+	/* Size of the raw message. */
+	unsigned int size;
+};
+
+/* Allocate a message able to hold 'size' raw bytes, with one reference taken.
+ *
+ * Returns the message on success, otherwise a null pointer.
+ */
+struct net_msg * net_msg_alloc(struct net_context * net, unsigned int size);
+
+/* Take a new reference on a message. */
+struct net_msg * net_msg_get(struct net_msg * m);
+
+/* Drop a reference on a message, freeing it with the last one. */
+void net_msg_put(struct net_msg * m);
+
+/* Controller which the agent can connect to. */
+struct net_endpoint {
+	char addr[16];
+	unsigned short port;
+};
+
+/* Hello requests waiting for their reply. */
+#define NET_HELLO_PENDING		8
+
+/* Hello request sent to the controller. */
+struct net_hello {
+	/* The request is waiting for its reply. */
+	int used;
+	/* Sequence number of the request. */
+	uint32_t seq;
+	/* Time the request has been sent. */
+	struct timespec sent;
+};
+
 /* Private context of a network listener. */
 struct net_context {
 	/* Address to listen. */
@@ -39,6 +139,28 @@ struct net_context {
 	/* Socket fd used for communication. */
 	int sockfd;
 
+	/* Controllers to use, in order; the first is the one above. */
+	struct net_endpoint eps[NET_MAX_ENDPOINTS];
+	unsigned int neps;
+	/* Controller currently in use. */
+	unsigned int cur;
+
+	/* Connection kept ready with the next controller, if any. */
+	int sbfd;
+	/* Controller of the standby connection. */
+	unsigned int sbep;
+	/* The standby connection is established. */
+	int sbok;
+	/* Next time to try the standby connection again. */
+	struct timespec sbretry;
+
+	/* Time the last connection has been lost. */
+	struct timespec down;
+	/* Number of switches to the standby connection. */
+	unsigned int failovers;
+	/* Time taken by the last switch, in us. */
+	unsigned int failover_us;
+
 	/* A value different than 0 stop this listener. */
 	int stop;
 	/* Status of the listener. */
@@ -49,17 +171,69 @@ struct net_context {
 	/* Thread in charge of this listening. */
 	pthread_t thread;
 	/* Lock for elements of this context. */
-	pthread_spinlock_t lock;
+	lock_t lock;
 	/* Time to wait at the end of each loop, in ms. */
 	unsigned int interval;
+
+	/* Hello interval asked by the controller, in ms. */
+	int hello;
+	/* Time something has been sent to/received from the controller. */
+	struct timespec last_tx;
+	struct timespec last_rx;
+	/* Time the last Hello request has been sent. */
+	struct timespec last_hello;
+	/* A Hello is sent at least once every this many Hello intervals, to
+	 * sample the round trip even when other traffic flows; 0 never.
+	 */
+	unsigned int rtt_every;
+
+	/* Hello requests sent, the oldest overwritten first. */
+	struct net_hello pend[NET_HELLO_PENDING];
+	unsigned int npend;
 };
 
+/* Period of the Hello job: the link is checked more often than the Hello
+ * interval, so that an idle link is probed sooner.
+ */
+int net_hello_tick(struct net_context * net);
+
+/* Remember a Hello request, to measure the round trip once the reply comes. */
+void net_hello_sent(
+	struct net_context * net, uint32_t seq, struct timespec * sent);
+
 /* Get the next valid sequence number to emit with this context. */
 unsigned int net_next_seq(struct net_context * net);
 
 /* Adjust the context due a network error. */
 int net_not_connected(struct net_context * net);
 
+/* Turn the socket in an non-blocking one. */
+int net_noblock_socket(int sockfd);
+
+/* Disable the Nagle algorithm on the socket. */
+int net_nodelay_socket(int sockfd);
+
+/* Enable keepalive probes and the user timeout on the socket.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int net_alive_socket(struct net_context * net, int sockfd);
+
+/* Fill the address of a controller.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+struct sockaddr_in;
+int net_resolve(struct net_endpoint * e, struct sockaddr_in * sa);
+
+/* Add a controller to connect to if the ones before it fail. The first one
+ * is the address and port of the context.
+ *
+ * Returns 0 on success, a negative error code if there is no more room.
+ */
+int net_add_endpoint(
+	struct net_context * net, const char * addr, unsigned short port);
+
 /* Send a generic message using the network listener logic.
  */
 int net_send(struct net_context * net, char * buf, unsigned int size);
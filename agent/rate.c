@@ -0,0 +1,274 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal egress rate limiting logic.
+ *
+ * Periodic reports pass through two token buckets, one of the trigger which
+ * produced them and one shared by the whole agent. On top of that, when the
+ * messages waiting to be sent pile up because the link is slow, the reports of
+ * every trigger are decimated: one out of 'queued / degrade + 1' is kept. The
+ * replies to the controller requests and the event-driven UE reports are never
+ * limited.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <emlog.h>
+#include <emage/emproto.h>
+
+#include "agent.h"
+#include "rate.h"
+
+/* Default burst, in seconds of rate */
+#define RATE_DEF_BURST                          1
+
+/* Tokens needed to send a message */
+#define RATE_TOKEN                              1000
+
+/******************************************************************************
+ * Buckets                                                                    *
+ ******************************************************************************/
+
+void rate_fill(struct rate_bucket * b, struct timespec * now)
+{
+	int64_t ms;
+	int64_t max = (int64_t)b->burst * RATE_TOKEN;
+
+	ms = (now->tv_sec - b->last.tv_sec) * 1000 +
+		(now->tv_nsec - b->last.tv_nsec) / 1000000;
+
+	/* Refill in steps of ms, keeping the remainder for later. */
+	if(ms <= 0) {
+		return;
+	}
+
+	b->tokens += ms * b->rate;
+
+	b->last.tv_sec  += ms / 1000;
+	b->last.tv_nsec += (ms % 1000) * 1000000;
+
+	if(b->last.tv_nsec >= 1000000000) {
+		b->last.tv_sec++;
+		b->last.tv_nsec -= 1000000000;
+	}
+
+	if(b->tokens > max) {
+		b->tokens = max;
+	}
+}
+
+void rate_setup(
+	struct rate_bucket * b,
+	unsigned int rate,
+	unsigned int burst,
+	struct timespec * now)
+{
+	b->rate   = rate;
+	b->burst  = burst ? burst : rate * RATE_DEF_BURST;
+	b->tokens = (int64_t)b->burst * RATE_TOKEN;
+	b->last   = *now;
+}
+
+int rate_has_token(struct rate_bucket * b, struct timespec * now)
+{
+	if(!b->rate) {
+		return 1;
+	}
+
+	rate_fill(b, now);
+
+	return b->tokens >= RATE_TOKEN;
+}
+
+void rate_take_token(struct rate_bucket * b)
+{
+	if(b->rate) {
+		b->tokens -= RATE_TOKEN;
+	}
+}
+
+/******************************************************************************
+ * Public API                                                                 *
+ ******************************************************************************/
+
+int rate_admit(
+	struct rate_context * rc,
+	char * msg,
+	unsigned int size,
+	unsigned int queued)
+{
+	struct rate_stream * s = 0;
+	struct timespec      now;
+
+	uint32_t mod  = 0;
+	uint16_t cell = 0;
+	int      type;
+	int      act;
+	int      found = 0;
+	int      pass  = 1;
+	unsigned int n;
+
+	if(!rc->agent.rate && !rc->trig_rate && !rc->degrade) {
+		return 1;
+	}
+
+	if(size < EP_HEADER_SIZE ||
+		epp_head(msg, size, 0, 0, &cell, &mod)) {
+
+		return 1;
+	}
+
+	type = epp_msg_type(msg, size);
+
+	switch(type) {
+	case EP_TYPE_TRIGGER_MSG:
+		act = epp_trigger_type(msg, size);
+		break;
+	case EP_TYPE_SCHEDULE_MSG:
+		act = epp_schedule_type(msg, size);
+		break;
+	default:
+		/* Replies to the controller always pass. */
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	lock_take(&rc->lock);
+	list_for_each_entry(s, &rc->ss, next) {
+		if(s->mod == mod &&
+			s->cell == cell &&
+			s->type == type &&
+			s->act == act) {
+
+			found = 1;
+			break;
+		}
+	}
+
+	if(!found) {
+		s = mem_alloc(
+			agent_mem(rc, rate),
+			EM_MEM_OTHER,
+			sizeof(struct rate_stream));
+
+		/* Do not lose reports just because of the accounting. */
+		if(!s) {
+			lock_drop(&rc->lock);
+			return 1;
+		}
+
+		memset(s, 0, sizeof(struct rate_stream));
+
+		INIT_LIST_HEAD(&s->next);
+		s->mod  = mod;
+		s->cell = cell;
+		s->type = type;
+		s->act  = act;
+
+		rate_setup(&s->b, rc->trig_rate, rc->trig_burst, &now);
+
+		list_add(&s->next, &rc->ss);
+	}
+
+	/* The link is not keeping up: keep one report every n. */
+	if(rc->degrade && queued >= rc->degrade) {
+		n = queued / rc->degrade + 1;
+
+		if(s->seen++ % n) {
+			rc->degraded++;
+			pass = 0;
+		}
+	} else {
+		s->seen = 0;
+	}
+
+	if(pass) {
+		if(rate_has_token(&s->b, &now) &&
+			rate_has_token(&rc->agent, &now)) {
+
+			rate_take_token(&s->b);
+			rate_take_token(&rc->agent);
+		} else {
+			rc->dropped++;
+			pass = 0;
+		}
+	}
+	lock_drop(&rc->lock);
+
+	if(!pass) {
+		EMDBG("Report dropped, mod=%d, type=%d, act=%d, queued=%d",
+			mod, type, act, queued);
+	}
+
+	return pass;
+}
+
+int rate_reset(struct rate_context * rc)
+{
+	struct rate_stream * s = 0;
+	struct rate_stream * t = 0;
+	struct timespec      now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	lock_take(&rc->lock);
+	list_for_each_entry_safe(s, t, &rc->ss, next) {
+		list_del(&s->next);
+		mem_free(s);
+	}
+
+	rate_setup(&rc->agent, rc->agent.rate, rc->agent.burst, &now);
+	lock_drop(&rc->lock);
+
+	return 0;
+}
+
+int rate_init(
+	struct rate_context * rc,
+	unsigned int rate,
+	unsigned int burst,
+	unsigned int trig_rate,
+	unsigned int trig_burst,
+	unsigned int degrade)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	memset(rc, 0, sizeof(struct rate_context));
+
+	INIT_LIST_HEAD(&rc->ss);
+	rate_setup(&rc->agent, rate, burst, &now);
+
+	rc->trig_rate  = trig_rate;
+	rc->trig_burst = trig_burst;
+	rc->degrade    = degrade;
+
+	lock_init(&rc->lock);
+
+	return 0;
+}
+
+int rate_release(struct rate_context * rc)
+{
+	lock_destroy(&rc->lock);
+
+	return 0;
+}
@@ -0,0 +1,129 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal egress rate limiting logic.
+ */
+
+#ifndef __EMAGE_RATE_H
+#define __EMAGE_RATE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "emlist.h"
+#include "lock.h"
+
+/* Token bucket; tokens are kept in thousandths of message. */
+struct rate_bucket {
+	/* Messages per second; 0 means unlimited. */
+	unsigned int rate;
+	/* Maximum number of messages which can be sent in a burst. */
+	unsigned int burst;
+
+	/* Tokens available. */
+	int64_t tokens;
+	/* Last time the bucket has been refilled. */
+	struct timespec last;
+};
+
+/* Reports of a single trigger. */
+struct rate_stream {
+	/* Member of a list. */
+	struct list_head next;
+
+	/* Module, cell and action identifying the trigger. */
+	uint32_t mod;
+	uint16_t cell;
+	int type;
+	int act;
+
+	/* Limit of the reports of this trigger. */
+	struct rate_bucket b;
+	/* Reports seen while decimating. */
+	unsigned int seen;
+};
+
+/* Egress rate limiting context for an agent. */
+struct rate_context {
+	/* Streams of the triggers reporting. */
+	struct list_head ss;
+
+	/* Limit of all the periodic reports of the agent. */
+	struct rate_bucket agent;
+	/* Limit applied to every trigger. */
+	unsigned int trig_rate;
+	unsigned int trig_burst;
+
+	/* Outbound queue depth after which the periodic reports are
+	 * decimated; 0 disables the degradation.
+	 */
+	unsigned int degrade;
+
+	/* Reports dropped because out of tokens. */
+	uint64_t dropped;
+	/* Reports dropped because of the queue depth. */
+	uint64_t degraded;
+
+	/* Lock for this context. */
+	lock_t lock;
+};
+
+/* Set the limits of a bucket and fill it; a burst of 0 is the same as one
+ * second of messages.
+ */
+void rate_setup(
+	struct rate_bucket * b,
+	unsigned int rate,
+	unsigned int burst,
+	struct timespec * now);
+
+/* Check if a bucket has a token for a message, without taking it. An unlimited
+ * bucket has always tokens.
+ */
+int rate_has_token(struct rate_bucket * b, struct timespec * now);
+
+/* Take the token of a message from a bucket. */
+void rate_take_token(struct rate_bucket * b);
+
+/* Check if a message can be enqueued given the limits and the number of
+ * messages waiting to be sent. Only periodic reports are limited; every other
+ * message, like the replies to setup and handover requests, always passes.
+ *
+ * Returns 1 if the message can be sent, 0 if it has to be dropped.
+ */
+int rate_admit(
+	struct rate_context * rc,
+	char * msg,
+	unsigned int size,
+	unsigned int queued);
+
+/* Forget the state of every trigger, and refill all the buckets. */
+int rate_reset(struct rate_context * rc);
+
+/* Initialize an egress rate limiting context. */
+int rate_init(
+	struct rate_context * rc,
+	unsigned int rate,
+	unsigned int burst,
+	unsigned int trig_rate,
+	unsigned int trig_burst,
+	unsigned int degrade);
+
+/* Release the resources of an egress rate limiting context. */
+int rate_release(struct rate_context * rc);
+
+#endif /* __EMAGE_RATE_H */
@@ -18,6 +18,7 @@
  */
 
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -41,15 +42,77 @@
 #define JOB_NOT_ELAPSED                         1
 #define JOB_RESCHEDULE                          2
 
+/* Summaries reduced at once by a sampling job */
+#define SCHED_MAX_SUMMARY                       16
+
+/* Job carrying messages to send out */
+#define sched_outbound(j)                       \
+	((j)->type == JOB_TYPE_SEND || (j)->type == JOB_TYPE_AGGR)
+
+/* Job performing a controller command */
+#define sched_command(j)                        \
+	((j)->msg || (j)->type == JOB_TYPE_UE_REPORT || \
+	 (j)->type == JOB_TYPE_UE_MEASURE ||    \
+	 (j)->type == JOB_TYPE_MAC_REPORT)
+
+/* Job serving a trigger, kept during the reconnection grace time */
+#define sched_trigger_job(j)                    \
+	((j)->type == JOB_TYPE_SAMPLE ||        \
+	 (j)->type == JOB_TYPE_UE_REPORT ||     \
+	 (j)->type == JOB_TYPE_UE_MEASURE ||    \
+	 (j)->type == JOB_TYPE_MAC_REPORT)
+
 /* Dif "b-a" two timespec structs and return such value in ms*/
 #define ts_diff_to_ms(a, b)                     \
 	(((b->tv_sec - a->tv_sec) * 1000) +     \
 	 ((b->tv_nsec - a->tv_nsec) / 1000000))
 
+#define ts_diff_to_us(a, b)                             \
+	(((int64_t)(b->tv_sec - a->tv_sec) * 1000000) + \
+	 ((b->tv_nsec - a->tv_nsec) / 1000))
+
 /******************************************************************************
  * Utilities                                                                  *
  ******************************************************************************/
 
+/* Move the issue time of an aligned job back to the last multiple of its
+ * elapse time, so that it runs on the next one.
+ */
+void sched_align_job(struct sched_job * job)
+{
+	unsigned long long ms;
+
+	if(!job->aligned || job->elapse <= 0) {
+		return;
+	}
+
+	ms  = (unsigned long long)job->issued.tv_sec * 1000 +
+		job->issued.tv_nsec / 1000000;
+	ms -= ms % job->elapse;
+
+	job->issued.tv_sec  = ms / 1000;
+	job->issued.tv_nsec = (ms % 1000) * 1000000;
+}
+
+/* Account a job entering (1) or leaving (-1) the queues */
+void sched_count_job(
+	struct sched_context * sched, struct sched_job * job, int dir)
+{
+	if(sched_outbound(job)) {
+		sched->queued += dir;
+
+		if(sched->queued > sched->queued_peak) {
+			sched->queued_peak = sched->queued;
+		}
+	} else if(sched_command(job)) {
+		sched->commands += dir;
+
+		if(sched->commands > sched->commands_peak) {
+			sched->commands_peak = sched->commands;
+		}
+	}
+}
+
 /* Fix the last details and send the message */
 int sched_send_msg(struct agent * a, char * msg, unsigned int size)
 {
@@ -69,31 +132,102 @@ int sched_send_msg(struct agent * a, char * msg, unsigned int size)
 	if(net_send(&a->net, msg, size) < 0) {
 		return JOB_NET_ERROR; /* On error */
 	} else {
+		stats_msg(&a->stats, 1, msg, size);
 		return JOB_CONSUMED;  /* On success */
 	}
 }
 
+/* Number each message of a batch and send them all at once */
+int sched_send_batch(struct agent * a, char * buf, unsigned int size)
+{
+	unsigned int off = 0;
+	unsigned int len = 0;
+
+	while(off + EP_HEADER_SIZE <= size) {
+		len = epp_msg_length(buf + off, size - off);
+
+		if(len < EP_HEADER_SIZE || off + len > size) {
+			EMLOG("Malformed batch, offset=%d, size=%d", off, size);
+			return JOB_CONSUMED;
+		}
+
+		epf_seq(buf + off, len, net_next_seq(&a->net));
+		off += len;
+	}
+
+	EMDBG("Sending a batch of %d bytes...", size);
+
+	if(net_send(&a->net, buf, off) < 0) {
+		return JOB_NET_ERROR;
+	} else {
+		stats_msg(&a->stats, 1, buf, off);
+		return JOB_CONSUMED;
+	}
+}
+
 /******************************************************************************
  * Jobs                                                                       *
  ******************************************************************************/
 
-int sched_perform_send(struct agent * a, struct sched_job * job)
+/* Send the messages kept while disconnected, oldest first. */
+int sched_replay(struct agent * a)
 {
-	return sched_send_msg(a, job->args, job->size);
+	char *       msg;
+	unsigned int len;
+
+	while((len = backlog_peek(&a->backlog, &msg)) > 0) {
+		if(sched_send_batch(a, msg, len) == JOB_NET_ERROR) {
+			return JOB_NET_ERROR;
+		}
+
+		backlog_pop(&a->backlog);
+	}
+
+	return JOB_CONSUMED;
 }
 
-int sched_perform_cell_setup(struct agent * a, struct sched_job * job)
+/* Send a message, or keep it for later if the controller is not there. */
+int sched_send_or_keep(struct agent * a, char * msg, unsigned int size)
 {
-	uint16_t pci = 0;
-	uint32_t mod = 0;
+	int ret = JOB_NET_ERROR;
+
+	/* Collectors get the reports whatever the state of the controller. */
+	sess_post(&a->sess, msg, size);
+
+	/* Older messages go first. */
+	if(!a->sched.offline && sched_replay(a) == JOB_CONSUMED) {
+		ret = sched_send_batch(a, msg, size);
 
-	if(epp_head((char *)job->args, job->size, 0, 0, &pci, &mod)) {
-		EMLOG("Cannot parse cell id in Cell setup");
-		return 0;
+		if(ret == JOB_CONSUMED) {
+			return ret;
+		}
 	}
 
+	backlog_push(&a->backlog, msg, size);
+
+	return a->sched.offline ? JOB_CONSUMED : ret;
+}
+
+int sched_perform_send(struct agent * a, struct sched_job * job)
+{
+	if(job->size > EM_BUF_SIZE) {
+		EMLOG("Message too long, msg=%lu, limit=%d!",
+			job->size + sizeof(uint32_t),
+			EM_BUF_SIZE);
+
+		return JOB_CONSUMED;
+	}
+
+	return sched_send_or_keep(a, job->args, job->size);
+}
+
+int sched_perform_cell_setup(struct agent * a, struct sched_job * job)
+{
+	struct net_msg * m = job->msg;
+
 	if(a->ops && a->ops->cell_setup_request) {
-		a->ops->cell_setup_request(mod, pci);
+		agent_op(a, EM_OP_CELL_SETUP_REQUEST,
+			cell_setup_request(m->mod_id, m->cell_id));
 	}
 
 	return JOB_CONSUMED;
@@ -101,15 +235,11 @@ int sched_perform_cell_setup(struct agent * a, struct sched_job * job)
 
 int sched_perform_enb_setup(struct agent * a, struct sched_job * job)
 {
-	uint32_t mod = 0;
-
-	if(epp_head((char *)job->args, job->size, 0, 0, 0, &mod)) {
-		EMLOG("Cannot parse cell id in Cell setup");
-		return 0;
-	}
+	struct net_msg * m = job->msg;
 
 	if(a->ops && a->ops->enb_setup_request) {
-		a->ops->enb_setup_request(mod);
+		agent_op(a, EM_OP_ENB_SETUP_REQUEST,
+			enb_setup_request(m->mod_id));
 	}
 
 	return JOB_CONSUMED;
@@ -117,113 +247,273 @@ int sched_perform_enb_setup(struct agent * a, struct sched_job * job)
 
 int sched_perform_ho(struct agent * a, struct sched_job * job)
 {
-	uint32_t mod   = 0;
-	uint16_t scell = 0;
-	uint16_t rnti  = 0;
-	uint32_t tenb  = 0;
-	uint16_t tcell = 0;
-	uint8_t  cause = 0;
+	struct net_msg * m = job->msg;
 
-	if(epp_head((char *)job->args, job->size, 0, 0, &scell, &mod)) {
-		EMLOG("Cannot parse cell id in Handover");
-		return 0;
+	if(a->ops && a->ops->handover_UE) {
+		agent_op(a, EM_OP_HANDOVER_UE, handover_UE(
+			m->mod_id,
+			m->cell_id,
+			m->ho.rnti,
+			m->ho.target_enb,
+			m->ho.target_cell,
+			m->ho.cause));
 	}
 
-	if(epp_single_ho_req(
-		(char *)job->args, job->size, &rnti, &tenb, &tcell, &cause)) {
-		EMLOG("Cannot parse request elements in Handover");
-		return 0;
+	return JOB_CONSUMED;
+}
+
+/* Trigger jobs are identified by the id of the trigger they serve, and work on
+ * a copy of it, since the network thread can remove it while the wrapper runs.
+ */
+
+int sched_perform_ue_measure(struct agent * a, struct sched_job * job)
+{
+	struct trigger t;
+
+	if(a->ops && a->ops->ue_measure &&
+		!tr_snapshot(&a->trig, job->id, &t)) {
+
+		agent_op(a, EM_OP_UE_MEASURE, ue_measure(
+			t.mod,
+			t.id,
+			t.req->uemeas.meas_id,
+			t.req->uemeas.rnti,
+			t.req->uemeas.earfcn,
+			t.req->uemeas.interval,
+			t.req->uemeas.max_cells,
+			t.req->uemeas.max_meas));
+
+		tr_put(&t);
 	}
 
-	if(a->ops && a->ops->handover_UE) {
-		a->ops->handover_UE(mod, scell, rnti, tenb, tcell, cause);
+	return JOB_CONSUMED;
+}
+
+int sched_perform_mac_report(struct agent * a, struct sched_job * job)
+{
+	struct trigger t;
+
+	if(a->ops && a->ops->mac_report &&
+		!tr_snapshot(&a->trig, job->id, &t)) {
+
+		agent_op(a, EM_OP_MAC_REPORT, mac_report(
+			t.mod, t.req->macrep.interval, t.id));
+
+		tr_put(&t);
 	}
 
 	return JOB_CONSUMED;
 }
 
-int sched_perform_ue_measure(struct agent * a, struct sched_job * job)
+int sched_perform_ue_report(struct agent * a, struct sched_job * job)
 {
-	struct trigger * t   = (struct trigger *)job->args;
-
-	uint8_t          mid   = 0;
-	uint16_t         rnti  = 0;
-	uint16_t         freq  = 0;
-	uint16_t         intv  = 0;
-	uint16_t         max_c = 0;
-	uint16_t         max_m = 0;
-
-	if(a->ops && a->ops->ue_measure) {
-		/* Find the real trigger; the given one just an empty copy... */
-		t = tr_find(&a->trig, t->id);
-
-		if(t) {
-			epp_trigger_uemeas_req(
-				t->req,
-				t->size,
-				&mid,
-				&rnti,
-				&freq,
-				&intv,
-				&max_c,
-				&max_m);
-
-			a->ops->ue_measure(
-				t->mod,
-				t->id,
-				mid,
-				rnti,
-				freq,
-				intv,
-				max_c,
-				max_m);
-		}
+	struct trigger t;
+
+	if(a->ops && a->ops->ue_report &&
+		!tr_snapshot(&a->trig, job->id, &t)) {
+
+		agent_op(a, EM_OP_UE_REPORT, ue_report(t.mod, t.id));
+
+		tr_put(&t);
 	}
 
 	return JOB_CONSUMED;
 }
 
-int sched_perform_mac_report(struct agent * a, struct sched_job * job)
+/* Report the summaries of the samples collected for a measurement trigger. */
+int sched_perform_summary(struct agent * a, struct trigger * t)
+{
+	char                   buf[EM_BUF_SIZE];
+	int                    blen;
+	int                    i;
+	int                    n;
+	struct em_meas_summary s[SCHED_MAX_SUMMARY];
+
+	do {
+		n = meas_reduce(&a->meas, t->id, s, SCHED_MAX_SUMMARY);
+
+		for(i = 0; i < n; i++) {
+			blen = agent_op(a, EM_OP_UE_MEASURE_SUMMARY,
+				ue_measure_summary(
+					t->mod,
+					t->id,
+					&s[i],
+					buf,
+					EM_BUF_SIZE));
+
+			if(blen > 0) {
+				add_report_jobs(a, t->id, buf, blen);
+			}
+		}
+	} while(n == SCHED_MAX_SUMMARY);
+
+	return 0;
+}
+
+int sched_perform_sample(struct agent * a, struct sched_job * job)
 {
-	uint32_t         mod = 0;
-	int16_t          intv;
-	struct trigger * t   = (struct trigger *)job->args;
+	char             buf[EM_BUF_SIZE];
+	int              blen = 0;
+	struct trigger   c;
+	struct trigger * t    = &c;
+
+	/* The trigger has been disabled; stop sampling it. */
+	if(tr_snapshot(&a->trig, job->id, t)) {
+		meas_del(&a->meas, job->id);
+		cond_del(&a->cond, job->id);
+		delta_del(&a->delta, job->id);
+
+		job->reschedule = 0;
+		return JOB_CONSUMED;
+	}
 
-	if(a->ops && a->ops->mac_report) {
-		t = tr_find(&a->trig, t->id);
+	/* The trigger condition does not hold; start a new window anyway. */
+	if(!cond_pass(&a->cond, t->id)) {
+		meas_del(&a->meas, t->id);
+		tr_put(t);
+		return JOB_CONSUMED;
+	}
 
-		if(t) {
-			epp_trigger_macrep_req(t->req, t->size, &intv);
+	switch(t->type) {
+	case TR_TYPE_MAC_REP:
+		if(a->ops && a->ops->mac_report_pull) {
+			blen = agent_op(a, EM_OP_MAC_REPORT_PULL,
+				mac_report_pull(
+					t->mod, t->id, buf, EM_BUF_SIZE));
+		}
+		break;
+	case TR_TYPE_UE_MEAS:
+		if(a->ops && a->ops->ue_measure_pull) {
+			blen = agent_op(a, EM_OP_UE_MEASURE_PULL,
+				ue_measure_pull(
+					t->mod,
+					t->id,
+					t->req->uemeas.meas_id,
+					t->req->uemeas.rnti,
+					buf,
+					EM_BUF_SIZE));
+		}
 
-			a->ops->mac_report(t->mod, intv, t->id);
+		if(a->ops && a->ops->ue_measure_summary) {
+			sched_perform_summary(a, t);
 		}
+		break;
 	}
 
+	if(blen > 0) {
+		add_report_jobs(a, t->id, buf, blen);
+	}
+
+	tr_put(t);
+
 	return JOB_CONSUMED;
 }
 
-int sched_perform_ue_report(struct agent * a, struct sched_job * job)
+int sched_perform_aggr(struct agent * a, struct sched_job * job)
 {
-	uint32_t         mod = 0;
-	struct trigger * t   = (struct trigger *)job->args;
+	int                 ret = JOB_CONSUMED;
+	struct aggr_batch * b   = aggr_take(&a->aggr, job->id);
 
-	if(a->ops && a->ops->ue_report) {
-		a->ops->ue_report(t->mod, t->id);
+	/* Already sent because it was full. */
+	if(!b) {
+		return JOB_CONSUMED;
 	}
 
+	ret = sched_send_or_keep(a, b->buf, b->len);
+	mem_free(b);
+
+	return ret;
+}
+
+/* Refresh the metrics in the shared memory segment. */
+int sched_perform_publish(struct agent * a, struct sched_job * job)
+{
+	struct em_stats st;
+
+	em_agent_stats(a, &st);
+	shm_publish(&a->shm, &st, a->net.status);
+
 	return JOB_CONSUMED;
 }
 
+/* Forget what the controller did not confirm, or everything if it did not come
+ * back in time.
+ */
+int sched_perform_resync(struct agent * a, struct sched_job * job)
+{
+	int n;
+
+	if(a->net.status == EM_STATUS_CONNECTED) {
+		n = tr_prune(&a->trig);
+
+		if(n > 0) {
+			EMLOG("Resync over, %d triggers not confirmed", n);
+		}
+
+		return JOB_CONSUMED;
+	}
+
+	EMLOG("Controller not back in time; disabling the triggers");
+
+	tr_flush(&a->trig);
+	meas_del(&a->meas, 0);
+	cond_del(&a->cond, 0);
+
+	/* Alert wrapper about controller disconnection */
+	if(a->ops->disconnected) {
+		agent_op(a, EM_OP_DISCONNECTED, disconnected());
+	}
+
+	return JOB_CONSUMED;
+}
+
+/* Any traffic already proves that the agent is alive, so Hello is sent only if
+ * nothing else went out during the interval. When the link is idle and nothing
+ * came back from the controller either, Hello is sent at every run of the job
+ * instead, so that a dead link is found sooner.
+ *
+ * The reply to Hello is the only sample of the round trip with the controller,
+ * so one Hello every 'rtt_every' intervals goes out even on a busy link: a busy
+ * agent pays one more message in that time, and gets fewer round trip samples
+ * than an idle one.
+ */
 int sched_perform_hello(struct agent * a, struct sched_job * job) {
 	char buf[EM_BUF_SIZE];
 	int blen = 0;
 	int sent = 0;
 	int ret  = JOB_CONSUMED;
+	int rtt;
+
+	struct timespec   now;
+	struct timespec * tx = &a->net.last_tx;
+	struct timespec * rx = &a->net.last_rx;
+	struct timespec * hl = &a->net.last_hello;
+	struct timespec * n  = &now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* Time for a round trip sample? */
+	rtt = a->net.rtt_every &&
+		ts_diff_to_ms(hl, n) >=
+			(int64_t)a->net.hello * a->net.rtt_every;
+
+	if(!rtt && (ts_diff_to_ms(tx, n) < job->elapse ||
+		(ts_diff_to_ms(tx, n) < a->net.hello &&
+		ts_diff_to_ms(rx, n) < a->net.hello))) {
+
+		return JOB_CONSUMED;
+	}
 
 	blen = epf_sched_hello_req(
-		buf, EM_BUF_SIZE, a->b_id, 0, 0, job->elapse ,0);
+		buf, EM_BUF_SIZE, a->b_id, 0, 0, a->net.hello, 0);
 	ret  = sched_send_msg(a, buf, blen);
 
+	/* Wait for the reply to measure the round trip. */
+	if(ret == JOB_CONSUMED) {
+		a->net.last_hello = now;
+		net_hello_sent(&a->net, epp_seq(buf, blen), &now);
+	}
+
 	return ret;
 }
 
@@ -232,11 +522,16 @@ int sched_release_job(struct sched_job * job)
 	EMDBG("Releasing a %d job", job->type);
 
 	if(job->args && job->size > 0) {
-		free(job->args);
+		mem_free(job->args);
 		job->args = 0;
 	}
 
-	free(job);
+	if(job->msg) {
+		net_msg_put(job->msg);
+		job->msg = 0;
+	}
+
+	mem_free(job);
 	return 0;
 }
 
@@ -247,18 +542,29 @@ int sched_release_job(struct sched_job * job)
 int sched_add_job(struct sched_job * job, struct sched_context * sched) {
 	int status = 0;
 
+	struct agent * a = container_of(sched, struct agent, sched);
+
 	clock_gettime(CLOCK_REALTIME, &job->issued);
+	sched_align_job(job);
 
-	pthread_spin_lock(&sched->lock);
+	trace_event(
+		&a->trace,
+		EM_TRACE_ENQUEUE,
+		job->msg ? job->msg->seq : 0,
+		job->id,
+		job->type);
+
+	lock_take(&sched->lock);
 
 	/* Perform the job if the context is not stopped. */
 	if(!sched->stop) {
-		list_add(&job->next, &sched->jobs);
+		list_add_tail(&job->next, &sched->jobs);
+		sched_count_job(sched, job, 1);
 	} else {
 		status = -1;
 	}
 
-	pthread_spin_unlock(&sched->lock);
+	lock_drop(&sched->lock);
 
 	EMDBG("Scheduled a %d job for %d msec", job->type, job->elapse);
 
@@ -270,29 +576,69 @@ struct sched_job * sched_find_job(
 {
 	struct sched_job * job = 0;
 
-	pthread_spin_lock(&sched->lock);
+	lock_take(&sched->lock);
 	list_for_each_entry(job, &sched->jobs, next) {
 		if(job->id == id && job->type == type) {
-			pthread_spin_unlock(&sched->lock);
+			lock_drop(&sched->lock);
 			return job;
 		}
 	}
-	pthread_spin_unlock(&sched->lock);
+	lock_drop(&sched->lock);
 
 	return 0;
 }
 
+int sched_has_command(
+	struct sched_context * sched, int type, uint32_t mod, uint16_t cell)
+{
+	struct sched_job * job = 0;
+	struct list_head * qs[2] = {&sched->jobs, &sched->todo};
+
+	int i;
+	int found = 0;
+
+	lock_take(&sched->lock);
+	for(i = 0; i < 2 && !found; i++) {
+		list_for_each_entry(job, qs[i], next) {
+			if(job->type == type &&
+				job->msg &&
+				job->msg->mod_id == mod &&
+				job->msg->cell_id == cell) {
+
+				found = 1;
+				break;
+			}
+		}
+	}
+	lock_drop(&sched->lock);
+
+	return found;
+}
+
 int sched_perform_job(
 	struct agent * a, struct sched_job * job, struct timespec * now) {
 
 	int status = JOB_CONSUMED;
 	struct timespec * is = &job->issued;
+	struct timespec   end;
+	int64_t           us;
 
 	/* Job not to be performed now. */
 	if(ts_diff_to_ms(is, now) < job->elapse) {
 		return JOB_NOT_ELAPSED;
 	}
 
+	us = ts_diff_to_us(is, now) - (int64_t)job->elapse * 1000;
+	stats_hist(&a->stats.lateness, us > 0 ? us : 0);
+	stats_job(&a->stats, job->type);
+
+	trace_event(
+		&a->trace,
+		EM_TRACE_JOB_BEGIN,
+		job->msg ? job->msg->seq : 0,
+		job->id,
+		job->type);
+
 	EMDBG("\nPerforming a job %d", job->type);
 
 	switch(job->type) {
@@ -320,10 +666,39 @@ int sched_perform_job(
 	case JOB_TYPE_HO:
 		status = sched_perform_ho(a, job);
 		break;
+	case JOB_TYPE_SAMPLE:
+		status = sched_perform_sample(a, job);
+		break;
+	case JOB_TYPE_AGGR:
+		status = sched_perform_aggr(a, job);
+		break;
+	case JOB_TYPE_RESYNC:
+		status = sched_perform_resync(a, job);
+		break;
+	case JOB_TYPE_REPLAY:
+		status = a->sched.offline ? JOB_CONSUMED : sched_replay(a);
+		break;
+	case JOB_TYPE_PUBLISH:
+		status = sched_perform_publish(a, job);
+		break;
 	default:
 		EMDBG("Unknown job cannot be performed, type=%d", job->type);
 	}
 
+	trace_event(
+		&a->trace,
+		EM_TRACE_JOB_END,
+		job->msg ? job->msg->seq : 0,
+		job->id,
+		job->type);
+
+	/* Messages which left now, rather than being kept or lost. */
+	if(sched_outbound(job) && status == JOB_CONSUMED && !a->sched.offline) {
+		clock_gettime(CLOCK_REALTIME, &end);
+		us = ts_diff_to_us(is, (&end));
+		stats_hist(&a->stats.wire, us > 0 ? us : 0);
+	}
+
 	/* The job has to be rescheduled? */
 	if(status == 0 && job->reschedule != 0) {
 		return JOB_RESCHEDULE;
@@ -332,19 +707,113 @@ int sched_perform_job(
 	return status;
 }
 
+/* Handle the loss of the connection with the controller. */
+void sched_net_down(struct agent * a)
+{
+	struct sched_context * sched = &a->sched;
+	struct sched_job *     job   = 0;
+	struct sched_job *     tmp   = 0;
+	struct aggr_batch *    b;
+	struct list_head       rm;
+
+	int grace = a->conf.reconnect_grace;
+
+	INIT_LIST_HEAD(&rm);
+
+	stats_add(a->stats.disconnects, 1);
+
+	lock_take(&sched->lock);
+
+	/* Jobs to process again go first. */
+	list_splice_init(&sched->todo, &sched->jobs);
+
+	/* Free ANY remaining job still to process, but the ones of the triggers
+	 * if they survive the disconnection.
+	 */
+	list_for_each_entry_safe(job, tmp, &sched->jobs, next) {
+		if(grace && sched_trigger_job(job)) {
+			continue;
+		}
+
+		/* Metrics are published whatever the connection. */
+		if(job->type == JOB_TYPE_PUBLISH) {
+			continue;
+		}
+
+		list_move_tail(&job->next, &rm);
+		sched_count_job(sched, job, -1);
+	}
+
+	lock_drop(&sched->lock);
+
+	/* Keep what was still to be sent, in order. */
+	list_for_each_entry_safe(job, tmp, &rm, next) {
+		if(job->type == JOB_TYPE_SEND) {
+			backlog_push(&a->backlog, job->args, job->size);
+		} else if(job->type == JOB_TYPE_AGGR) {
+			b = aggr_take(&a->aggr, job->id);
+
+			if(b) {
+				backlog_push(&a->backlog, b->buf, b->len);
+				mem_free(b);
+			}
+		}
+
+		list_del(&job->next);
+		sched_release_job(job);
+	}
+
+	aggr_flush(&a->aggr);
+
+	if(grace) {
+		/* Wait for the controller to come back. */
+		tr_stale(&a->trig);
+		add_resync_job(a);
+	} else {
+		tr_flush(&a->trig);
+
+		/* Alert wrapper about controller disconnection */
+		if(a->ops->disconnected) {
+			agent_op(a, EM_OP_DISCONNECTED, disconnected());
+		}
+	}
+
+	/* Signal the network that the connection down now, and that it can
+	 * connect again.
+	 *
+	 * We do it here since we are sure we cleaned all the jobs, and eventual
+	 * new job (from a new successful connection) don't get deleted.
+	 */
+	net_not_connected(&a->net);
+	sched->offline = 1;
+}
+
+/* Consume the jobs which elapsed.
+ *
+ * Returns the time in ms until the next job is due, bounded by the interval of
+ * the scheduler.
+ */
 int sched_consume(struct sched_context * sched) {
 	struct agent * a = container_of(sched, struct agent, sched);
 	struct net_context * net = &a->net;
 	struct sched_job * job = 0;
-	struct sched_job * tmp = 0;
 	struct timespec now;
+	struct timespec * is;
 
 	int op = 0;
 	int nj = 1;	/* New job to consume. */
 	int ne = 0;	/* Network error. */
+	int wait = sched->interval;
+	int left;
+
+	/* The network lost the connection on its own. */
+	if(!sched->offline && net->status != EM_STATUS_CONNECTED) {
+		sched_net_down(a);
+		return sched->interval;
+	}
 
 	while(nj) {
-		pthread_spin_lock(&sched->lock);
+		lock_take(&sched->lock);
 
 		/* Nothing to to? Go to sleep. */
 		if(list_empty(&sched->jobs)) {
@@ -360,7 +829,7 @@ int sched_consume(struct sched_context * sched) {
 			list_del(&job->next);
 		}
 
-		pthread_spin_unlock(&sched->lock);
+		lock_drop(&sched->lock);
 
 		/* Nothing to do... out! */
 		if(!nj) {
@@ -371,17 +840,27 @@ int sched_consume(struct sched_context * sched) {
 
 		op = sched_perform_job(a, job, &now);
 
-		pthread_spin_lock(&sched->lock);
+		lock_take(&sched->lock);
 
 		/* Possible outcomes. */
 		switch(op) {
 		case JOB_NOT_ELAPSED:
-			list_add(&job->next, &sched->todo);
+			list_add_tail(&job->next, &sched->todo);
+
+			is   = &job->issued;
+			left = job->elapse - ts_diff_to_ms(is, (&now));
+			wait = left < wait ? left : wait;
+
 			break;
 		case JOB_RESCHEDULE:
 			job->issued.tv_sec  = now.tv_sec;
 			job->issued.tv_nsec = now.tv_nsec;
-			list_add(&job->next, &sched->todo);
+			sched_align_job(job);
+			list_add_tail(&job->next, &sched->todo);
+
+			is   = &job->issued;
+			left = job->elapse - ts_diff_to_ms(is, (&now));
+			wait = left < wait ? left : wait;
 
 			/* Consume one reschedule credit. */
 			if(job->reschedule > 0) {
@@ -390,63 +869,36 @@ int sched_consume(struct sched_context * sched) {
 
 			break;
 		case JOB_CONSUMED:
-			sched_release_job(job);
-			break;
 		case JOB_NET_ERROR:
+			sched_count_job(sched, job, -1);
+
+			ne = op == JOB_NET_ERROR;
 			sched_release_job(job);
-			ne = 1;
 			break;
 		}
 
 		if(ne) {
-			/* Dump job to process again. */
-			list_for_each_entry_safe(job, tmp, &sched->todo, next) {
-				list_del(&job->next);
-				sched_release_job(job);
-			}
-
-			/* Free ANY remaining job still to process. */
-			list_for_each_entry_safe(job, tmp, &sched->jobs, next) {
-				list_del(&job->next);
-				sched_release_job(job);
-			}
-
-			pthread_spin_unlock(&sched->lock);
-
-			tr_flush(&a->trig);
-
-			/* Alert wrapper about controller disconnection */
-			if(a->ops->disconnected) {
-				a->ops->disconnected();
-			}
-
-			/* Signal the network that the connection down now.
-			 *
-			 * We do it here since we are sure we cleaned all the
-			 * jobs, and eventual new job (from a new successful
-			 * connection) don't get deleted.
-			 */
-			net_not_connected(net);
+			lock_drop(&sched->lock);
+			sched_net_down(a);
 
-			return 0;
+			return sched->interval;
 		}
 
-		pthread_spin_unlock(&sched->lock);
+		lock_drop(&sched->lock);
 	}
 
 	/* All the jobs marked as to process again are moved to the official
 	 * job queue.
 	 */
 
-	/* Dump all the rescheduled jobs in the queue again. */
-	pthread_spin_lock(&sched->lock);
-	list_for_each_entry_safe(job, tmp, &sched->todo, next) {
-		list_del(&job->next);
-		list_add(&job->next, &sched->jobs);
-	}
-	pthread_spin_unlock(&sched->lock);
+	/* Dump all the rescheduled jobs in the queue again, keeping them in
+	 * front of the ones added in the meantime.
+	 */
+	lock_take(&sched->lock);
+	list_splice_init(&sched->todo, &sched->jobs);
+	lock_drop(&sched->lock);
 
-	return 0;
+	return wait > 0 ? wait : 0;
 }
 
 int sched_remove_job(unsigned int id, int type, struct sched_context * sched) {
@@ -454,44 +906,40 @@ int sched_remove_job(unsigned int id, int type, struct sched_context * sched) {
 
 	struct sched_job * job = 0;
 	struct sched_job * tmp = 0;
+	struct list_head * qs[2] = {&sched->jobs, &sched->todo};
+	struct list_head   rm;
 
-	/* Dump the job from wherever it could be listed. */
-	pthread_spin_lock(&sched->lock);
-	list_for_each_entry_safe(job, tmp, &sched->jobs, next) {
-		if(job->id == id && job->type == type) {
-			found = 1;
-			list_del(&job->next);
+	int i;
 
-			/* There can be multiple jobs with the same id in case
-			 * of cancellation events, so remove everything.
-			 */
-		}
-	}
+	INIT_LIST_HEAD(&rm);
 
-	/* Where is it? Already performed? */
-	if(!found) {
-		list_for_each_entry_safe(job, tmp, &sched->todo, next) {
+	/* Dump the job from wherever it could be listed. There can be multiple
+	 * jobs with the same id in case of cancellation events, so remove
+	 * everything.
+	 */
+	lock_take(&sched->lock);
+	for(i = 0; i < 2; i++) {
+		list_for_each_entry_safe(job, tmp, qs[i], next) {
 			if(job->id == id && job->type == type) {
 				found = 1;
-				list_del(&job->next);
-
-				/* There can be multiple jobs with the same id
-				 * in case of cancellation events, so remove
-				 * everything.
-				 */
+				list_move(&job->next, &rm);
+				sched_count_job(sched, job, -1);
 			}
 		}
 	}
-	pthread_spin_unlock(&sched->lock);
+	lock_drop(&sched->lock);
 
 	if(!found) {
-		EMDBG("Job %d NOT found!", job->id);
+		EMDBG("Job %d NOT found!", id);
 		return -1;
 	}
 
-	EMDBG("Job %d removed from the scheduler", job->id);
+	EMDBG("Job %d removed from the scheduler", id);
 
-	sched_release_job(job);
+	list_for_each_entry_safe(job, tmp, &rm, next) {
+		list_del(&job->next);
+		sched_release_job(job);
+	}
 
 	return 0;
 }
@@ -503,31 +951,52 @@ int sched_remove_job(unsigned int id, int type, struct sched_context * sched) {
 void * sched_loop(void * args) {
 	struct sched_context * s = (struct sched_context *)args;
 
-	unsigned int wi = s->interval;
+	unsigned int wi;
 	struct timespec wt = {0};
-	struct timespec td = {0};
 
 	struct sched_job * job = 0;
 	struct sched_job * tmp = 0;
 
-	/* Convert the wait interval in a timespec struct. */
-	while(wi >= 1000) {
-		wi -= 1000;
-		wt.tv_sec += 1;
-	}
-	wt.tv_nsec = wi * 1000000;
+	struct agent * a = container_of(s, struct agent, sched);
+
+	char path[256];
 
 	EMDBG("Scheduling loop starting, interval=%d", s->interval);
 
+	trace_thread(EM_TRACE_SCHED);
+	stats_thread(&a->stats, STATS_THREAD_SCHED, 1);
+
 	while(!s->stop) {
-		/* Job scheduling logic. */
-		sched_consume(s);
+		/* Job scheduling logic; sleep until the next job is due. */
+		wi = sched_consume(s);
+
+		/* Save the trace if a signal asked for it. */
+		if(trace_requested(&a->trace) && a->conf.trace_file) {
+			snprintf(path, sizeof(path), "%s.%d",
+				a->conf.trace_file, a->b_id);
+			trace_dump(&a->trace, a->b_id, path);
+		}
+
+		/* Convert the wait interval in an absolute time. */
+		clock_gettime(CLOCK_MONOTONIC, &wt);
+		wt.tv_sec  += wi / 1000;
+		wt.tv_nsec += (wi % 1000) * 1000000;
+
+		if(wt.tv_nsec >= 1000000000) {
+			wt.tv_sec++;
+			wt.tv_nsec -= 1000000000;
+		}
 
-		/* Relax the CPU. */
-		nanosleep(&wt, &td);
+		/* Relax the CPU, unless somebody needs the scheduler. */
+		pthread_mutex_lock(&s->wlock);
+		if(!s->woken) {
+			pthread_cond_timedwait(&s->wake, &s->wlock, &wt);
+		}
+		s->woken = 0;
+		pthread_mutex_unlock(&s->wlock);
 	}
 
-	pthread_spin_lock(&s->lock);
+	lock_take(&s->lock);
 	/* Dump job to process again. */
 	list_for_each_entry_safe(job, tmp, &s->todo, next) {
 		list_del(&job->next);
@@ -539,7 +1008,9 @@ void * sched_loop(void * args) {
 		list_del(&job->next);
 		sched_release_job(job);
 	}
-	pthread_spin_unlock(&s->lock);
+	lock_drop(&s->lock);
+
+	stats_thread(&a->stats, STATS_THREAD_SCHED, 0);
 
 	/*
 	 * If execution arrives here, then a stop has been issued.
@@ -549,12 +1020,29 @@ out:
 	return 0;
 }
 
+void sched_wake(struct sched_context * sched)
+{
+	pthread_mutex_lock(&sched->wlock);
+	sched->woken = 1;
+	pthread_cond_signal(&sched->wake);
+	pthread_mutex_unlock(&sched->wlock);
+}
+
 int sched_start(struct sched_context * sched) {
+	pthread_condattr_t ca;
+
 	sched->interval = 1000;
+	sched->offline  = 1;
 
 	INIT_LIST_HEAD(&sched->jobs);
 	INIT_LIST_HEAD(&sched->todo);
-	pthread_spin_init(&sched->lock, 0);
+	lock_init(&sched->lock);
+
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&sched->wake, &ca);
+	pthread_condattr_destroy(&ca);
+	pthread_mutex_init(&sched->wlock, 0);
 
 	/* Create the context where the agent scheduler will run on. */
 	if(pthread_create(&sched->thread, NULL, sched_loop, sched)) {
@@ -568,9 +1056,12 @@ int sched_start(struct sched_context * sched) {
 int sched_stop(struct sched_context * sched) {
 	/* Stop and wait for it... */
 	sched->stop = 1;
+	sched_wake(sched);
 
 	pthread_join(sched->thread, 0);
-	pthread_spin_destroy(&sched->lock);
+	lock_destroy(&sched->lock);
+	pthread_cond_destroy(&sched->wake);
+	pthread_mutex_destroy(&sched->wlock);
 
 	return 0;
 }
@@ -20,10 +20,14 @@
 #ifndef __EMAGE_SCHEDULER_H
 #define __EMAGE_SCHEDULER_H
 
+#include <stdint.h>
 #include <time.h>
 #include <pthread.h>
 
 #include "emlist.h"
+#include "lock.h"
+
+struct net_msg;
 
 /* Possible types of jobs to issue in the scheduler */
 enum JOB_TYPES {
@@ -36,6 +40,11 @@ enum JOB_TYPES {
 	JOB_TYPE_UE_MEASURE,
 	JOB_TYPE_MAC_REPORT,
 	JOB_TYPE_HO,
+	JOB_TYPE_SAMPLE,
+	JOB_TYPE_AGGR,
+	JOB_TYPE_RESYNC,
+	JOB_TYPE_REPLAY,
+	JOB_TYPE_PUBLISH,
 };
 
 /* Job for agent scheduler */
@@ -52,6 +61,10 @@ struct sched_job {
 	void * args;
 	/* Eventual size for the arguments */
 	unsigned int size;
+	/* Controller message which originated the job, if any; a reference
+	 * is held on it.
+	 */
+	struct net_msg * msg;
 
 	/* This variable contains the number of time a message will be
 	 * rescheduled; -1 cause the job to be re-scheduled forever.
@@ -62,6 +75,11 @@ struct sched_job {
 	struct timespec issued;
 	/* time in 'ms' after that the job will be run */
 	int elapse;
+	/* Run the job on multiples of its elapse time rather than relatively
+	 * to when it has been issued, so that periodic jobs with the same or
+	 * multiple periods are performed together.
+	 */
+	int aligned;
 };
 
 struct sched_context {
@@ -72,13 +90,30 @@ struct sched_context {
 	struct list_head jobs;
 	/* Jobs to do but not scheduled for this run */
 	struct list_head todo;
+	/* Messages waiting to be sent, as send and aggregation jobs */
+	unsigned int queued;
+	/* Controller commands waiting to be performed */
+	unsigned int commands;
+	/* Most messages and commands which have been waiting at once */
+	unsigned int queued_peak;
+	unsigned int commands_peak;
+	/* The scheduler has handled the loss of the connection (or there has
+	 * never been one), and drops the messages until the next connection is
+	 * established.
+	 */
+	int offline;
 
 	/* Thread in charge of this listening */
 	pthread_t thread;
 	/* Lock for elements of this context */
-	pthread_spinlock_t lock;
+	lock_t lock;
 	/* Time to wait at the end of each loop, in ms */
 	unsigned int interval;
+
+	/* Wakes up the scheduler before the end of its wait */
+	pthread_cond_t wake;
+	pthread_mutex_t wlock;
+	int woken;
 };
 
 /* Adds a job to a scheduler context */
@@ -88,9 +123,23 @@ int sched_add_job(struct sched_job * job, struct sched_context * sched);
 struct sched_job * sched_find_job(
 	struct sched_context * sched, unsigned int id, int type);
 
+/* Check if a command of the given type for the same module and cell is
+ * already waiting to be performed.
+ *
+ * Returns 1 if such command is found, 0 otherwise.
+ */
+int sched_has_command(
+	struct sched_context * sched, int type, uint32_t mod, uint16_t cell);
+
+/* Free a job and the resources it holds; the job must not be listed */
+int sched_release_job(struct sched_job * job);
+
 /* Release a job which is currently scheduled by using the associated id */
 int sched_remove_job(unsigned int id, int type, struct sched_context * sched);
 
+/* Let the scheduler look at its jobs now, rather than at the end of its wait */
+void sched_wake(struct sched_context * sched);
+
 /* Correctly start a new scheduler in it's own context */
 int sched_start(struct sched_context * sched);
 
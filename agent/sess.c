@@ -0,0 +1,471 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal report sessions logic.
+ *
+ * Besides the controller, the agent can stream its reports to other collectors,
+ * for example an analytics application. Every report is copied once in a buffer
+ * shared by all the sessions which queue it; only the header, which carries the
+ * sequence number of the session, is patched and sent apart from the rest of
+ * the report. Every session has its own bounded queue, so a slow collector
+ * loses reports without slowing down the controller or the other collectors.
+ *
+ * Sessions only receive reports: the commands are accepted from the controller
+ * alone, and what the collectors send is discarded.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <emlog.h>
+#include <emage/emproto.h>
+
+#include "agent.h"
+#include "sess.h"
+
+/* Time between connection attempts, in s */
+#define SESS_RETRY                              1
+/* Maximum wait of the sessions thread, in ms */
+#define SESS_WAIT                               1000
+
+/******************************************************************************
+ * Buffers                                                                    *
+ ******************************************************************************/
+
+struct sess_buf * sess_buf_alloc(
+	struct sess_context * sc, char * msg, unsigned int size)
+{
+	struct sess_buf * b = mem_alloc(
+		agent_mem(sc, sess),
+		EM_MEM_BUFFERS,
+		sizeof(struct sess_buf) + size);
+
+	if(!b) {
+		return 0;
+	}
+
+	b->ref  = 1;
+	b->size = size;
+	memcpy(b->data, msg, size);
+
+	return b;
+}
+
+void sess_buf_put(struct sess_buf * b)
+{
+	if(__sync_sub_and_fetch(&b->ref, 1) == 0) {
+		mem_free(b);
+	}
+}
+
+/******************************************************************************
+ * Sessions                                                                   *
+ ******************************************************************************/
+
+/* Drop the connection and everything queued; try again later. */
+void sess_close(struct sess_context * sc, struct session * s)
+{
+	if(s->fd >= 0) {
+		close(s->fd);
+	}
+
+	s->fd  = -1;
+	s->ok  = 0;
+	s->off = 0;
+
+	lock_take(&sc->lock);
+	while(s->count) {
+		sess_buf_put(s->q[s->head]);
+
+		s->head = (s->head + 1) % sc->queue;
+		s->count--;
+	}
+	lock_drop(&sc->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &s->retry);
+	s->retry.tv_sec += SESS_RETRY;
+}
+
+/* Start connecting to the collector, without waiting. */
+void sess_connect(struct sess_context * sc, struct session * s)
+{
+	struct sockaddr_in sa;
+	struct timespec    now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if(now.tv_sec < s->retry.tv_sec) {
+		return;
+	}
+
+	s->fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if(s->fd < 0) {
+		sess_close(sc, s);
+		return;
+	}
+
+	net_noblock_socket(s->fd);
+
+	if(net_resolve(&s->ep, &sa) ||
+		(connect(s->fd, (struct sockaddr *)&sa, sizeof(sa)) &&
+		errno != EINPROGRESS)) {
+
+		sess_close(sc, s);
+	}
+}
+
+/* Connection attempt over. */
+void sess_connected(struct sess_context * sc, struct session * s)
+{
+	int       err = 0;
+	socklen_t len = sizeof(err);
+
+	if(getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+		sess_close(sc, s);
+		return;
+	}
+
+	net_nodelay_socket(s->fd);
+
+	s->ok  = 1;
+	s->seq = 0;
+
+	EMDBG("Session with %s:%d established", s->ep.addr, s->ep.port);
+}
+
+/* Discard what the collector sends, and find out if it closed. */
+void sess_recv(struct sess_context * sc, struct session * s)
+{
+	char buf[EP_HEADER_SIZE];
+	int  op;
+
+	while((op = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0);
+
+	if(op == 0 || errno != EAGAIN) {
+		EMDBG("Session with %s:%d lost", s->ep.addr, s->ep.port);
+		sess_close(sc, s);
+	}
+}
+
+/* Send as many queued reports as the connection accepts. */
+void sess_flush(struct sess_context * sc, struct session * s)
+{
+	struct sess_buf * b;
+	struct iovec      iov[2];
+	struct msghdr     mh;
+
+	int op;
+
+	while(1) {
+		lock_take(&sc->lock);
+		b = s->count ? s->q[s->head] : 0;
+		lock_drop(&sc->lock);
+
+		if(!b) {
+			return;
+		}
+
+		/* The header is the only part which differs between sessions. */
+		if(!s->off) {
+			memcpy(s->hdr, b->data, EP_HEADER_SIZE);
+			epf_seq(s->hdr, EP_HEADER_SIZE, s->seq++);
+		}
+
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+
+		if(s->off < EP_HEADER_SIZE) {
+			iov[0].iov_base = s->hdr + s->off;
+			iov[0].iov_len  = EP_HEADER_SIZE - s->off;
+			iov[1].iov_base = b->data + EP_HEADER_SIZE;
+			iov[1].iov_len  = b->size - EP_HEADER_SIZE;
+			mh.msg_iovlen   = 2;
+		} else {
+			iov[0].iov_base = b->data + s->off;
+			iov[0].iov_len  = b->size - s->off;
+			mh.msg_iovlen   = 1;
+		}
+
+		op = sendmsg(s->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if(op < 0) {
+			if(errno != EAGAIN) {
+				sess_close(sc, s);
+			}
+
+			return;
+		}
+
+		s->off += op;
+
+		if(s->off < b->size) {
+			continue;
+		}
+
+		lock_take(&sc->lock);
+		s->head = (s->head + 1) % sc->queue;
+		s->count--;
+		lock_drop(&sc->lock);
+
+		sess_buf_put(b);
+
+		s->off = 0;
+		s->sent++;
+	}
+}
+
+void * sess_loop(void * args)
+{
+	struct sess_context * sc = (struct sess_context *)args;
+	struct agent *        a  = container_of(sc, struct agent, sess);
+	struct session *      s;
+	struct pollfd         fds[SESS_MAX + 1];
+
+	unsigned int i;
+	char         buf[64];
+
+	fds[0].fd     = sc->wake[0];
+	fds[0].events = POLLIN;
+
+	stats_thread(&a->stats, STATS_THREAD_SESS, 1);
+
+	while(!sc->stop) {
+		for(i = 0; i < sc->n; i++) {
+			s = &sc->ss[i];
+
+			if(s->fd < 0) {
+				sess_connect(sc, s);
+			}
+
+			fds[i + 1].fd      = s->fd;
+			fds[i + 1].events  = !s->ok ? POLLOUT :
+				POLLIN | (s->count ? POLLOUT : 0);
+			fds[i + 1].revents = 0;
+		}
+
+		fds[0].revents = 0;
+		poll(fds, sc->n + 1, SESS_WAIT);
+
+		/* Woken up because of new reports. */
+		if(fds[0].revents) {
+			while(read(sc->wake[0], buf, sizeof(buf)) > 0);
+		}
+
+		for(i = 0; i < sc->n; i++) {
+			s = &sc->ss[i];
+
+			if(s->fd < 0 || !fds[i + 1].revents) {
+				if(s->ok) {
+					sess_flush(sc, s);
+				}
+
+				continue;
+			}
+
+			if(!s->ok) {
+				sess_connected(sc, s);
+				continue;
+			}
+
+			if(fds[i + 1].revents & ~POLLOUT) {
+				sess_recv(sc, s);
+			}
+
+			if(s->ok) {
+				sess_flush(sc, s);
+			}
+		}
+	}
+
+	for(i = 0; i < sc->n; i++) {
+		sess_close(sc, &sc->ss[i]);
+	}
+
+	stats_thread(&a->stats, STATS_THREAD_SESS, 0);
+
+	return 0;
+}
+
+/******************************************************************************
+ * Public API                                                                 *
+ ******************************************************************************/
+
+int sess_post(struct sess_context * sc, char * msg, unsigned int size)
+{
+	struct sess_buf * b;
+	struct session *  s;
+
+	unsigned int off = 0;
+	unsigned int len;
+	unsigned int i;
+	int          queued = 0;
+
+	if(!sc->n) {
+		return 0;
+	}
+
+	/* Every report of a batch is queued by itself. */
+	for(off = 0; off + EP_HEADER_SIZE <= size; off += len) {
+		len = epp_msg_length(msg + off, size - off);
+
+		if(len < EP_HEADER_SIZE || off + len > size) {
+			return -1;
+		}
+
+		if(epp_msg_type(msg + off, len) != EP_TYPE_TRIGGER_MSG) {
+			continue;
+		}
+
+		b = sess_buf_alloc(sc, msg + off, len);
+
+		if(!b) {
+			EMLOG("No more memory!");
+			return -1;
+		}
+
+		lock_take(&sc->lock);
+		for(i = 0; i < sc->n; i++) {
+			s = &sc->ss[i];
+
+			if(!s->ok) {
+				continue;
+			}
+
+			/* The collector does not keep up. */
+			if(s->count == sc->queue) {
+				s->dropped++;
+				continue;
+			}
+
+			__sync_add_and_fetch(&b->ref, 1);
+			s->q[(s->head + s->count) % sc->queue] = b;
+			s->count++;
+			queued = 1;
+
+			if(s->count > s->peak) {
+				s->peak = s->count;
+			}
+		}
+		lock_drop(&sc->lock);
+
+		sess_buf_put(b);
+	}
+
+	if(queued && write(sc->wake[1], "", 1) < 0) {
+		/* Already woken up. */
+	}
+
+	return 0;
+}
+
+int sess_add(struct sess_context * sc, const char * addr, unsigned short port)
+{
+	struct session * s;
+
+	if(sc->n >= SESS_MAX) {
+		EMLOG("Too many sessions, %s:%d ignored", addr, port);
+		return -1;
+	}
+
+	s = &sc->ss[sc->n];
+	s->q = mem_alloc(
+		agent_mem(sc, sess),
+		EM_MEM_BUFFERS,
+		sizeof(struct sess_buf *) * sc->queue);
+
+	if(!s->q) {
+		EMLOG("No more memory!");
+		return -1;
+	}
+
+	strncpy(s->ep.addr, addr, sizeof(s->ep.addr) - 1);
+	s->ep.port = port;
+	s->fd      = -1;
+
+	sc->n++;
+
+	return 0;
+}
+
+int sess_init(struct sess_context * sc, unsigned int queue)
+{
+	memset(sc, 0, sizeof(struct sess_context));
+
+	sc->queue   = queue ? queue : SESS_DEF_QUEUE;
+	sc->wake[0] = -1;
+	sc->wake[1] = -1;
+
+	lock_init(&sc->lock);
+
+	return 0;
+}
+
+int sess_start(struct sess_context * sc)
+{
+	if(!sc->n) {
+		return 0;
+	}
+
+	if(pipe(sc->wake)) {
+		EMLOG("Cannot create the sessions pipe!");
+		return -1;
+	}
+
+	net_noblock_socket(sc->wake[0]);
+	net_noblock_socket(sc->wake[1]);
+
+	if(pthread_create(&sc->thread, NULL, sess_loop, sc)) {
+		EMLOG("Failed to create the sessions thread.");
+
+		close(sc->wake[0]);
+		close(sc->wake[1]);
+		sc->wake[0] = -1;
+		sc->wake[1] = -1;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+int sess_release(struct sess_context * sc)
+{
+	if(sc->wake[0] >= 0) {
+		sc->stop = 1;
+
+		if(write(sc->wake[1], "", 1) < 0) {
+			/* Already woken up. */
+		}
+
+		pthread_join(sc->thread, 0);
+
+		close(sc->wake[0]);
+		close(sc->wake[1]);
+	}
+
+	lock_destroy(&sc->lock);
+
+	return 0;
+}
@@ -0,0 +1,123 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal report sessions logic.
+ */
+
+#ifndef __EMAGE_SESS_H
+#define __EMAGE_SESS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <emage/emproto.h>
+
+#include "lock.h"
+#include "net.h"
+
+/* Maximum number of report sessions. */
+#define SESS_MAX			4
+/* Default number of reports queued per session. */
+#define SESS_DEF_QUEUE			1024
+
+/* Report serialized once and shared by all the sessions. */
+struct sess_buf {
+	/* References to this buffer. */
+	int ref;
+	/* Size of the report. */
+	unsigned int size;
+	/* The report, with the header of the controller connection. */
+	char data[];
+};
+
+/* Session with a collector of reports. */
+struct session {
+	/* Where the collector is. */
+	struct net_endpoint ep;
+	/* Socket of the session. */
+	int fd;
+	/* The connection is established. */
+	int ok;
+	/* Next time to try the connection again. */
+	struct timespec retry;
+
+	/* Sequence number of the session. */
+	uint32_t seq;
+
+	/* Reports queued, as a ring. */
+	struct sess_buf ** q;
+	unsigned int head;
+	unsigned int count;
+	/* Most reports queued at once. */
+	unsigned int peak;
+
+	/* Header of the first report, with the sequence of the session. */
+	char hdr[EP_HEADER_SIZE];
+	/* Bytes of the first report already sent. */
+	unsigned int off;
+
+	/* Reports sent. */
+	uint64_t sent;
+	/* Reports dropped because the collector was too slow. */
+	uint64_t dropped;
+};
+
+/* Report sessions context for an agent. */
+struct sess_context {
+	/* Sessions of the agent. */
+	struct session ss[SESS_MAX];
+	unsigned int n;
+	/* Size of the queue of each session. */
+	unsigned int queue;
+
+	/* Pipe used to wake up the sessions thread. */
+	int wake[2];
+	/* A value different than 0 stops the sessions thread. */
+	int stop;
+	/* Thread serving the sessions. */
+	pthread_t thread;
+
+	/* Lock for the queues of the sessions. */
+	lock_t lock;
+};
+
+/* Queue the reports of a message, or of a batch of messages, to every session.
+ * Only trigger messages are given to the sessions.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int sess_post(struct sess_context * sc, char * msg, unsigned int size);
+
+/* Add a session with a collector; to be done before starting the sessions.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int sess_add(struct sess_context * sc, const char * addr, unsigned short port);
+
+/* Initialize a report sessions context; 0 selects the default queue size. */
+int sess_init(struct sess_context * sc, unsigned int queue);
+
+/* Start serving the sessions, if any, in their own thread.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int sess_start(struct sess_context * sc);
+
+/* Stop the sessions and release the resources of the context. */
+int sess_release(struct sess_context * sc);
+
+#endif /* __EMAGE_SESS_H */
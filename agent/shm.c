@@ -0,0 +1,142 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal shared memory metrics logic.
+ *
+ * The segment is written only by the scheduler of the agent, under the
+ * sequence lock described in emshm.h; readers never block the writer.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <emlog.h>
+
+#include "agent.h"
+#include "shm.h"
+
+void shm_publish(struct shm_context * sc, struct em_stats * st, int status)
+{
+	struct em_shm * shm = sc->shm;
+	struct timespec now;
+	uint32_t        seq;
+
+	if(!shm) {
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	seq = shm->seq;
+
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	shm->updated = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	shm->status  = status;
+	memcpy(&shm->stats, st, sizeof(struct em_stats));
+
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int shm_init(
+	struct shm_context * sc,
+	const char * path,
+	int enb_id,
+	unsigned int interval)
+{
+	int fd;
+
+	memset(sc, 0, sizeof(struct shm_context));
+
+	if(!path) {
+		return 0;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if(fd < 0) {
+		EMLOG("Cannot create the metrics segment %s!", path);
+		return -1;
+	}
+
+	if(ftruncate(fd, sizeof(struct em_shm))) {
+		EMLOG("Cannot size the metrics segment %s!", path);
+		goto err;
+	}
+
+	sc->shm = mmap(
+		0,
+		sizeof(struct em_shm),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED,
+		fd,
+		0);
+
+	if(sc->shm == MAP_FAILED) {
+		EMLOG("Cannot map the metrics segment %s!", path);
+		sc->shm = 0;
+		goto err;
+	}
+
+	sc->path = mem_strdup(agent_mem(sc, shm), EM_MEM_OTHER, path);
+
+	if(!sc->path) {
+		EMLOG("No more memory!");
+		munmap(sc->shm, sizeof(struct em_shm));
+		sc->shm = 0;
+		goto err;
+	}
+
+	close(fd);
+
+	sc->shm->enb_id   = enb_id;
+	sc->shm->pid      = getpid();
+	sc->shm->interval = interval;
+	sc->shm->version  = EM_SHM_VERSION;
+	sc->shm->size     = sizeof(struct em_shm);
+
+	/* The segment is valid only once the magic is there. */
+	__atomic_store_n(&sc->shm->magic, EM_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+
+err:
+	close(fd);
+	unlink(path);
+
+	return -1;
+}
+
+int shm_release(struct shm_context * sc)
+{
+	if(sc->shm) {
+		munmap(sc->shm, sizeof(struct em_shm));
+		sc->shm = 0;
+	}
+
+	if(sc->path) {
+		unlink(sc->path);
+		sc->path = 0;
+	}
+
+	return 0;
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal shared memory metrics logic.
+ */
+
+#ifndef __EMAGE_SHM_INT_H
+#define __EMAGE_SHM_INT_H
+
+#include <emshm.h>
+
+/* Default time between the updates of the segment, in ms. */
+#define SHM_DEF_INTERVAL		100
+
+/* Shared memory metrics context for an agent. */
+struct shm_context {
+	/* Segment mapped, if any. */
+	struct em_shm * shm;
+	/* File of the segment. */
+	char * path;
+};
+
+/* Update the segment with the given metrics and connection status. */
+void shm_publish(struct shm_context * sc, struct em_stats * st, int status);
+
+/* Create the segment of an agent; a null path leaves the context disabled.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int shm_init(
+	struct shm_context * sc,
+	const char * path,
+	int enb_id,
+	unsigned int interval);
+
+/* Unmap and remove the segment of an agent. */
+int shm_release(struct shm_context * sc);
+
+#endif /* __EMAGE_SHM_INT_H */
@@ -0,0 +1,232 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal runtime metrics logic.
+ *
+ * Counters are plain integers updated with relaxed atomic operations, so the
+ * threads of the agent never wait for each other nor for the reader. Latencies
+ * go into log-linear histograms in the spirit of HDR: the bucket of a value is
+ * found with a couple of shifts, whatever its magnitude.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include <emage/emproto.h>
+
+#include "stats.h"
+
+/* Linear buckets per power of two, as a power of two */
+#define STATS_SUB_BITS                          EM_HIST_SUB_BITS
+#define STATS_SUB                               (1 << STATS_SUB_BITS)
+
+/******************************************************************************
+ * Histograms                                                                 *
+ ******************************************************************************/
+
+unsigned int stats_bucket(uint64_t v)
+{
+	unsigned int e;
+
+	if(v < STATS_SUB) {
+		return v;
+	}
+
+	e = 63 - __builtin_clzll(v);
+
+	if((e - STATS_SUB_BITS + 1) * STATS_SUB >= EM_HIST_BUCKETS) {
+		return EM_HIST_BUCKETS - 1;
+	}
+
+	return (e - STATS_SUB_BITS + 1) * STATS_SUB +
+		((v >> (e - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+void stats_hist(struct em_hist * h, uint64_t us)
+{
+	uint64_t max = stats_get(h->max);
+
+	stats_add(h->buckets[stats_bucket(us)], 1);
+	stats_add(h->count, 1);
+	stats_add(h->sum, us);
+
+	/* Only one thread feeds an histogram. */
+	if(us > max) {
+		__atomic_store_n(&h->max, us, __ATOMIC_RELAXED);
+	}
+}
+
+void stats_peak(uint64_t * c, uint64_t v)
+{
+	uint64_t cur = __atomic_load_n(c, __ATOMIC_RELAXED);
+
+	while(v > cur) {
+		if(__atomic_compare_exchange_n(
+			c, &cur, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+}
+
+/******************************************************************************
+ * Counters                                                                   *
+ ******************************************************************************/
+
+void stats_msg(struct stats_context * sc, int tx, char * msg, unsigned int size)
+{
+	unsigned int off;
+	unsigned int len;
+	unsigned int t;
+
+	for(off = 0; off + EP_HEADER_SIZE <= size; off += len) {
+		len = epp_msg_length(msg + off, size - off);
+
+		if(len < EP_HEADER_SIZE || off + len > size) {
+			return;
+		}
+
+		t = epp_msg_type(msg + off, len);
+
+		if(t >= EM_STATS_MSG_TYPES) {
+			t = 0;
+		}
+
+		if(tx) {
+			stats_add(sc->tx_msgs[t], 1);
+			stats_add(sc->tx_bytes[t], len);
+		} else {
+			stats_add(sc->rx_msgs[t], 1);
+			stats_add(sc->rx_bytes[t], len);
+		}
+	}
+}
+
+void stats_job(struct stats_context * sc, int type)
+{
+	if(type < 0 || type >= EM_STATS_JOB_TYPES) {
+		type = 0;
+	}
+
+	stats_add(sc->jobs[type], 1);
+}
+
+/* Jitter is smoothed as in RFC 3550: J += (|D| - J) / 16, where D is the
+ * difference between two consecutive round trips.
+ */
+void stats_rtt(struct stats_context * sc, int64_t us)
+{
+	int64_t d;
+	int64_t j = sc->rtt_jitter;
+
+	if(us < 0) {
+		us = 0;
+	}
+
+	if(sc->rtt.count) {
+		d = us - (int64_t)sc->rtt_last;
+		d = d < 0 ? -d : d;
+		j += (d - j) / 16;
+	}
+
+	if(!sc->rtt.count || us < sc->rtt_min) {
+		__atomic_store_n(&sc->rtt_min, us, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&sc->rtt_jitter, j, __ATOMIC_RELAXED);
+	__atomic_store_n(&sc->rtt_last, us, __ATOMIC_RELAXED);
+
+	stats_hist(&sc->rtt, us);
+}
+
+void stats_copy(uint64_t * dst, uint64_t * src, unsigned int n)
+{
+	unsigned int i;
+
+	for(i = 0; i < n; i++) {
+		dst[i] = stats_get(src[i]);
+	}
+}
+
+/******************************************************************************
+ * Threads                                                                    *
+ ******************************************************************************/
+
+void stats_thread(struct stats_context * sc, int thr, int on)
+{
+	if(on) {
+		if(pthread_getcpuclockid(pthread_self(), &sc->cpu[thr])) {
+			return;
+		}
+
+		__atomic_fetch_or(&sc->cpu_on, 1 << thr, __ATOMIC_RELEASE);
+	} else {
+		__atomic_fetch_and(&sc->cpu_on, ~(1 << thr), __ATOMIC_RELEASE);
+	}
+}
+
+/* CPU time of a thread in us, or 0 if it is not running. */
+static uint64_t stats_cpu(struct stats_context * sc, int thr)
+{
+	struct timespec ts;
+
+	if(!(__atomic_load_n(&sc->cpu_on, __ATOMIC_ACQUIRE) & (1 << thr))) {
+		return 0;
+	}
+
+	if(clock_gettime(sc->cpu[thr], &ts)) {
+		return 0;
+	}
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_read(struct stats_context * sc, struct em_stats * st)
+{
+	stats_copy(st->tx_msgs,  sc->tx_msgs,  EM_STATS_MSG_TYPES);
+	stats_copy(st->tx_bytes, sc->tx_bytes, EM_STATS_MSG_TYPES);
+	stats_copy(st->rx_msgs,  sc->rx_msgs,  EM_STATS_MSG_TYPES);
+	stats_copy(st->rx_bytes, sc->rx_bytes, EM_STATS_MSG_TYPES);
+	stats_copy(st->jobs,     sc->jobs,     EM_STATS_JOB_TYPES);
+
+	st->connects    = stats_get(sc->connects);
+	st->disconnects = stats_get(sc->disconnects);
+
+	stats_copy(
+		(uint64_t *)&st->lateness,
+		(uint64_t *)&sc->lateness,
+		sizeof(struct em_hist) / sizeof(uint64_t));
+	stats_copy(
+		(uint64_t *)&st->wire,
+		(uint64_t *)&sc->wire,
+		sizeof(struct em_hist) / sizeof(uint64_t));
+	stats_copy(
+		(uint64_t *)st->ops,
+		(uint64_t *)sc->ops,
+		EM_OP_MAX * sizeof(struct em_hist) / sizeof(uint64_t));
+	stats_copy(st->ops_over, sc->ops_over, EM_OP_MAX);
+	stats_copy(
+		(uint64_t *)&st->rtt,
+		(uint64_t *)&sc->rtt,
+		sizeof(struct em_hist) / sizeof(uint64_t));
+
+	st->rtt_min    = stats_get(sc->rtt_min);
+	st->rtt_last   = stats_get(sc->rtt_last);
+	st->rtt_jitter = stats_get(sc->rtt_jitter);
+
+	st->cpu_net   = stats_cpu(sc, STATS_THREAD_NET);
+	st->cpu_sched = stats_cpu(sc, STATS_THREAD_SCHED);
+	st->cpu_sess  = stats_cpu(sc, STATS_THREAD_SESS);
+}
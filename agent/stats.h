@@ -0,0 +1,102 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal runtime metrics logic.
+ */
+
+#ifndef __EMAGE_STATS_H
+#define __EMAGE_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <emage.h>
+
+/* Threads of an agent whose CPU time is accounted. */
+enum stats_thread {
+	STATS_THREAD_NET = 0,
+	STATS_THREAD_SCHED,
+	STATS_THREAD_SESS,
+	STATS_THREADS,
+};
+
+/* Add to a counter which other threads can read at any time. */
+#define stats_add(c, v)		__atomic_fetch_add(&(c), (v), __ATOMIC_RELAXED)
+/* Read a counter which other threads keep updating. */
+#define stats_get(c)		__atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+/* Counters of an agent, updated without locks by the thread which does the
+ * work; gauges are collected only when the metrics are requested.
+ */
+struct stats_context {
+	/* Messages and bytes sent and received, per message type. */
+	uint64_t tx_msgs[EM_STATS_MSG_TYPES];
+	uint64_t tx_bytes[EM_STATS_MSG_TYPES];
+	uint64_t rx_msgs[EM_STATS_MSG_TYPES];
+	uint64_t rx_bytes[EM_STATS_MSG_TYPES];
+
+	/* Jobs performed, per job type. */
+	uint64_t jobs[EM_STATS_JOB_TYPES];
+
+	/* Connections established with the controller, and lost. */
+	uint64_t connects;
+	uint64_t disconnects;
+
+	/* Delay of the jobs, and time from enqueue to socket of messages. */
+	struct em_hist lateness;
+	struct em_hist wire;
+
+	/* Time spent in the wrapper operations, and calls over the budget. */
+	struct em_hist ops[EM_OP_MAX];
+	uint64_t       ops_over[EM_OP_MAX];
+
+	/* Round trip times with the controller, in us. */
+	struct em_hist rtt;
+	uint32_t       rtt_min;
+	uint32_t       rtt_last;
+	uint32_t       rtt_jitter;
+
+	/* CPU clocks of the threads, valid while the bit of the thread is set
+	 * in 'cpu_on'.
+	 */
+	clockid_t cpu[STATS_THREADS];
+	uint32_t  cpu_on;
+};
+
+/* Account a message, or a batch of messages, sent (tx = 1) or received. */
+void stats_msg(struct stats_context * sc, int tx, char * msg, unsigned int size);
+
+/* Account a job performed. */
+void stats_job(struct stats_context * sc, int type);
+
+/* Account a round trip with the controller, in us. */
+void stats_rtt(struct stats_context * sc, int64_t us);
+
+/* Register the calling thread for CPU accounting (on = 1), or remove it before
+ * it exits.
+ */
+void stats_thread(struct stats_context * sc, int thr, int on);
+
+/* Raise a counter to a value if it is lower; more threads can do it at once. */
+void stats_peak(uint64_t * c, uint64_t v);
+
+/* Add a value, in us, to an histogram. */
+void stats_hist(struct em_hist * h, uint64_t us);
+
+/* Copy the counters of the context into the metrics given to the user. */
+void stats_read(struct stats_context * sc, struct em_stats * st);
+
+#endif /* __EMAGE_STATS_H */
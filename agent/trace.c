@@ -0,0 +1,245 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal tracing logic.
+ *
+ * Events are small fixed records written in a ring by any thread: a slot is
+ * claimed with an atomic increment and stamped once filled, so recording takes
+ * no lock and costs a clock read and a few stores. The dump copies the slots
+ * and keeps only those whose stamp did not change during the copy.
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <emlog.h>
+
+#include "agent.h"
+#include "trace.h"
+
+/* Thread recording the events; see 'em_trace_thread'. */
+static __thread int trace_thr;
+
+/* Dumps requested by signal. */
+static volatile uint32_t trace_signals;
+
+void trace_thread(int thread)
+{
+	trace_thr = thread;
+}
+
+void trace_event(
+	struct trace_context * tc,
+	int type,
+	uint32_t seq,
+	uint32_t job,
+	uint32_t arg)
+{
+	struct em_trace_ev * e;
+	struct timespec      now;
+	uint32_t             i;
+
+	if(!tc->evs) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	i = __atomic_fetch_add(&tc->next, 1, __ATOMIC_RELAXED);
+	e = &tc->evs[i & tc->mask];
+
+	__atomic_store_n(&e->stamp, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	e->ts     = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	e->seq    = seq;
+	e->job    = job;
+	e->arg    = arg;
+	e->type   = type;
+	e->thread = trace_thr;
+
+	__atomic_store_n(&e->stamp, i + 1, __ATOMIC_RELEASE);
+}
+
+int trace_copy(struct trace_context * tc, int enb_id, struct trace_copy * c)
+{
+	struct em_trace_ev * e;
+
+	uint32_t n;
+	uint32_t i;
+	uint32_t first;
+
+	if(!tc->evs) {
+		return -1;
+	}
+
+	memset(c, 0, sizeof(struct trace_copy));
+
+	/* Out of the arena, since the agent may go away before the write. */
+	c->size = sizeof(struct em_trace_ev) * (tc->mask + 1);
+	c->evs  = mem_sys_alloc(enb_id, c->size);
+
+	if(!c->evs) {
+		EMLOG("No more memory!");
+		return -1;
+	}
+
+	n     = __atomic_load_n(&tc->next, __ATOMIC_ACQUIRE);
+	first = n > tc->mask + 1 ? n - tc->mask - 1 : 0;
+
+	for(i = first; i != n; i++) {
+		e = &tc->evs[i & tc->mask];
+
+		if(__atomic_load_n(&e->stamp, __ATOMIC_ACQUIRE) != i + 1) {
+			continue;
+		}
+
+		c->evs[c->h.count] = *e;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		/* Overwritten while copying it. */
+		if(__atomic_load_n(&e->stamp, __ATOMIC_RELAXED) != i + 1) {
+			continue;
+		}
+
+		c->h.count++;
+	}
+
+	c->h.magic   = EM_TRACE_MAGIC;
+	c->h.version = EM_TRACE_VERSION;
+	c->h.ev_size = sizeof(struct em_trace_ev);
+	c->h.enb_id  = enb_id;
+	c->h.lost    = n - c->h.count;
+
+	return 0;
+}
+
+int trace_write(struct trace_copy * c, const char * path)
+{
+	size_t size = sizeof(struct em_trace_ev) * c->h.count;
+	int    fd;
+	int    ret  = 0;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if(fd < 0) {
+		EMLOG("Cannot create the trace file %s!", path);
+		ret = -1;
+		goto out;
+	}
+
+	if(write(fd, &c->h, sizeof(c->h)) != (ssize_t)sizeof(c->h) ||
+		write(fd, c->evs, size) != (ssize_t)size) {
+
+		EMLOG("Cannot write the trace file %s!", path);
+		ret = -1;
+	}
+
+	close(fd);
+out:
+	mem_sys_free(c->h.enb_id, c->evs, c->size);
+	c->evs = 0;
+
+	return ret;
+}
+
+int trace_dump(struct trace_context * tc, int enb_id, const char * path)
+{
+	struct trace_copy c;
+
+	if(!path || trace_copy(tc, enb_id, &c)) {
+		return -1;
+	}
+
+	return trace_write(&c, path);
+}
+
+int trace_requested(struct trace_context * tc)
+{
+	uint32_t s = trace_signals;
+
+	if(s == tc->served) {
+		return 0;
+	}
+
+	tc->served = s;
+
+	return 1;
+}
+
+void trace_on_signal(int signo __attribute__((unused)))
+{
+	trace_signals++;
+}
+
+int trace_signal(int signo)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = trace_on_signal;
+	sa.sa_flags   = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	if(sigaction(signo, &sa, 0)) {
+		EMLOG("Cannot handle signal %d for the traces!", signo);
+		return -1;
+	}
+
+	return 0;
+}
+
+int trace_init(struct trace_context * tc, unsigned int size)
+{
+	unsigned int n = 1;
+
+	memset(tc, 0, sizeof(struct trace_context));
+
+	if(!size) {
+		size = TRACE_DEF_SIZE;
+	}
+
+	while(n < size) {
+		n <<= 1;
+	}
+
+	tc->evs = mem_alloc(
+		agent_mem(tc, trace),
+		EM_MEM_BUFFERS,
+		sizeof(struct em_trace_ev) * n);
+
+	if(!tc->evs) {
+		EMLOG("No more memory!");
+		return -1;
+	}
+
+	memset(tc->evs, 0, sizeof(struct em_trace_ev) * n);
+	tc->mask   = n - 1;
+	tc->served = trace_signals;
+
+	return 0;
+}
+
+int trace_release(struct trace_context * tc)
+{
+	tc->evs = 0;
+
+	return 0;
+}
@@ -0,0 +1,97 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent internal tracing logic.
+ */
+
+#ifndef __EMAGE_TRACE_INT_H
+#define __EMAGE_TRACE_INT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <emtrace.h>
+
+/* Default number of events of a trace ring. */
+#define TRACE_DEF_SIZE			4096
+
+/* Ring of the recent events of an agent. */
+struct trace_context {
+	/* Events, and their number minus one. */
+	struct em_trace_ev * evs;
+	uint32_t mask;
+	/* Events recorded so far. */
+	uint32_t next;
+
+	/* Dump requests by signal already served. */
+	uint32_t served;
+};
+
+/* Tell which thread the calling one is, for the events it records. */
+void trace_thread(int thread);
+
+/* Record an event; see 'em_trace_type'. */
+void trace_event(
+	struct trace_context * tc,
+	int type,
+	uint32_t seq,
+	uint32_t job,
+	uint32_t arg);
+
+/* Copy of a ring, to be written once the agent is not needed anymore. */
+struct trace_copy {
+	struct em_trace_hdr  h;
+	struct em_trace_ev * evs;
+	size_t               size;
+};
+
+/* Copy the events of the ring, without stopping the agent.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int trace_copy(struct trace_context * tc, int enb_id, struct trace_copy * c);
+
+/* Write a copy of a ring in a file, and release the copy.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int trace_write(struct trace_copy * c, const char * path);
+
+/* Save the ring in a file.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int trace_dump(struct trace_context * tc, int enb_id, const char * path);
+
+/* Check if a signal asked for a dump since the last check.
+ *
+ * Returns 1 if a dump is requested, 0 otherwise.
+ */
+int trace_requested(struct trace_context * tc);
+
+/* Have the given signal request a dump of all the traces. */
+int trace_signal(int signo);
+
+/* Initialize a trace context; 0 selects the default size.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int trace_init(struct trace_context * tc, unsigned int size);
+
+/* Release the resources of a trace context. */
+int trace_release(struct trace_context * tc);
+
+#endif /* __EMAGE_TRACE_INT_H */
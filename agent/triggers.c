@@ -25,146 +25,378 @@
 #include <emlog.h>
 #include <emage/emproto.h>
 
+#include "agent.h"
 #include "triggers.h"
 
-struct trigger * tr_add(
-	struct tr_context * tc,
-	int id, int mod, int type, int instance,
-	char * req, unsigned char size)
+/* Copy a trigger; the lock of the context must be held. */
+static void tr_copy(struct trigger * t, struct trigger * copy)
 {
-	struct trigger * t = tr_has_trigger_ext(tc, mod, type, instance);
+	*copy = *t;
+	INIT_LIST_HEAD(&copy->next);
 
-	if(t) {
-		EMDBG("Trigger %d already exists", type);
-		return t;
+	if(copy->req) {
+		net_msg_get(copy->req);
 	}
+}
 
-	t = malloc(sizeof(struct trigger));
+/* Look a trigger up by its keys; the lock of the context must be held. */
+static struct trigger * tr_lookup(
+	struct tr_context * tc, int mod, int type, int instance)
+{
+	struct trigger * t = 0;
 
-	if(!t) {
-		EMLOG("Not enough memory for new trigger!");
-		return 0;
+	list_for_each_entry(t, &tc->ts, next) {
+		if(t->mod == mod &&
+			t->type == type &&
+			t->instance == instance) {
+
+			return t;
+		}
 	}
 
-	memset(t, 0, sizeof(struct trigger));
+	return 0;
+}
 
-	if(req) {
-		t->req = malloc(sizeof(char) * size);
+/* Two requests ask the stack exactly the same collection? */
+static int tr_same_request(int type, struct net_msg * a, struct net_msg * b)
+{
+	switch(type) {
+	case TR_TYPE_UE_REP:
+		return 1;
+	case TR_TYPE_MAC_REP:
+		return a->macrep.interval == b->macrep.interval;
+	case TR_TYPE_UE_MEAS:
+		return a->uemeas.rnti == b->uemeas.rnti &&
+			a->uemeas.earfcn == b->uemeas.earfcn &&
+			a->uemeas.interval == b->uemeas.interval &&
+			a->uemeas.max_cells == b->uemeas.max_cells &&
+			a->uemeas.max_meas == b->uemeas.max_meas;
+	}
 
-		if(!t->req) {
-			EMLOG("Not enough memory for new trigger!");
-			free(t);
-			return 0;
+	return 0;
+}
+
+/* Look for the trigger which owns the collection of an identical request; the
+ * lock of the context must be held.
+ */
+static struct trigger * tr_lookup_collector(
+	struct tr_context * tc, int type, int instance, struct net_msg * req)
+{
+	struct trigger * t = 0;
+
+	list_for_each_entry(t, &tc->ts, next) {
+		if(!t->owner &&
+			t->type == type &&
+			t->instance == instance &&
+			t->req &&
+			tr_same_request(type, t->req, req)) {
+
+			return t;
 		}
+	}
 
-		memcpy(t->req, req, size);
-		t->size = size;
+	return 0;
+}
+
+int tr_add(
+	struct tr_context * tc,
+	int id, int mod, int type, int instance,
+	struct net_msg * req,
+	struct trigger * copy)
+{
+	struct trigger * t;
+	struct trigger * o;
+	struct trigger * n = mem_alloc(
+		agent_mem(tc, trig), EM_MEM_TRIGGERS, sizeof(struct trigger));
+
+	if(!n) {
+		EMLOG("Not enough memory for new trigger!");
+		return -1;
 	}
 
-	INIT_LIST_HEAD(&t->next);
-	t->id       = id;
-	t->mod      = mod;
-	t->type     = type;
-	t->instance = instance;
+	memset(n, 0, sizeof(struct trigger));
 
-	pthread_spin_lock(&tc->lock);
-	list_add(&t->next, &tc->ts);
-	pthread_spin_unlock(&tc->lock);
+	INIT_LIST_HEAD(&n->next);
+	n->id       = id;
+	n->mod      = mod;
+	n->type     = type;
+	n->instance = instance;
 
-	EMDBG("New trigger enabled, id=%d, type=%d", id, type);
+	lock_take(&tc->lock);
+	t = tr_lookup(tc, mod, type, instance);
 
-	return t;
+	if(t) {
+		EMDBG("Trigger %d already exists", type);
+	} else {
+		/* Reports of these triggers are identified by module and type
+		 * only, so the agent can replicate them: let an identical
+		 * request of another module share the collection already
+		 * running in the stack.
+		 */
+		if(req && (type == TR_TYPE_MAC_REP || type == TR_TYPE_UE_REP)) {
+			o = tr_lookup_collector(tc, type, instance, req);
+
+			if(o) {
+				EMDBG("Trigger %d shares collection of trigger %d",
+					id, o->id);
+
+				n->owner = o->id;
+			}
+		}
+
+		if(req) {
+			n->req = net_msg_get(req);
+		}
+
+		list_add(&n->next, &tc->ts);
+
+		EMDBG("New trigger enabled, id=%d, type=%d", id, type);
+
+		t = n;
+		n = 0;
+	}
+
+	if(copy) {
+		tr_copy(t, copy);
+	}
+	lock_drop(&tc->lock);
+
+	/* Not needed, since the trigger was already there. */
+	mem_free(n);
+
+	return 0;
 }
 
-int tr_del(struct tr_context * tc, int mod, int type, int instance)
+int tr_del(
+	struct tr_context * tc, int mod, int type, int instance, int * gone)
 {
 	struct trigger * t = 0;
 	struct trigger * u = 0;
+	struct trigger * s = 0;
+	struct net_msg * r;
 	int found = 0;
 
-	pthread_spin_lock(&tc->lock);
+	lock_take(&tc->lock);
 	list_for_each_entry_safe(t, u, &tc->ts, next) {
 		if(t->type == type &&
 			t->mod == mod &&
 			t->instance == instance) {
 
-			list_del(&t->next);
-			pthread_spin_unlock(&tc->lock);
+			found = 1;
+			break;
+		}
+	}
 
-			if(t->req) {
-				free(t->req);
-			}
+	if(!found) {
+		lock_drop(&tc->lock);
+		return -1;
+	}
 
-			tr_free(t);
-			return 0;
+	/* Is some other module relying on this collection? */
+	if(!t->owner) {
+		list_for_each_entry(u, &tc->ts, next) {
+			if(u->owner == t->id) {
+				s = u;
+				break;
+			}
 		}
 	}
-	pthread_spin_unlock(&tc->lock);
 
-	return -1;
+	/* Hand the collection over the first subscriber: the trigger keeps
+	 * its id, which is the one known by the wrapper, and continues to
+	 * live on behalf of the subscriber module.
+	 */
+	if(s) {
+		EMDBG("Trigger %d now collects for module %d", t->id, s->mod);
+
+		t->mod      = s->mod;
+		t->stale    = s->stale;
+		r           = t->req;
+		t->req      = s->req;
+		s->req      = r;
+
+		list_del(&s->next);
+		t = s;
+	} else {
+		list_del(&t->next);
+	}
+
+	if(gone) {
+		*gone = t->id;
+	}
+	lock_drop(&tc->lock);
+
+	tr_free(t);
+
+	return 0;
 }
 
-struct trigger * tr_find(struct tr_context * tc, int id)
+int tr_snapshot(struct tr_context * tc, int id, struct trigger * copy)
 {
 	struct trigger * t = 0;
 	int found = 0;
 
-	pthread_spin_lock(&tc->lock);
+	lock_take(&tc->lock);
 	list_for_each_entry(t, &tc->ts, next) {
 		if(t->id == id) {
-			pthread_spin_unlock(&tc->lock);
-			return t;
+			tr_copy(t, copy);
+			found = 1;
+			break;
 		}
 	}
-	pthread_spin_unlock(&tc->lock);
+	lock_drop(&tc->lock);
 
-	return 0;
+	return found ? 0 : -1;
+}
+
+int tr_snapshot_ext(
+	struct tr_context * tc,
+	int mod, int type, int instance,
+	struct trigger * copy)
+{
+	struct trigger * t;
+
+	lock_take(&tc->lock);
+	t = tr_lookup(tc, mod, type, instance);
+
+	if(t) {
+		tr_copy(t, copy);
+	}
+	lock_drop(&tc->lock);
+
+	return t ? 0 : -1;
 }
 
-struct trigger * tr_has_trigger(struct tr_context * tc, int id)
+void tr_put(struct trigger * copy)
+{
+	if(copy->req) {
+		net_msg_put(copy->req);
+		copy->req = 0;
+	}
+}
+
+int tr_has_trigger(struct tr_context * tc, int id)
 {
 	struct trigger * t = 0;
 	int found = 0;
 
-	pthread_spin_lock(&tc->lock);
+	lock_take(&tc->lock);
 	list_for_each_entry(t, &tc->ts, next) {
 		if(t->id == id) {
 			found = 1;
 			break;
 		}
 	}
-	pthread_spin_unlock(&tc->lock);
+	lock_drop(&tc->lock);
 
-	if(!found) {
-		return 0;
+	return found;
+}
+
+int tr_has_trigger_ext(
+	struct tr_context * tc, int mod, int type, int instance)
+{
+	int found;
+
+	lock_take(&tc->lock);
+	found = tr_lookup(tc, mod, type, instance) != 0;
+	lock_drop(&tc->lock);
+
+	return found;
+}
+
+int tr_stale(struct tr_context * tc)
+{
+	struct trigger * t = 0;
+
+	lock_take(&tc->lock);
+	list_for_each_entry(t, &tc->ts, next) {
+		t->stale = 1;
 	}
+	lock_drop(&tc->lock);
 
-	return t;
+	return 0;
 }
 
-struct trigger * tr_has_trigger_ext(
-	struct tr_context * tc, int mod, int type, int instance)
+int tr_resync(
+	struct tr_context * tc,
+	int mod, int type, int instance,
+	struct net_msg * req)
 {
 	struct trigger * t = 0;
 	int found = 0;
+	int same  = 0;
+	int id    = 0;
 
-	pthread_spin_lock(&tc->lock);
+	lock_take(&tc->lock);
 	list_for_each_entry(t, &tc->ts, next) {
-		if(t->mod == mod &&
+		if(t->stale &&
+			t->mod == mod &&
 			t->type == type &&
 			t->instance == instance) {
 
 			found = 1;
+			id    = t->id;
+			same  = t->req && tr_same_request(type, t->req, req);
+
+			if(same) {
+				t->stale = 0;
+			}
+
 			break;
 		}
 	}
-	pthread_spin_unlock(&tc->lock);
+	lock_drop(&tc->lock);
 
 	if(!found) {
 		return 0;
 	}
 
-	return t;
+	if(!same) {
+		EMDBG("Trigger %d changed while disconnected", id);
+
+		tr_del(tc, mod, type, instance, 0);
+		return 0;
+	}
+
+	EMDBG("Trigger %d confirmed", id);
+
+	return 1;
+}
+
+int tr_prune(struct tr_context * tc)
+{
+	struct trigger * t = 0;
+
+	int found;
+	int mod;
+	int type;
+	int instance;
+	int n = 0;
+
+	/* Go through 'tr_del', so that the collections are handed over to the
+	 * subscribers which have been confirmed.
+	 */
+	do {
+		found = 0;
+
+		lock_take(&tc->lock);
+		list_for_each_entry(t, &tc->ts, next) {
+			if(t->stale) {
+				found    = 1;
+				mod      = t->mod;
+				type     = t->type;
+				instance = t->instance;
+				break;
+			}
+		}
+		lock_drop(&tc->lock);
+
+		if(found && !tr_del(tc, mod, type, instance, 0)) {
+			n++;
+		}
+	} while(found);
+
+	return n;
 }
 
 int tr_flush(struct tr_context * tc)
@@ -172,14 +404,14 @@ int tr_flush(struct tr_context * tc)
 	struct trigger * t = 0;
 	struct trigger * u = 0;
 
-	pthread_spin_lock(&tc->lock);
+	lock_take(&tc->lock);
 	list_for_each_entry_safe(t, u, &tc->ts, next) {
 		EMDBG("Flushing out trigger %d", t->id);
 
 		list_del(&t->next);
 		tr_free(t);
 	}
-	pthread_spin_unlock(&tc->lock);
+	lock_drop(&tc->lock);
 
 	return 0;
 }
@@ -188,10 +420,10 @@ void tr_free(struct trigger * t)
 {
 	if(t) {
 		if(t->req) {
-			free(t->req);
+			net_msg_put(t->req);
 		}
 
-		free(t);
+		mem_free(t);
 	}
 }
 
@@ -209,7 +441,7 @@ int tr_next_id(struct tr_context * tc)
 			n++;
 		}
 
-		pthread_spin_lock(&tc->lock);
+		lock_take(&tc->lock);
 		list_for_each_entry(t, &tc->ts, next) {
 			if(n == t->id) {
 				n = 0;
@@ -217,7 +449,7 @@ int tr_next_id(struct tr_context * tc)
 			}
 		}
 		n = tc->next++;
-		pthread_spin_unlock(&tc->lock);
+		lock_drop(&tc->lock);
 	} while(!n);
 
 	return n;
@@ -228,7 +460,7 @@ int tr_rem(struct tr_context * tc, int id, int type)
 	struct trigger * t = 0;
 	struct trigger * u = 0;
 
-	pthread_spin_lock(&tc->lock);
+	lock_take(&tc->lock);
 	list_for_each_entry_safe(t, u, &tc->ts, next) {
 		if(t->id == id) {
 			EMDBG("Removing trigger %d", t->id);
@@ -237,7 +469,7 @@ int tr_rem(struct tr_context * tc, int id, int type)
 			break;
 		}
 	}
-	pthread_spin_unlock(&tc->lock);
+	lock_drop(&tc->lock);
 
 	return 0;
 }
@@ -21,6 +21,8 @@
 #define __EMAGE_TRIGGERS_H
 
 #include "emlist.h"
+#include "lock.h"
+#include "net.h"
 
 /* Possible type of triggers which can be created */
 enum trigger_type {
@@ -44,11 +46,18 @@ struct trigger {
 	 * distinguish between IDs of the same module.
 	 */
 	int instance;
+	/* Id of the trigger which is actually collecting the data from the
+	 * stack on behalf of this one, or 0 if this trigger owns the collection.
+	 */
+	int owner;
+
+	/* Original request message; a reference is held on it. */
+	struct net_msg * req;
 
-	/* Original request message. */
-	char * req;
-	/* Size of the original request */
-	unsigned int size;
+	/* The trigger survived a disconnection and still waits for the
+	 * controller to confirm it.
+	 */
+	int stale;
 };
 
 /* Triggering context for an agent. */
@@ -60,24 +69,53 @@ struct tr_context {
 	int next;
 
 	/* Lock for this context. */
-	pthread_spinlock_t lock;
+	lock_t lock;
 };
 
-/* Add a new trigger in the agent triggering context.
+/* Add a new trigger in the agent triggering context, unless one with the same
+ * keys is already there. If 'copy' is given, it is filled as by 'tr_snapshot'
+ * with the trigger added, or the one already there.
  *
  * By adding a trigger you make it valid, since disabled triggers are just
  * removed from the list.
+ *
+ * Returns 0 on success, a negative error code otherwise.
  */
-struct trigger * tr_add(
+int tr_add(
 	struct tr_context * tc,
 	int id, int mod, int typ, int instance,
-	char * req, unsigned char size);
+	struct net_msg * req,
+	struct trigger * copy);
 
-/* Find, remove and free a trigger */
-int tr_del(struct tr_context * tc, int mod, int type, int instance);
+/* Find, remove and free a trigger.
+ *
+ * If the trigger was collecting data on behalf of other modules, the first of
+ * them inherits the collection, so that the stack does not notice anything;
+ * the id of the trigger lives on, and the one of the subscriber goes away
+ * instead. If 'gone' is given, it is set to the id which is no longer valid.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int tr_del(
+	struct tr_context * tc, int mod, int type, int instance, int * gone);
 
-/* Find an existing trigger */
-struct trigger * tr_find(struct tr_context * tc, int id);
+/* Copy a trigger, to use it without holding the lock of the context: the
+ * trigger can be removed or handed over in the meantime. A reference on its
+ * request is taken, which 'tr_put' drops. Pointers to the triggers of the
+ * context are never given out.
+ *
+ * Returns 0 on success, a negative error code if there is no such trigger.
+ */
+int tr_snapshot(struct tr_context * tc, int id, struct trigger * copy);
+
+/* Same as 'tr_snapshot', for the trigger with the given keys. */
+int tr_snapshot_ext(
+	struct tr_context * tc,
+	int mod, int type, int instance,
+	struct trigger * copy);
+
+/* Drop what a copy of a trigger holds. */
+void tr_put(struct trigger * copy);
 
 /* Flush everything and clean the context. */
 int tr_flush(struct tr_context * tc);
@@ -85,13 +123,34 @@ int tr_flush(struct tr_context * tc);
 /* Free the resources of a trigger */
 void tr_free(struct trigger * tc);
 
-/* Peek the context to see if it has a specific trigger. */
-struct trigger * tr_has_trigger(struct tr_context * tc, int id);
+/* Peek the context to see if it has a specific trigger; returns 1 if so. */
+int tr_has_trigger(struct tr_context * tc, int id);
 
-/* Peek the context to see if it has trigger with specific keys. */
-struct trigger * tr_has_trigger_ext(
+/* Peek the context to see if it has trigger with specific keys; returns 1 if
+ * so.
+ */
+int tr_has_trigger_ext(
 	struct tr_context * tc, int mod, int type, int instance);
 
+/* Mark every trigger as to be confirmed by the controller. */
+int tr_stale(struct tr_context * tc);
+
+/* Confirm a trigger kept across a disconnection with the request which is
+ * installing it again. If the request differs, the old trigger is removed.
+ *
+ * Returns 1 if the trigger has been confirmed, 0 if a new one has to be added.
+ */
+int tr_resync(
+	struct tr_context * tc,
+	int mod, int type, int instance,
+	struct net_msg * req);
+
+/* Remove every trigger which has not been confirmed.
+ *
+ * Returns the number of triggers removed.
+ */
+int tr_prune(struct tr_context * tc);
+
 /* Acquires the next usable trigger id */
 int tr_next_id(struct tr_context * tc);
 
@@ -25,8 +25,243 @@ extern "C"
 {
 #endif /* __cplusplus */
 
+#include <stddef.h>
 #include <stdint.h>
 
+/* Summary of a measured quantity over a reporting window. */
+struct em_meas_stat {
+	int32_t min;
+	int32_t max;
+	float   mean;
+	/* Percentiles 10, 50 and 90. */
+	int32_t p10;
+	int32_t p50;
+	int32_t p90;
+	/* Exponentially weighted moving average, across the windows. */
+	float   ewma;
+};
+
+/* Summary of the measurements of a UE over a reporting window. */
+struct em_meas_summary {
+	/* UE measured. */
+	uint16_t            rnti;
+	/* Number of samples reduced. */
+	uint32_t            samples;
+
+	struct em_meas_stat rsrp;
+	struct em_meas_stat rsrq;
+};
+
+/* Controller which the agent can connect to. */
+struct em_endpoint {
+	const char *   addr;
+	unsigned short port;
+};
+
+/* What to do when the backlog of the messages to send is full. */
+enum em_backlog_policy {
+	EM_BACKLOG_DROP_OLDEST = 0,
+	EM_BACKLOG_DROP_NEWEST,
+};
+
+/* Quantities which conditions can be evaluated on. */
+enum em_cond_metric {
+	EM_COND_RSRP = 0,	/* From 'em_meas_sample' */
+	EM_COND_RSRQ,		/* From 'em_meas_sample' */
+	EM_COND_PRB_UTIL,	/* From 'em_mac_sample', in percent */
+};
+
+/* Comparison of a condition. */
+enum em_cond_op {
+	EM_COND_BELOW = 0,
+	EM_COND_ABOVE,
+};
+
+/* Condition attached to a trigger: its reports reach the controller only while
+ * the condition holds.
+ */
+struct em_cond {
+	/* Quantity evaluated; see 'em_cond_metric'. */
+	int      metric;
+	/* Comparison with the threshold; see 'em_cond_op'. */
+	int      op;
+	/* Value which the samples are compared with. */
+	int32_t  threshold;
+	/* Once holding, the condition is released only when the samples come
+	 * back beyond the threshold by more than this value.
+	 */
+	int32_t  hysteresis;
+	/* Consecutive samples needed to enter or leave the condition; 0 is
+	 * the same as 1.
+	 */
+	uint32_t count;
+};
+
+/* Operations of 'em_agent_ops', as identified in traces and metrics. */
+enum em_agent_op {
+	EM_OP_INIT = 0,
+	EM_OP_RELEASE,
+	EM_OP_DISCONNECTED,
+	EM_OP_CELL_SETUP_REQUEST,
+	EM_OP_ENB_SETUP_REQUEST,
+	EM_OP_UE_REPORT,
+	EM_OP_UE_MEASURE,
+	EM_OP_HANDOVER_UE,
+	EM_OP_MAC_REPORT,
+	EM_OP_MAC_REPORT_PULL,
+	EM_OP_UE_MEASURE_PULL,
+	EM_OP_UE_MEASURE_SUMMARY,
+	EM_OP_MAX,
+};
+
+/* Kinds of memory accounted for each agent. */
+enum em_mem_type {
+	/* Scheduled jobs and their arguments. */
+	EM_MEM_JOBS = 0,
+	/* Triggers and the state kept for them: conditions, measurement
+	 * windows, snapshots of the last reports.
+	 */
+	EM_MEM_TRIGGERS,
+	/* Messages and rings: controller messages, batches, sessions queues,
+	 * backlog and trace.
+	 */
+	EM_MEM_BUFFERS,
+	/* Anything else. */
+	EM_MEM_OTHER,
+	EM_MEM_MAX,
+};
+
+/* Number of buckets of a latency histogram. */
+#define EM_HIST_BUCKETS		240
+/* Linear buckets of an histogram per power of two, as a power of two. */
+#define EM_HIST_SUB_BITS	3
+/* Number of message types accounted, indexed by the EP_TYPE_* values. */
+#define EM_STATS_MSG_TYPES	4
+/* Number of job types accounted, indexed by the scheduler job types. */
+#define EM_STATS_JOB_TYPES	16
+/* Maximum number of report sessions accounted. */
+#define EM_STATS_SESSIONS	4
+
+/* Log-linear histogram of latencies, in us. Values below 8 have a bucket each;
+ * then every power of two is split in 8 buckets of the same width, so the
+ * error is within 12.5% up to about 71 minutes.
+ */
+struct em_hist {
+	/* Number of values, their sum and the biggest of them. */
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+
+	uint64_t buckets[EM_HIST_BUCKETS];
+};
+
+/* Report session of an agent. */
+struct em_sess_stats {
+	/* The collector is connected. */
+	int      connected;
+	/* Reports waiting to be sent, and the most there have been. */
+	uint32_t queued;
+	uint32_t queued_peak;
+	/* Reports sent, and dropped because the collector was too slow. */
+	uint64_t sent;
+	uint64_t dropped;
+};
+
+/* Runtime metrics of an agent. Counters are taken since the start of the agent,
+ * while gauges give the state at the time of the request.
+ */
+struct em_stats {
+	/* Messages and bytes sent and received, per message type. */
+	uint64_t tx_msgs[EM_STATS_MSG_TYPES];
+	uint64_t tx_bytes[EM_STATS_MSG_TYPES];
+	uint64_t rx_msgs[EM_STATS_MSG_TYPES];
+	uint64_t rx_bytes[EM_STATS_MSG_TYPES];
+
+	/* Jobs performed, per job type. */
+	uint64_t jobs[EM_STATS_JOB_TYPES];
+
+	/* Jobs in the scheduler; among them, the messages waiting to be sent
+	 * and the controller commands waiting to be performed.
+	 */
+	uint32_t sched_jobs;
+	uint32_t sched_queued;
+	uint32_t sched_commands;
+	/* Most messages and commands there have been in the scheduler. */
+	uint32_t sched_queued_peak;
+	uint32_t sched_commands_peak;
+
+	/* The agent is connected to a controller. */
+	int      connected;
+	/* Connections established with a controller and lost. */
+	uint64_t connects;
+	uint64_t disconnects;
+	/* Switches to a standby controller, and time of the last one in us. */
+	uint64_t failovers;
+	uint32_t failover_us;
+
+	/* Triggers currently installed. */
+	uint32_t triggers;
+
+	/* Reports dropped by the egress rate limit, and by degradation. */
+	uint64_t rate_dropped;
+	uint64_t rate_degraded;
+	/* Commands rejected by the admission control, and coalesced. */
+	uint64_t admit_rejected;
+	uint64_t admit_coalesced;
+
+	/* Messages in the backlog, in memory and in the spill file, and the
+	 * most there have been in memory.
+	 */
+	uint32_t backlog_msgs;
+	uint32_t backlog_peak;
+	/* Backlog messages dropped when full, expired, and spilled. */
+	uint64_t backlog_dropped;
+	uint64_t backlog_expired;
+	uint64_t backlog_spilled;
+
+	/* Report sessions. */
+	uint32_t             nof_sessions;
+	struct em_sess_stats sessions[EM_STATS_SESSIONS];
+
+	/* Delay of the jobs on the time they were due. */
+	struct em_hist lateness;
+	/* Time from the enqueue of a message to its write on the socket. */
+	struct em_hist wire;
+
+	/* Time spent in each operation of the wrapper, and number of calls
+	 * which went over the budget; see 'em_agent_op'.
+	 */
+	struct em_hist ops[EM_OP_MAX];
+	uint64_t       ops_over[EM_OP_MAX];
+
+	/* Round trip times with the controller, measured on the Hello
+	 * exchanges, in us: all of them (average and percentiles), the
+	 * smallest, the last one, and their jitter.
+	 */
+	struct em_hist rtt;
+	uint32_t       rtt_min;
+	uint32_t       rtt_last;
+	uint32_t       rtt_jitter;
+
+	/* CPU time used by the network, scheduler and sessions threads of the
+	 * agent, in us.
+	 */
+	uint64_t cpu_net;
+	uint64_t cpu_sched;
+	uint64_t cpu_sess;
+
+	/* Bytes allocated by the agent, and the most there have been, per kind
+	 * of memory; see 'em_mem_type'.
+	 */
+	uint64_t mem[EM_MEM_MAX];
+	uint64_t mem_peak[EM_MEM_MAX];
+	/* Bytes taken from the system by the agent, and allocations refused
+	 * because of its limit; see 'mem_limit' in 'em_agent_conf'.
+	 */
+	uint64_t mem_reserved;
+	uint64_t mem_refused;
+};
+
 /* Defines the operations that can be customized depending on the technology
  * where you want to embed the agent to. Such procedures will be called by the
  * agent main logic while responding to the controller orders or events
@@ -50,6 +285,8 @@ struct em_agent_ops {
 	int (* release) (void);
 
 	/* Signal the wrapper that the controller disconnected from the agent.
+	 * With a reconnection grace time, this happens only if the controller
+	 * does not come back in time, and the triggers are then disabled.
 	 *
 	 * You should take the necessary operation to ensure a coherent behavior
 	 * between the two instances.
@@ -128,6 +365,220 @@ struct em_agent_ops {
 	 * Returns 0 on success, a negative error code otherwise.
 	 */
 	int (* mac_report) (uint32_t mod, int32_t interval, int trig_id);
+
+	/*
+	 * Periodic reporting procedures:
+	 */
+
+	/* Fill the MAC report of a trigger in 'buf', which can hold up to
+	 * 'size' bytes. If this operation is provided, the agent calls it
+	 * at the interval requested by the controller, and sends the report
+	 * on behalf of the wrapper; 'mac_report' is still called once when the
+	 * trigger is enabled, but the wrapper does not need its own timer.
+	 *
+	 * Returns the length of the report, 0 if there is nothing to report, or
+	 * a negative error code.
+	 */
+	int (* mac_report_pull) (
+		uint32_t     mod,
+		int          trig_id,
+		char *       buf,
+		unsigned int size);
+
+	/* Fill the measurement report of a trigger in 'buf', which can hold up
+	 * to 'size' bytes. Works like 'mac_report_pull', using the interval of
+	 * the measurement request.
+	 *
+	 * Returns the length of the report, 0 if there is nothing to report, or
+	 * a negative error code.
+	 */
+	int (* ue_measure_pull) (
+		uint32_t     mod,
+		int          trig_id,
+		uint8_t      measure_id,
+		uint16_t     rnti,
+		char *       buf,
+		unsigned int size);
+
+	/* Fill in 'buf', which can hold up to 'size' bytes, the report of a
+	 * measurement trigger out of the summary of the samples given to the
+	 * agent with 'em_meas_sample' during the last interval. If this
+	 * operation is provided, the agent calls it once per UE at the
+	 * interval of the measurement request, and sends the report on behalf
+	 * of the wrapper.
+	 *
+	 * Returns the length of the report, 0 if there is nothing to report, or
+	 * a negative error code.
+	 */
+	int (* ue_measure_summary) (
+		uint32_t                 mod,
+		int                      trig_id,
+		struct em_meas_summary * summary,
+		char *                   buf,
+		unsigned int             size);
+};
+
+/* Optional tuning of an agent instance. Fields left to 0 keep the default
+ * behavior of the agent.
+ */
+struct em_agent_conf {
+	/* Time, in ms, a report can wait to be sent together with the other
+	 * reports of the same trigger. 0 disables the aggregation.
+	 */
+	unsigned int aggr_time;
+	/* Maximum size, in bytes, of the reports sent together; 0 selects the
+	 * default of 16KB.
+	 */
+	unsigned int aggr_size;
+
+	/* Periodic reports identical to the last one sent for the same trigger
+	 * are not sent again, and the controller keeps the values it already
+	 * has; at least one report every 'delta_keyframe' is sent anyway, as
+	 * well as the first one after a reconnection. 0 disables the delta
+	 * reporting.
+	 */
+	unsigned int delta_keyframe;
+
+	/* Maximum number of samples kept per UE and measurement trigger while
+	 * waiting for the summary; the oldest ones are overwritten. 0 selects
+	 * the default of 1024, and at most 65536 are kept.
+	 */
+	unsigned int meas_samples;
+	/* Weight, in percent, of a new sample in the moving average of the
+	 * measurements; 0 selects the default of 10.
+	 */
+	unsigned int meas_ewma;
+
+	/* Maximum number of periodic reports per second sent by the agent, and
+	 * how many of them can be sent in a burst; 0 disables the limit, and
+	 * a burst of 0 is the same as one second of reports.
+	 */
+	unsigned int rate_limit;
+	unsigned int rate_burst;
+	/* Same as above, but for the reports of every single trigger. */
+	unsigned int rate_trigger;
+	unsigned int rate_trigger_burst;
+	/* Number of messages waiting to be sent after which the periodic
+	 * reports start to be decimated, more and more as the queue grows;
+	 * replies to the controller requests are never dropped. 0 disables
+	 * the degradation.
+	 */
+	unsigned int rate_degrade;
+
+	/* Maximum number of commands per second accepted from the controller,
+	 * for every type of command, and how many of them can be accepted in
+	 * a burst; 0 disables the limit, and a burst of 0 is the same as one
+	 * second of commands.
+	 */
+	unsigned int cmd_rate;
+	unsigned int cmd_burst;
+	/* Maximum number of commands waiting to be performed; new ones are
+	 * rejected until the agent catches up. 0 disables the limit.
+	 */
+	unsigned int cmd_queue;
+
+	/* Time, in ms, the triggers and their periodic jobs are kept after the
+	 * connection with the controller is lost. Once back, the controller
+	 * confirms them by installing them again, without the wrapper being
+	 * involved, and the ones not confirmed within the same time are
+	 * removed. 0 disables the grace time: triggers are removed as soon as
+	 * the connection is lost.
+	 */
+	unsigned int reconnect_grace;
+
+	/* Size, in bytes, of the memory used to keep the messages which cannot
+	 * be sent while the controller is not connected; they are sent in
+	 * order once it is back. 0 disables the backlog, and such messages are
+	 * dropped.
+	 */
+	unsigned int backlog_size;
+	/* Message dropped when the backlog is full; see 'em_backlog_policy'. */
+	int backlog_policy;
+	/* Maximum age, in ms, of the messages sent once the controller is back;
+	 * the older ones are dropped. 0 disables the limit.
+	 */
+	unsigned int backlog_age;
+	/* File mapped in memory to keep the messages which do not fit in the
+	 * backlog, and its size in bytes; it is removed when the agent stops.
+	 * A null path or a size of 0 disables it.
+	 */
+	const char * backlog_file;
+	unsigned int backlog_file_size;
+
+	/* Other controllers to use, in order, when the current one fails; up
+	 * to 3 are used. While connected, a connection with the next one is
+	 * kept ready, so that the agent switches to it as soon as the current
+	 * one is lost.
+	 */
+	struct em_endpoint * endpoints;
+	unsigned int nof_endpoints;
+
+	/* Collectors which receive a copy of every report sent to the
+	 * controller, up to 4. They are only given reports, and never send
+	 * commands to the agent. Each one has a queue of 'session_queue'
+	 * reports (0 selects 1024); the reports which do not fit are dropped
+	 * for that collector alone.
+	 */
+	struct em_endpoint * sessions;
+	unsigned int nof_sessions;
+	unsigned int session_queue;
+	/* Time, in ms, after which a controller which does not answer is
+	 * considered lost, even if the agent has nothing to send. 0 selects 10
+	 * seconds.
+	 */
+	unsigned int link_timeout;
+	/* Hello is not sent while other messages prove that the agent is
+	 * alive, but its reply is the only round trip sample: one Hello every
+	 * 'rtt_every' Hello intervals is sent anyway. 0 selects 10.
+	 */
+	unsigned int rtt_every;
+
+	/* File, usually under /dev/shm, where the agent publishes its metrics
+	 * for monitoring processes (see emshm.h), every 'shm_interval' ms (0
+	 * selects 100 ms). A null path disables it; the file is removed when
+	 * the agent stops.
+	 */
+	const char * shm_path;
+	unsigned int shm_interval;
+
+	/* Events kept in the trace ring of the agent, rounded up to a power of
+	 * 2; 0 selects 4096. See emtrace.h.
+	 */
+	unsigned int trace_size;
+	/* Signal which makes every agent save its trace in 'trace_file',
+	 * followed by a dot and the base station id. 0 installs no handler.
+	 */
+	int          trace_signal;
+	const char * trace_file;
+
+	/* Time, in us, which an operation of the wrapper is expected to take
+	 * at most; longer calls are counted and logged. 0 disables the check.
+	 */
+	unsigned int op_budget;
+
+	/* Bytes of memory which the agent can have in use at once, the
+	 * backlog and trace included, counting each block rounded up to its
+	 * size class. Once they are all in use new jobs, triggers and messages
+	 * are refused rather than growing the heap. Released blocks are kept
+	 * for reuse, so the memory taken from the system can go beyond the
+	 * limit by what is kept. 0 means no limit.
+	 */
+	unsigned int mem_limit;
+};
+
+/* Allocator which the library uses for all its memory; see 'em_set_allocator'.
+ * 'enb_id' tells the agent which is going to use the memory, or is -1 for the
+ * memory shared by all the agents.
+ */
+struct em_allocator {
+	/* Get a block of at least 'size' bytes, aligned as done by malloc, or
+	 * a null pointer if there is no memory.
+	 */
+	void * (* alloc)(void * arg, int enb_id, size_t size);
+	/* Give back a block, with the same size asked for it. */
+	void   (* free)(void * arg, int enb_id, void * ptr, size_t size);
+	/* Passed untouched to the operations. */
+	void * arg;
 };
 
 /* Peek the triggers of the given agent and check if a trigger is enabled or
@@ -144,15 +595,79 @@ int em_has_trigger(int enb_id, int tid);
  */
 int em_is_connected(int enb_id);
 
+/* Give the agent a sample of the measurements of a UE for a measurement trigger.
+ * Samples are summarized locally and reported at the interval requested by the
+ * controller through the 'ue_measure_summary' operation. Samples of unknown
+ * triggers are rejected.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int em_meas_sample(
+	int enb_id, int trig_id, uint16_t rnti, int32_t rsrp, int32_t rsrq);
+
+/* Give the agent a sample of the MAC layer usage for a MAC report trigger, used
+ * to evaluate the conditions on the physical resource blocks utilization.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int em_mac_sample(
+	int enb_id, int trig_id, uint32_t prb_used, uint32_t prb_total);
+
+/* Attach a condition to a trigger, replacing any previous one; a null
+ * condition detaches it. Reports of the trigger, sent by the wrapper or driven
+ * by the agent, are then sent only while the condition holds for at least one
+ * UE, and a report is asked right away when it starts to hold.
+ *
+ * Reports sent with 'em_send' can be filtered only for MAC and UE reports, the
+ * other ones have to be driven by the agent.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int em_trigger_cond(int enb_id, int trig_id, struct em_cond * cond);
+
+/* Get the runtime metrics of an agent. Counters are read without stopping the
+ * agent, so they may not be consistent one with the other.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int em_get_stats(int enb_id, struct em_stats * stats);
+
+/* Save the recent events of the pipeline of an agent in a file; see emtrace.h.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int em_trace_dump(int enb_id, const char * path);
+
+/* Write in a text file the contention of every place where the agents take a
+ * lock: acquisitions, how many had to wait, and the time spent waiting for the
+ * lock and holding it. Available only if the library has been built with
+ * EM_LOCK_STATS.
+ *
+ * Returns 0 on success, a negative error code otherwise.
+ */
+int em_lock_dump(const char * path);
+
 /* Send a message to the connected controller, if any controller is attached.
  * This operations is only possible if the agent for that particular id has
  * already been created.
  *
+ * Reports of triggers shared between more controller modules are replicated
+ * for each one of them.
+ *
  * Returns 0 if the message is successfully sent, a negative error code
  * otherwise.
  */
 int em_send(int enb_id, char * msg, unsigned int size);
 
+/* Let the library take all its memory from the given allocator, rather than
+ * from malloc. It must be called before any other function of the library, and
+ * it can be called only once.
+ *
+ * Returns 0 on success, a negative error code if the library already allocated
+ * some memory or the allocator is not complete.
+ */
+int em_set_allocator(const struct em_allocator * alloc);
+
 /* Start the Empower Agent logic. This will cause the agent to start interacting
  * with a remote controller or to local events. You need to pass the technology
  * dependent callbacks and the base station identifier.
@@ -165,6 +680,18 @@ int em_start(
 	char *                ctrl_addr,
 	unsigned short        ctrl_port);
 
+/* Start the Empower Agent logic, like 'em_start', tuning the agent instance
+ * with the given configuration. A null configuration selects the defaults.
+ *
+ * Returns 0 on success, or a negative error code on failure.
+ */
+int em_start_ext(
+	int                    b_id,
+	struct em_agent_ops *  ops,
+	char *                 ctrl_addr,
+	unsigned short         ctrl_port,
+	struct em_agent_conf * conf);
+
 /* Stop the Empower Agent logic. This will cause the agent to stop to all the
  * controller commands and local events.
  *
@@ -25,17 +25,61 @@ extern "C"
 {
 #endif /* __cplusplus */
 
-#include <stdio.h>
+#include <stdint.h>
+
+/* Levels of the log messages; only the messages up to the current level are
+ * written.
+ */
+enum em_log_level {
+	EM_LOG_NONE = 0,
+	EM_LOG_INFO,
+	EM_LOG_DEBUG,
+};
+
+/* Place in the code which emits a log message; it keeps the state needed to
+ * limit the rate of the messages which repeat too often.
+ */
+struct em_log_site {
+	uint32_t window;
+	uint32_t count;
+	uint32_t suppressed;
+};
+
+/* Queue a log message of the calling thread; it is formatted in place, and then
+ * written by a background thread. The caller never waits for the output, and
+ * the message is dropped if the queue of the thread is full.
+ */
+void em_log(struct em_log_site * site, int level, const char * fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* Queue a dump of a buffer, between two lines with the given mark. The buffer
+ * is copied as it is, and only the background thread turns it in hex.
+ */
+void em_log_hex(int level, const char * mark, const char * buf, int size);
+
+/* Change the level of the messages written; see 'em_log_level'. */
+void em_log_set_level(int level);
+
+/* Write all the queued messages before returning. */
+void em_log_flush(void);
 
 /* Log routine for every feedback. */
 #define EMLOG(x, ...)                                                   \
-	printf("emage: "x"\n", ##__VA_ARGS__)
+	do {                                                            \
+		static struct em_log_site __em_site;                    \
+		em_log(&__em_site, EM_LOG_INFO,                         \
+			"emage: "x"\n", ##__VA_ARGS__);                 \
+	} while(0)
 
 #ifdef EM_DEBUG
 
 /* Debugging routine. */
 #define EMDBG(x, ...)                                                   \
-	printf("emage-debug:"x"\n", ##__VA_ARGS__)
+	do {                                                            \
+		static struct em_log_site __em_site;                    \
+		em_log(&__em_site, EM_LOG_DEBUG,                        \
+			"emage-debug:"x"\n", ##__VA_ARGS__);            \
+	} while(0)
 
 #else /* EM_DEBUG */
 
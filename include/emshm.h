@@ -0,0 +1,168 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent shared memory metrics.
+ *
+ * An agent can publish its metrics in a file mapped in memory (see the
+ * 'shm_path' field of 'em_agent_conf'), so that a monitoring process can read
+ * them as often as it wants, without calling into the base station process.
+ *
+ * The file holds a single 'em_shm' structure. Its layout changes only along
+ * with EM_SHM_VERSION, and a reader must check 'magic', 'version' and 'size'
+ * before trusting the rest. The agent updates the content under a sequence
+ * lock: 'seq' is odd while the agent writes, and a consistent copy is one
+ * taken while 'seq' stays the same even value, as done by 'em_shm_read'.
+ */
+
+#ifndef __EMAGE_SHM_H
+#define __EMAGE_SHM_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "emage.h"
+
+/* "EMSH" */
+#define EM_SHM_MAGIC		0x48534d45
+/* Version of the layout below; any change to it, or to 'em_stats', makes it
+ * grow.
+ */
+#define EM_SHM_VERSION		5
+
+struct em_shm {
+	/* Identification of the layout. */
+	uint32_t        magic;
+	uint32_t        version;
+	uint32_t        size;
+
+	/* Sequence lock; odd while the content is being updated. */
+	uint32_t        seq;
+
+	/* Base station of the agent, and process which runs it. */
+	int32_t         enb_id;
+	int32_t         pid;
+
+	/* Time of the last update, in us since the epoch. */
+	uint64_t        updated;
+	/* Time between the updates, in ms. */
+	uint32_t        interval;
+
+	/* Status of the connection with the controller: 0 means not connected,
+	 * 1 connected.
+	 */
+	int32_t         status;
+
+	/* Metrics of the agent, as given by 'em_get_stats'. */
+	struct em_stats stats;
+};
+
+/* Take a consistent copy of a segment which the agent keeps updating. No lock
+ * is taken, and the agent is never slowed down by the readers.
+ *
+ * Returns 0 on success, -1 if the segment is not valid.
+ */
+static inline int em_shm_read(const struct em_shm * shm, struct em_shm * copy)
+{
+	uint32_t s1;
+	uint32_t s2;
+
+	if(shm->magic != EM_SHM_MAGIC ||
+		shm->version != EM_SHM_VERSION ||
+		shm->size != sizeof(struct em_shm)) {
+
+		return -1;
+	}
+
+	do {
+		s1 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+
+		if(s1 & 1) {
+			continue;
+		}
+
+		memcpy(copy, (const void *)shm, sizeof(struct em_shm));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		s2 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+	} while((s1 & 1) || s1 != s2);
+
+	return 0;
+}
+
+/* Smallest value which falls in a bucket of an histogram. */
+static inline uint64_t em_hist_low(unsigned int i)
+{
+	unsigned int sub = 1 << EM_HIST_SUB_BITS;
+	unsigned int e;
+
+	if(i < sub) {
+		return i;
+	}
+
+	e = i / sub + EM_HIST_SUB_BITS - 1;
+
+	return (uint64_t)(sub + i % sub) << (e - EM_HIST_SUB_BITS);
+}
+
+/* Get the value below which the given percentage (0 to 100) of the values of
+ * an histogram falls, within the precision of its buckets. It works as well on
+ * the histograms of a copy of the segment as on those given by 'em_get_stats'.
+ *
+ * Returns the value, or 0 if the histogram is empty.
+ */
+static inline uint64_t em_hist_percentile(
+	const struct em_hist * hist, double pct)
+{
+	uint64_t     seen = 0;
+	uint64_t     want;
+	unsigned int i;
+
+	if(!hist->count) {
+		return 0;
+	}
+
+	want = (uint64_t)(hist->count * pct / 100.0 + 0.5);
+
+	if(want < 1) {
+		want = 1;
+	}
+
+	for(i = 0; i < EM_HIST_BUCKETS - 1; i++) {
+		seen += hist->buckets[i];
+
+		if(seen >= want) {
+			break;
+		}
+	}
+
+	/* Highest value of the bucket, but never above the real one. */
+	if(i == EM_HIST_BUCKETS - 1 || em_hist_low(i + 1) > hist->max) {
+		return hist->max;
+	}
+
+	return em_hist_low(i + 1) - 1;
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __EMAGE_SHM_H */
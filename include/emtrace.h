@@ -0,0 +1,102 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Empower Agent trace format.
+ *
+ * Every agent records the steps of its pipeline in a ring of binary events,
+ * which can be saved with 'em_trace_dump' or, if configured, by sending a
+ * signal to the process. A dump is an 'em_trace_hdr' followed by 'count' events, the
+ * oldest first; its layout changes only along with EM_TRACE_VERSION.
+ */
+
+#ifndef __EMAGE_TRACE_H
+#define __EMAGE_TRACE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif /* __cplusplus */
+
+#include <stdint.h>
+
+/* "EMTR" */
+#define EM_TRACE_MAGIC		0x52544d45
+#define EM_TRACE_VERSION	1
+
+/* Step of the pipeline an event marks. */
+enum em_trace_type {
+	EM_TRACE_NONE = 0,
+	/* A message arrived from the controller; 'arg' is its size. */
+	EM_TRACE_RECV,
+	/* The message has been decoded; 'arg' is its action. */
+	EM_TRACE_PARSE,
+	/* A job has been queued; 'arg' is its type. */
+	EM_TRACE_ENQUEUE,
+	/* The scheduler starts and ends a job; 'arg' is its type. */
+	EM_TRACE_JOB_BEGIN,
+	EM_TRACE_JOB_END,
+	/* An operation of the wrapper is called and returns; 'arg' is the
+	 * operation, see 'em_agent_op'.
+	 */
+	EM_TRACE_OP_BEGIN,
+	EM_TRACE_OP_END,
+	/* Data written to the controller; 'arg' is its size. */
+	EM_TRACE_SEND,
+};
+
+/* Thread an event comes from. */
+enum em_trace_thread {
+	EM_TRACE_WRAPPER = 0,
+	EM_TRACE_NET,
+	EM_TRACE_SCHED,
+};
+
+struct em_trace_ev {
+	/* Time of the event, in ns of the monotonic clock. */
+	uint64_t ts;
+	/* Position of the event in the ring, plus one; used while recording. */
+	uint32_t stamp;
+	/* Sequence number of the controller message involved, if any. */
+	uint32_t seq;
+	/* Id of the job involved, if any. */
+	uint32_t job;
+	/* Argument which depends on the type. */
+	uint32_t arg;
+	/* See 'em_trace_type' and 'em_trace_thread'. */
+	uint16_t type;
+	uint16_t thread;
+	uint32_t reserved;
+};
+
+struct em_trace_hdr {
+	uint32_t magic;
+	uint32_t version;
+	/* Size of an event. */
+	uint32_t ev_size;
+	/* Events in the dump. */
+	uint32_t count;
+	/* Base station of the agent. */
+	int32_t  enb_id;
+	uint32_t reserved;
+	/* Events overwritten before the dump. */
+	uint64_t lost;
+};
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __EMAGE_TRACE_H */
@@ -0,0 +1,248 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Monitor of the metrics which an Empower Agent publishes in shared memory.
+ *
+ * Usage: emstat <segment> [interval in ms]
+ *
+ * The segment is read without any call into the agent process; with an interval
+ * the metrics are printed again and again, until interrupted.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <emage.h>
+#include <emshm.h>
+
+/* Names of the message types, as in the protocol. */
+static const char * msg_names[EM_STATS_MSG_TYPES] = {
+	"other", "single", "schedule", "trigger"
+};
+
+/* Names of the wrapper operations; see 'em_agent_op'. */
+static const char * op_names[EM_OP_MAX] = {
+	"init", "release", "disconnected", "cell_setup", "enb_setup",
+	"ue_report", "ue_measure", "handover", "mac_report", "mac_pull",
+	"meas_pull", "meas_sum"
+};
+
+/* Names of the kinds of memory; see 'em_mem_type'. */
+static const char * mem_names[EM_MEM_MAX] = {
+	"jobs", "triggers", "buffers", "other"
+};
+
+/* Names of the jobs, in the order of the agent scheduler. */
+static const char * job_names[EM_STATS_JOB_TYPES] = {
+	"invalid", "send", "hello", "enb_setup", "cell_setup", "ue_report",
+	"ue_measure", "mac_report", "handover", "sample", "aggr", "resync",
+	"replay", "publish", 0, 0
+};
+
+void emstat_hist(const char * name, struct em_hist * h)
+{
+	printf("  %-10s n=%-10llu avg=%-8llu p50=%-8llu p90=%-8llu "
+		"p99=%-8llu max=%llu us\n",
+		name,
+		(unsigned long long)h->count,
+		(unsigned long long)(h->count ? h->sum / h->count : 0),
+		(unsigned long long)em_hist_percentile(h, 50),
+		(unsigned long long)em_hist_percentile(h, 90),
+		(unsigned long long)em_hist_percentile(h, 99),
+		(unsigned long long)h->max);
+}
+
+void emstat_print(struct em_shm * m)
+{
+	struct em_stats * s = &m->stats;
+	unsigned int      i;
+
+	printf("Agent %d (pid %d), updated at %llu.%06llu, every %u ms\n",
+		m->enb_id,
+		m->pid,
+		(unsigned long long)(m->updated / 1000000),
+		(unsigned long long)(m->updated % 1000000),
+		m->interval);
+
+	printf("Controller: %s, %llu connections, %llu losses, "
+		"%llu failovers (last %u us)\n",
+		m->status ? "connected" : "not connected",
+		(unsigned long long)s->connects,
+		(unsigned long long)s->disconnects,
+		(unsigned long long)s->failovers,
+		s->failover_us);
+
+	printf("Messages:     %12s %12s %12s %12s\n",
+		"tx msgs", "tx bytes", "rx msgs", "rx bytes");
+
+	for(i = 0; i < EM_STATS_MSG_TYPES; i++) {
+		printf("  %-10s %12llu %12llu %12llu %12llu\n",
+			msg_names[i],
+			(unsigned long long)s->tx_msgs[i],
+			(unsigned long long)s->tx_bytes[i],
+			(unsigned long long)s->rx_msgs[i],
+			(unsigned long long)s->rx_bytes[i]);
+	}
+
+	printf("Jobs: %u in queue, %u messages (peak %u), "
+		"%u commands (peak %u)\n",
+		s->sched_jobs,
+		s->sched_queued,
+		s->sched_queued_peak,
+		s->sched_commands,
+		s->sched_commands_peak);
+
+	for(i = 0; i < EM_STATS_JOB_TYPES; i++) {
+		if(!s->jobs[i]) {
+			continue;
+		}
+
+		printf("  %-10s %12llu\n",
+			job_names[i] ? job_names[i] : "unknown",
+			(unsigned long long)s->jobs[i]);
+	}
+
+	printf("Triggers: %u\n", s->triggers);
+
+	printf("Rate limit: %llu dropped, %llu degraded; "
+		"admission: %llu rejected, %llu coalesced\n",
+		(unsigned long long)s->rate_dropped,
+		(unsigned long long)s->rate_degraded,
+		(unsigned long long)s->admit_rejected,
+		(unsigned long long)s->admit_coalesced);
+
+	printf("Backlog: %u messages (peak %u), %llu dropped, %llu expired, "
+		"%llu spilled\n",
+		s->backlog_msgs,
+		s->backlog_peak,
+		(unsigned long long)s->backlog_dropped,
+		(unsigned long long)s->backlog_expired,
+		(unsigned long long)s->backlog_spilled);
+
+	for(i = 0; i < s->nof_sessions && i < EM_STATS_SESSIONS; i++) {
+		printf("Session %u: %s, %u queued (peak %u), %llu sent, "
+			"%llu dropped\n",
+			i,
+			s->sessions[i].connected ? "connected" : "not connected",
+			s->sessions[i].queued,
+			s->sessions[i].queued_peak,
+			(unsigned long long)s->sessions[i].sent,
+			(unsigned long long)s->sessions[i].dropped);
+	}
+
+	printf("CPU: net %llu us, scheduler %llu us, sessions %llu us\n",
+		(unsigned long long)s->cpu_net,
+		(unsigned long long)s->cpu_sched,
+		(unsigned long long)s->cpu_sess);
+
+	printf("Memory: %llu bytes reserved, %llu allocations refused\n",
+		(unsigned long long)s->mem_reserved,
+		(unsigned long long)s->mem_refused);
+	printf("              %12s %12s\n", "bytes", "peak");
+
+	for(i = 0; i < EM_MEM_MAX; i++) {
+		printf("  %-10s %12llu %12llu\n",
+			mem_names[i],
+			(unsigned long long)s->mem[i],
+			(unsigned long long)s->mem_peak[i]);
+	}
+
+	printf("Latencies:\n");
+	emstat_hist("lateness", &s->lateness);
+	emstat_hist("wire", &s->wire);
+
+	emstat_hist("rtt", &s->rtt);
+	printf("  %-10s min=%u last=%u jitter=%u us\n",
+		"", s->rtt_min, s->rtt_last, s->rtt_jitter);
+
+	printf("Wrapper operations:\n");
+
+	for(i = 0; i < EM_OP_MAX; i++) {
+		if(!s->ops[i].count) {
+			continue;
+		}
+
+		emstat_hist(op_names[i], &s->ops[i]);
+
+		if(s->ops_over[i]) {
+			printf("  %-10s %llu calls over the budget\n",
+				"", (unsigned long long)s->ops_over[i]);
+		}
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	struct em_shm * shm;
+	struct em_shm   copy;
+	struct timespec ts;
+
+	int interval = 0;
+	int fd;
+
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s <segment> [interval in ms]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if(argc > 2) {
+		interval = atoi(argv[2]);
+	}
+
+	fd = open(argv[1], O_RDONLY);
+
+	if(fd < 0) {
+		perror("open");
+		return 1;
+	}
+
+	shm = mmap(0, sizeof(struct em_shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(shm == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	ts.tv_sec  = interval / 1000;
+	ts.tv_nsec = (interval % 1000) * 1000000;
+
+	do {
+		if(em_shm_read(shm, &copy)) {
+			fprintf(stderr, "Not a metrics segment of version %d\n",
+				EM_SHM_VERSION);
+			return 1;
+		}
+
+		emstat_print(&copy);
+
+		if(interval) {
+			printf("\n");
+			fflush(stdout);
+			nanosleep(&ts, 0);
+		}
+	} while(interval);
+
+	munmap(shm, sizeof(struct em_shm));
+
+	return 0;
+}
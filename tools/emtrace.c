@@ -0,0 +1,167 @@
+/* Copyright (c) 2016 Kewin Rausch
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Converter of the traces of an Empower Agent to the Chrome trace event format,
+ * which can be opened by chrome://tracing or Perfetto.
+ *
+ * Usage: emtrace <trace dump> > trace.json
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <emage.h>
+#include <emtrace.h>
+
+/* Names of the threads of an agent. */
+static const char * thread_names[] = {"wrapper", "net", "sched"};
+
+/* Names of the jobs, in the order of the agent scheduler. */
+static const char * job_names[] = {
+	"invalid", "send", "hello", "enb_setup", "cell_setup", "ue_report",
+	"ue_measure", "mac_report", "handover", "sample", "aggr", "resync",
+	"replay", "publish"
+};
+
+/* Names of the wrapper operations; see 'em_agent_op'. */
+static const char * op_names[EM_OP_MAX] = {
+	"init", "release", "disconnected", "cell_setup_request",
+	"enb_setup_request", "ue_report", "ue_measure", "handover_UE",
+	"mac_report", "mac_report_pull", "ue_measure_pull",
+	"ue_measure_summary"
+};
+
+#define NAME(t, i) \
+	((i) < sizeof(t) / sizeof(t[0]) && t[i] ? t[i] : "unknown")
+
+void emtrace_event(struct em_trace_ev * e, uint64_t t0, int pid)
+{
+	const char * name;
+	const char * ph   = "i";
+	double       ts   = (e->ts - t0) / 1000.0;
+
+	switch(e->type) {
+	case EM_TRACE_RECV:
+		name = "recv";
+		break;
+	case EM_TRACE_PARSE:
+		name = "parse";
+		break;
+	case EM_TRACE_ENQUEUE:
+		name = "enqueue";
+		break;
+	case EM_TRACE_JOB_BEGIN:
+	case EM_TRACE_JOB_END:
+		name = NAME(job_names, e->arg);
+		ph   = e->type == EM_TRACE_JOB_BEGIN ? "B" : "E";
+		break;
+	case EM_TRACE_OP_BEGIN:
+	case EM_TRACE_OP_END:
+		name = NAME(op_names, e->arg);
+		ph   = e->type == EM_TRACE_OP_BEGIN ? "B" : "E";
+		break;
+	case EM_TRACE_SEND:
+		name = "send";
+		break;
+	default:
+		return;
+	}
+
+	printf(",\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,"
+		"\"pid\":%d,\"tid\":%u,%s"
+		"\"args\":{\"seq\":%u,\"job\":%u,\"arg\":%u}}",
+		name,
+		ph,
+		ts,
+		pid,
+		e->thread,
+		ph[0] == 'i' ? "\"s\":\"t\"," : "",
+		e->seq,
+		e->job,
+		e->arg);
+}
+
+int main(int argc, char ** argv)
+{
+	struct em_trace_hdr  h;
+	struct em_trace_ev * evs;
+	FILE *               f;
+	unsigned int         i;
+	uint64_t             t0 = 0;
+
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s <trace dump>\n", argv[0]);
+		return 1;
+	}
+
+	f = fopen(argv[1], "rb");
+
+	if(!f) {
+		perror("fopen");
+		return 1;
+	}
+
+	if(fread(&h, sizeof(h), 1, f) != 1 ||
+		h.magic != EM_TRACE_MAGIC ||
+		h.version != EM_TRACE_VERSION ||
+		h.ev_size != sizeof(struct em_trace_ev)) {
+
+		fprintf(stderr, "Not a trace of version %d\n", EM_TRACE_VERSION);
+		return 1;
+	}
+
+	evs = malloc(sizeof(struct em_trace_ev) * (h.count ? h.count : 1));
+
+	if(!evs || fread(evs, sizeof(struct em_trace_ev), h.count, f) !=
+		h.count) {
+
+		fprintf(stderr, "Truncated trace\n");
+		return 1;
+	}
+
+	fclose(f);
+
+	printf("{\"displayTimeUnit\":\"ns\",\"otherData\":"
+		"{\"enb_id\":%d,\"lost\":%llu},\"traceEvents\":[",
+		h.enb_id, (unsigned long long)h.lost);
+
+	/* Name the threads of the agent. */
+	for(i = 0; i < sizeof(thread_names) / sizeof(thread_names[0]); i++) {
+		printf("%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			i ? "," : "",
+			h.enb_id,
+			i,
+			thread_names[i]);
+	}
+
+	/* Threads stamp the ring out of order; start from the oldest event. */
+	for(i = 0; i < h.count; i++) {
+		if(!i || evs[i].ts < t0) {
+			t0 = evs[i].ts;
+		}
+	}
+
+	for(i = 0; i < h.count; i++) {
+		emtrace_event(&evs[i], t0, h.enb_id);
+	}
+
+	printf("\n]}\n");
+
+	free(evs);
+
+	return 0;
+}